@@ -1,49 +1,1360 @@
-﻿#include <stdio.h>
+﻿#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#ifdef _WIN32
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
-#include <time.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/sendfile.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup) && defined(STATX_BASIC_STATS)
+#define HAVE_IO_URING 1     // 小さなファイルの一括コピーに io_uring を使える
+#endif
+#endif
+#endif
 
 #define BUFFER_SIZE 4096
 #define HISTORY_FILE "history.txt"
 #define SCHEDULE_FILE "schedule.txt"
-#define MAX_ENTRIES 100      // 最大100件の履歴を処理
-#define MAX_REPLACE_LEN MAX_PATH
+#define SETTINGS_FILE "settings.txt"
+#ifndef MAX_PATH
+#define MAX_PATH PATH_MAX    // Windows 以外では OS のパス長上限を使用
+#endif
+#define COPY_BUFFER_SIZE (1024 * 1024) // read/write 方式のコピーのバッファサイズ
+#define SAMPLE_SIZE (64 * 1024)        // 同一判定で比較する先頭・末尾のサイズ
+#define COMPARE_BLOCK_SIZE (1024 * 1024) // 同一判定の全比較で一度に読み込むサイズ
+
+// ----- 内容ハッシュ -----
+// コピー中のデータから計算する 64bit の高速なチェックサム（8バイト単位で混合する）。
+// 0 は「未計算」を表すため、最終値が0になる場合は1に置き換える。
+#define CONTENT_HASH_SEED 0x9E3779B97F4A7C15ULL
+unsigned long long content_hash_update(unsigned long long h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    while (len >= 8) {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h ^= w;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+unsigned long long content_hash_final(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+// ----- プラットフォーム抽象化 -----
+// Windows では Win32 API、それ以外（Linux など）では POSIX API を使用する。
+// 成功時に非0を返す関数は Win32 API の BOOL と同じ規約に合わせている。
+#ifdef _WIN32
+#define PATH_SEP '\\'
+#define fseek64 _fseeki64
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE CondVar;
+typedef HANDLE Thread;
+#else
+#define PATH_SEP '/'
+#define fseek64 fseeko
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t CondVar;
+typedef pthread_t Thread;
+#endif
+
+// 複数スレッドから更新するカウンタ用のアトミック操作（GCC / MinGW 組み込み関数）
+#define ATOMIC_ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, expected, v) \
+    __atomic_compare_exchange_n((p), (expected), (v), 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+// スレッドごとの変数（GCC / MinGW の拡張）
+#define THREAD_LOCAL __thread
+
+void mutex_init(Mutex *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+void mutex_lock(Mutex *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+void mutex_unlock(Mutex *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+void mutex_destroy(Mutex *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+void cond_init(CondVar *c) {
+#ifdef _WIN32
+    InitializeConditionVariable(c);
+#else
+    pthread_cond_init(c, NULL);
+#endif
+}
+void cond_wait(CondVar *c, Mutex *m) {
+#ifdef _WIN32
+    SleepConditionVariableCS(c, m, INFINITE);
+#else
+    pthread_cond_wait(c, m);
+#endif
+}
+// 通知を受けるか ms ミリ秒経過するまで待機する
+void cond_timedwait(CondVar *c, Mutex *m, unsigned int ms) {
+#ifdef _WIN32
+    SleepConditionVariableCS(c, m, ms);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(c, m, &ts);
+#endif
+}
+void cond_signal(CondVar *c) {
+#ifdef _WIN32
+    WakeConditionVariable(c);
+#else
+    pthread_cond_signal(c);
+#endif
+}
+void cond_broadcast(CondVar *c) {
+#ifdef _WIN32
+    WakeAllConditionVariable(c);
+#else
+    pthread_cond_broadcast(c);
+#endif
+}
+void cond_destroy(CondVar *c) {
+#ifdef _WIN32
+    (void)c; // Windows の条件変数は破棄不要
+#else
+    pthread_cond_destroy(c);
+#endif
+}
+
+// スレッド開始用の引数（OS ごとのスレッド関数の型の違いを吸収する）
+typedef struct _ThreadStart {
+    void (*func)(void *);
+    void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+#else
+static void *thread_trampoline(void *param) {
+#endif
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// スレッドを作成する（成功で非0）
+int thread_create(Thread *thread, void (*func)(void *), void *arg) {
+    ThreadStart *start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    if (!start)
+        return 0;
+    start->func = func;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (*thread == NULL) {
+        free(start);
+        return 0;
+    }
+#else
+    if (pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+        free(start);
+        return 0;
+    }
+#endif
+    return 1;
+}
+void thread_join(Thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void sleep_ms(unsigned int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+// 論理CPUコア数を取得する
+int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+// ----- 親フォルダハンドルのキャッシュ -----
+// ファイルを操作するたびにカーネルが絶対パスの全要素を解決し直さないよう、
+// 最近使った親フォルダをスレッドごとに開いたまま保持し、*at() 系の呼び出しで末尾の名前だけを
+// 解決させる（Windows では使用しない）。ファイルはフォルダ単位でまとめて処理されるため、
+// 数件を保持すればほぼ当たり、1ファイルあたりの解決はフォルダの深さによらず1要素で済む。
+// フォルダを削除・移動したときは世代を進め、各スレッドは次の利用時にキャッシュを捨てる。
+#ifndef _WIN32
+#define DIR_CACHE_SLOTS 4
+#ifdef O_PATH
+#define DIR_CACHE_OPEN_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define DIR_CACHE_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+typedef struct _DirCacheSlot {
+    int fd;
+    size_t len;                     // 0 なら未使用
+    unsigned long long last_used;
+    char path[MAX_PATH];
+} DirCacheSlot;
+
+static THREAD_LOCAL DirCacheSlot t_dirCache[DIR_CACHE_SLOTS];
+static THREAD_LOCAL unsigned long long t_dirCacheTick = 0;
+static THREAD_LOCAL long t_dirCacheGeneration = 0;
+static long g_dirCacheGeneration = 0;
+
+static void dir_cache_clear(void) {
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (t_dirCache[i].len > 0)
+            close(t_dirCache[i].fd);
+        t_dirCache[i].len = 0;
+    }
+}
+
+// path の親フォルダのハンドルを返し、*name に末尾の名前を設定する。
+// 親フォルダを開けない場合は AT_FDCWD を返す（*name は path 全体になり、通常どおり解決される）。
+static int dir_cache_parent(const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    *name = path;
+    if (!slash || slash[1] == '\0')
+        return AT_FDCWD;
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    if (len >= MAX_PATH)
+        return AT_FDCWD;
+    long generation = ATOMIC_LOAD(&g_dirCacheGeneration);
+    if (generation != t_dirCacheGeneration) {
+        dir_cache_clear();
+        t_dirCacheGeneration = generation;
+    }
+    DirCacheSlot *victim = &t_dirCache[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        DirCacheSlot *slot = &t_dirCache[i];
+        if (slot->len == len && memcmp(slot->path, path, len) == 0) {
+            slot->last_used = ++t_dirCacheTick;
+            *name = slash + 1;
+            return slot->fd;
+        }
+        if (slot->len == 0 || (victim->len != 0 && slot->last_used < victim->last_used))
+            victim = slot;
+    }
+    char dir[MAX_PATH];
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    int fd = open(dir, DIR_CACHE_OPEN_FLAGS);
+    if (fd < 0)
+        return AT_FDCWD;
+    if (victim->len > 0)
+        close(victim->fd);
+    memcpy(victim->path, dir, len + 1);
+    victim->len = len;
+    victim->fd = fd;
+    victim->last_used = ++t_dirCacheTick;
+    *name = slash + 1;
+    return fd;
+}
+
+// path を開く（open と同じ引数）
+static int open_path(const char *path, int flags, int mode) {
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    return openat(dir, name, flags | O_CLOEXEC, mode);
+}
+#endif
+
+// フォルダを削除・移動した後に呼び、全スレッドのキャッシュを無効にする
+void dir_cache_invalidate(void) {
+#ifndef _WIN32
+    ATOMIC_ADD(&g_dirCacheGeneration, 1);
+#endif
+}
+// 呼び出したスレッドのキャッシュを閉じる（スレッド終了時）
+void dir_cache_release(void) {
+#ifndef _WIN32
+    dir_cache_clear();
+#endif
+}
+
+// パスが存在するかどうか（ファイル・フォルダ問わず）
+int path_exists(const char *path) {
+#ifdef _WIN32
+    return GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat st;
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    return fstatat(dir, name, &st, 0) == 0;
+#endif
+}
+#ifdef _WIN32
+// FILETIME（1601年からの100ナノ秒単位）を time_t に変換する
+time_t filetime_to_time(FILETIME ft) {
+    unsigned long long t = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (time_t)(t / 10000000ULL - 11644473600ULL);
+}
+#endif
+
+// ファイルのメタデータ（dev/ino が取得できない環境では 0）
+typedef struct _FileInfo {
+    unsigned long long size;
+    long long mtime;
+    unsigned long long dev;
+    unsigned long long ino;
+} FileInfo;
+
+// 成功で非0
+int get_file_info(const char *path, FileInfo *info) {
+    memset(info, 0, sizeof(*info));
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data))
+        return 0;
+    info->size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    info->mtime = (long long)filetime_to_time(data.ftLastWriteTime);
+#else
+    struct stat st;
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    if (fstatat(dir, name, &st, 0) != 0)
+        return 0;
+    info->size = (unsigned long long)st.st_size;
+    info->mtime = (long long)st.st_mtime;
+    info->dev = (unsigned long long)st.st_dev;
+    info->ino = (unsigned long long)st.st_ino;
+#endif
+    return 1;
+}
+
+int make_directory(const char *path) {
+#ifdef _WIN32
+    return CreateDirectory(path, NULL);
+#else
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    return mkdirat(dir, name, 0777) == 0;
+#endif
+}
+int delete_file(const char *path) {
+#ifdef _WIN32
+    return DeleteFile(path);
+#else
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    return unlinkat(dir, name, 0) == 0;
+#endif
+}
+int remove_directory(const char *path) {
+#ifdef _WIN32
+    int ok = RemoveDirectory(path);
+#else
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    int ok = unlinkat(dir, name, AT_REMOVEDIR) == 0;
+#endif
+    if (ok)
+        dir_cache_invalidate();
+    return ok;
+}
+// カレントディレクトリを変更する（成功で非0）
+int change_directory(const char *path) {
+#ifdef _WIN32
+    return SetCurrentDirectory(path);
+#else
+    return chdir(path) == 0;
+#endif
+}
+// 名前変更（MoveFile と同様、移動先が既に存在する場合は失敗する）。
+// 移動先の確認と名前変更の間に他から作られたファイルを上書きしないよう、renameat2 の
+// RENAME_NOREPLACE を使う。対応しないファイルシステムでは、ファイルはハードリンクを作ってから
+// 元の名前を消し、ハードリンクも作れない場合（フォルダなど）だけ存在を確かめてから名前を変更する。
+// フォルダを移動した場合は、呼び出し側で dir_cache_invalidate を呼ぶ。
+int move_path(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFile(from, to);
+#else
+    const char *from_name, *to_name;
+    int from_dir = dir_cache_parent(from, &from_name);
+    int to_dir = dir_cache_parent(to, &to_name);
+#ifdef RENAME_NOREPLACE
+    if (renameat2(from_dir, from_name, to_dir, to_name, RENAME_NOREPLACE) == 0)
+        return 1;
+    if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        return 0;
+#endif
+    struct stat st;
+    if (fstatat(from_dir, from_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return 0;
+    if (!S_ISDIR(st.st_mode)) {
+        if (linkat(from_dir, from_name, to_dir, to_name, 0) == 0) {
+            if (unlinkat(from_dir, from_name, 0) == 0)
+                return 1;
+            unlinkat(to_dir, to_name, 0);
+            return 0;
+        }
+        if (errno == EEXIST)
+            return 0;
+    }
+    if (path_exists(to))
+        return 0;
+    return renameat(from_dir, from_name, to_dir, to_name) == 0;
+#endif
+}
+// to に from のハードリンクを作成する（同じボリューム上のみ）。成功で非0
+int link_file(const char *from, const char *to) {
+#ifdef _WIN32
+    return CreateHardLink(to, from, NULL);
+#else
+    const char *from_name, *to_name;
+    int from_dir = dir_cache_parent(from, &from_name);
+    int to_dir = dir_cache_parent(to, &to_name);
+    return linkat(from_dir, from_name, to_dir, to_name, 0) == 0;
+#endif
+}
+// 2つのパスが同じボリューム（ファイルシステム）上にあれば非0
+int same_volume(const char *path1, const char *path2) {
+#ifdef _WIN32
+    char vol1[MAX_PATH], vol2[MAX_PATH];
+    if (!GetVolumePathName(path1, vol1, MAX_PATH) || !GetVolumePathName(path2, vol2, MAX_PATH))
+        return 0;
+    return _stricmp(vol1, vol2) == 0;
+#else
+    struct stat st1, st2;
+    if (stat(path1, &st1) != 0 || stat(path2, &st2) != 0)
+        return 0;
+    return st1.st_dev == st2.st_dev;
+#endif
+}
+// 名前変更（移動先が既に存在する場合は置き換える）
+int replace_file(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+    const char *from_name, *to_name;
+    int from_dir = dir_cache_parent(from, &from_name);
+    int to_dir = dir_cache_parent(to, &to_name);
+    return renameat(from_dir, from_name, to_dir, to_name) == 0;
+#endif
+}
+// 位置指定の読み書き用のファイルハンドル（大きなファイルの分割コピーで使用）。
+// direct が非0なら OS のキャッシュを通さずに読み書きする（O_DIRECT / FILE_FLAG_NO_BUFFERING）。
+// その場合、バッファ・位置・長さは DIRECT_IO_ALIGN の倍数でなければならない。
+#define DIRECT_IO_ALIGN 4096
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+#define INVALID_FILE_HANDLE INVALID_HANDLE_VALUE
+#else
+typedef int FileHandle;
+#define INVALID_FILE_HANDLE (-1)
+#endif
+
+// 読み込み用に開く
+FileHandle file_open_read(const char *path, int direct) {
+#ifdef _WIN32
+    return CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                      direct ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#else
+    int flags = O_RDONLY;
+#ifdef O_DIRECT
+    if (direct)
+        flags |= O_DIRECT;
+#else
+    if (direct)
+        return INVALID_FILE_HANDLE;
+#endif
+    return open_path(path, flags, 0);
+#endif
+}
+// 書き込み用に開く（create が非0なら作成し、既存の内容は切り詰める）
+FileHandle file_open_write(const char *path, int create, int direct) {
+#ifdef _WIN32
+    return CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                      create ? CREATE_ALWAYS : OPEN_EXISTING, direct ? FILE_FLAG_NO_BUFFERING : 0, NULL);
+#else
+    int flags = O_WRONLY | (create ? O_CREAT | O_TRUNC : 0);
+#ifdef O_DIRECT
+    if (direct)
+        flags |= O_DIRECT;
+#else
+    if (direct)
+        return INVALID_FILE_HANDLE;
+#endif
+    return open_path(path, flags, 0666);
+#endif
+}
+// 読み込み用にストリームとして開く
+FILE *file_open_stream(const char *path) {
+#ifdef _WIN32
+    return fopen(path, "rb");
+#else
+    int fd = open_path(path, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp)
+        close(fd);
+    return fp;
+#endif
+}
+// 閉じる（書き込みの完了を含めて成功なら非0）
+int file_close(FileHandle h) {
+#ifdef _WIN32
+    return CloseHandle(h);
+#else
+    return close(h) == 0;
+#endif
+}
+// offset から最大 len バイト読み込む（読み込んだバイト数、エラーは-1）
+long long file_pread(FileHandle h, void *buf, size_t len, unsigned long long offset) {
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD n = 0;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (!ReadFile(h, buf, (DWORD)len, &n, &ov))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    return n;
+#else
+    ssize_t n;
+    do {
+        n = pread(h, buf, len, (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    return n;
+#endif
+}
+// offset に len バイトすべてを書き込む（成功で非0）
+int file_pwrite(FileHandle h, const void *buf, size_t len, unsigned long long offset) {
+    const char *p = (const char*)buf;
+    while (len > 0) {
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD n = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(h, p, (DWORD)len, &n, &ov) || n == 0)
+            return 0;
+#else
+        ssize_t n = pwrite(h, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+#endif
+        p += n;
+        len -= (size_t)n;
+        offset += (unsigned long long)n;
+    }
+    return 1;
+}
+// ファイルサイズを size にする。preallocate が非0なら、可能であれば領域を先に確保する。
+int file_set_size(FileHandle h, unsigned long long size, int preallocate) {
+#ifdef _WIN32
+    (void)preallocate;
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle(h, FileEndOfFileInfo, &info, sizeof(info));
+#else
+#ifdef __linux__
+    if (preallocate && size > 0)
+        fallocate(h, 0, 0, (off_t)size);  // 非対応のファイルシステムでは無視する
+#else
+    (void)preallocate;
+#endif
+    return ftruncate(h, (off_t)size) == 0;
+#endif
+}
+// from の更新日時を to に設定する
+int file_copy_times(FileHandle from, FileHandle to) {
+#ifdef _WIN32
+    FILETIME created, accessed, written;
+    if (!GetFileTime(from, &created, &accessed, &written))
+        return 0;
+    return SetFileTime(to, NULL, &accessed, &written);
+#else
+    struct stat st;
+    if (fstat(from, &st) != 0)
+        return 0;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    return futimens(to, times) == 0;
+#endif
+}
+// 書き込んだ内容をディスクまで書き出す（成功で非0）
+int file_sync(FileHandle h) {
+#ifdef _WIN32
+    return FlushFileBuffers(h);
+#else
+    return fsync(h) == 0;
+#endif
+}
+// フォルダ内の作成・名前変更をディスクまで書き出す（Windows では何もしない）
+int sync_directory(const char *path) {
+#ifdef _WIN32
+    (void)path;
+    return 1;
+#else
+    int fd = open_path(path, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0)
+        return 0;
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+// path の更新日時を mtime（time_t の秒）にする
+int set_file_mtime(const char *path, long long mtime) {
+#ifdef _WIN32
+    HANDLE h = CreateFile(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                          FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return 0;
+    unsigned long long t = ((unsigned long long)mtime + 11644473600ULL) * 10000000ULL;
+    FILETIME ft;
+    ft.dwLowDateTime = (DWORD)t;
+    ft.dwHighDateTime = (DWORD)(t >> 32);
+    BOOL ok = SetFileTime(h, NULL, &ft, &ft);
+    CloseHandle(h);
+    return ok;
+#else
+    const char *name;
+    int dir = dir_cache_parent(path, &name);
+    struct timespec times[2] = { { (time_t)mtime, 0 }, { (time_t)mtime, 0 } };
+    return utimensat(dir, name, times, 0) == 0;
+#endif
+}
+// DIRECT_IO_ALIGN 境界に揃えたバッファを確保する
+void *aligned_buffer_alloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, DIRECT_IO_ALIGN);
+#else
+    void *p = NULL;
+    return posix_memalign(&p, DIRECT_IO_ALIGN, size) == 0 ? p : NULL;
+#endif
+}
+void aligned_buffer_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// ----- ディレクトリ列挙 -----
+// FindFirstFile/FindNextFile と opendir/readdir の差を吸収する。"." と ".." は返さない。
+// POSIX ではシンボリックリンクをたどらずに読み飛ばす（リンク先のフォルダを列挙・移動しない）。
+typedef struct _DirEntry {
+    const char *name;          // 列挙中のみ有効なエントリ名
+    int is_dir;
+    unsigned long long size;
+    time_t mtime;
+    unsigned long long ino;    // inode 番号（並べ替え用。Windows では0）
+} DirEntry;
+
+typedef struct _DirIter {
+#ifdef _WIN32
+    HANDLE hFind;
+    WIN32_FIND_DATA findData;
+    int first;
+#else
+    DIR *dir;
+#endif
+} DirIter;
+
+// 成功で非0
+int dir_open(DirIter *it, const char *path) {
+#ifdef _WIN32
+    char searchPath[MAX_PATH];
+    snprintf(searchPath, sizeof(searchPath), "%s\\*", path);
+    it->hFind = FindFirstFile(searchPath, &it->findData);
+    it->first = 1;
+    return it->hFind != INVALID_HANDLE_VALUE;
+#else
+    it->dir = opendir(path);
+    return it->dir != NULL;
+#endif
+}
+// 列挙中のフォルダ parent の子フォルダ name を開く（path はその絶対パスで、Windows ではこちらを使う）。
+// POSIX では親フォルダからの相対で開くため、深い階層でもパスの解決は1要素で済む。
+int dir_open_child(DirIter *it, const DirIter *parent, const char *name, const char *path) {
+#ifdef _WIN32
+    (void)parent;
+    (void)name;
+    return dir_open(it, path);
+#else
+    (void)path;
+    // 列挙後にシンボリックリンクへ差し替えられたフォルダをたどらない
+    int fd = openat(dirfd(parent->dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    it->dir = fdopendir(fd);
+    if (!it->dir)
+        close(fd);
+    return it->dir != NULL;
+#endif
+}
+
+// 次のエントリを取得する（終端で0）
+int dir_next(DirIter *it, DirEntry *entry) {
+#ifdef _WIN32
+    for (;;) {
+        if (!it->first && FindNextFile(it->hFind, &it->findData) == 0)
+            return 0;
+        it->first = 0;
+        const char *name = it->findData.cFileName;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        entry->name = name;
+        entry->is_dir = (it->findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        entry->size = ((unsigned long long)it->findData.nFileSizeHigh << 32) | it->findData.nFileSizeLow;
+        entry->mtime = filetime_to_time(it->findData.ftLastWriteTime);
+        entry->ino = 0;
+        return 1;
+    }
+#else
+    struct dirent *de;
+    while ((de = readdir(it->dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(it->dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || S_ISLNK(st.st_mode))
+            continue;
+        entry->name = de->d_name;
+        entry->is_dir = S_ISDIR(st.st_mode);
+        entry->size = entry->is_dir ? 0 : (unsigned long long)st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->ino = (unsigned long long)st.st_ino;
+        return 1;
+    }
+    return 0;
+#endif
+}
+void dir_close(DirIter *it) {
+#ifdef _WIN32
+    FindClose(it->hFind);
+#else
+    closedir(it->dir);
+#endif
+}
+
+// ----- 転送マニフェスト -----
+// タスクのコピー元フォルダを一度だけ列挙し、結果を連続した配列に保持する。
+// 空き容量チェック・コピー・進捗・置換処理はすべてこの一覧を参照し、再列挙は行わない。
+// 名前とフォルダの相対パスはアリーナ（大きなブロック単位の確保領域）に格納し、
+// フォルダの相対パスは1回だけ保持して各ファイルからはフォルダ番号で参照する。
+// そのため1件あたりのメモリは「固定長のエントリ + 名前の長さ」に収まる。
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define INDEX_FILE_NAME ".afm_index"  // コピー先インデックスのファイル名
+#define JOURNAL_FILE_NAME ".afm_journal"  // 再開用ジャーナルのファイル名（後ろにコピー元のハッシュが付く）
+#define PART_SUFFIX ".afm_part"  // 分割コピー中のファイルに付ける拡張子
+
+typedef struct _ArenaBlock {
+    struct _ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct _Arena {
+    ArenaBlock *head;
+    size_t reserved;    // 確保済みブロックの合計サイズ
+    size_t used;        // 実際に割り当てた合計サイズ
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!arena->head || arena->head->size - arena->head->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + block_size);
+        if (!block) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+        arena->reserved += sizeof(ArenaBlock) + block_size;
+    }
+    void *p = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    arena->used += size;
+    return p;
+}
+char *arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = (char*)arena_alloc(arena, len);
+    memcpy(copy, s, len);
+    return copy;
+}
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->reserved = 0;
+    arena->used = 0;
+}
+
+// ファイル1件分の情報
+typedef struct _ManifestEntry {
+    const char *name;           // ファイル名（アリーナ内）
+    unsigned long long size;
+    long long mtime;
+    unsigned long long ino;     // inode 番号（物理配置順の並べ替えに使う。Windows では0）
+    unsigned int dir;           // 所属フォルダ番号（Manifest.dirs の添字）
+} ManifestEntry;
+
+// フォルダ1件分の情報。列挙順（親が子より先）に並ぶ。
+typedef struct _ManifestDir {
+    const char *rel;            // コピー元フォルダからの相対パス（アリーナ内、ルートは ""）
+    const char *name;           // フォルダ名（rel の末尾を指す）
+    const char *dest_rel;       // コピー先での相対パス（フォルダ名置換後。置換しなければ rel と同じ）
+    unsigned int parent;        // 親フォルダ番号（ルートは 0）
+    unsigned int level;         // 0=コピー元フォルダ自体、1=直下のフォルダ、2以上=それ以降
+    unsigned int children;      // 直下のファイル数 + フォルダ数
+    long long mtime;
+    int scan_failed;            // 列挙に失敗したフォルダ（削除対象にしない）
+} ManifestDir;
+
+typedef struct _Manifest {
+    Arena arena;
+    ManifestEntry *files;
+    size_t file_count;
+    size_t file_capacity;
+    ManifestDir *dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+    unsigned long long total_size;
+} Manifest;
+
+static void *grow_array(void *array, size_t *capacity, size_t elem_size) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    void *p = realloc(array, new_capacity * elem_size);
+    if (!p) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return p;
+}
+
+static unsigned int manifest_add_dir(Manifest *m, unsigned int parent, const char *name, long long mtime) {
+    if (m->dir_count == m->dir_capacity)
+        m->dirs = (ManifestDir*)grow_array(m->dirs, &m->dir_capacity, sizeof(ManifestDir));
+    ManifestDir *d = &m->dirs[m->dir_count];
+    memset(d, 0, sizeof(*d));
+    if (m->dir_count == 0) {
+        d->rel = arena_strdup(&m->arena, "");
+        d->name = d->rel;
+    } else {
+        const char *parent_rel = m->dirs[parent].rel;
+        size_t plen = strlen(parent_rel), nlen = strlen(name);
+        char *rel = (char*)arena_alloc(&m->arena, plen + nlen + 2);
+        if (plen > 0) {
+            memcpy(rel, parent_rel, plen);
+            rel[plen++] = PATH_SEP;
+        }
+        memcpy(rel + plen, name, nlen + 1);
+        d->rel = rel;
+        d->name = rel + plen;
+        d->parent = parent;
+        d->level = m->dirs[parent].level + 1;
+        m->dirs[parent].children++;
+    }
+    d->dest_rel = d->rel;
+    d->mtime = mtime;
+    return (unsigned int)m->dir_count++;
+}
+
+static void manifest_add_file(Manifest *m, unsigned int dir, const DirEntry *entry) {
+    if (m->file_count == m->file_capacity)
+        m->files = (ManifestEntry*)grow_array(m->files, &m->file_capacity, sizeof(ManifestEntry));
+    ManifestEntry *e = &m->files[m->file_count++];
+    e->name = arena_strdup(&m->arena, entry->name);
+    e->size = entry->size;
+    e->mtime = (long long)entry->mtime;
+    e->ino = entry->ino;
+    e->dir = dir;
+    m->dirs[dir].children++;
+    m->total_size += entry->size;
+}
+
+// コピー先フォルダ直下の管理用ファイル（インデックス・ジャーナルとその一時ファイル）なら非0
+static int is_control_file(const char *name) {
+    return strncmp(name, INDEX_FILE_NAME, strlen(INDEX_FILE_NAME)) == 0 ||
+           strncmp(name, JOURNAL_FILE_NAME, strlen(JOURNAL_FILE_NAME)) == 0;
+}
+
+static void manifest_scan(Manifest *m, unsigned int dir, DirIter *parent, const char *name, const char *path) {
+    DirIter it;
+    DirEntry entry;
+    if (!(parent ? dir_open_child(&it, parent, name, path) : dir_open(&it, path))) {
+        m->dirs[dir].scan_failed = 1;
+        return;
+    }
+    while (dir_next(&it, &entry)) {
+        if (dir == 0 && is_control_file(entry.name))
+            continue; // コピー先インデックス・ジャーナルはコピーしない
+        if (entry.is_dir) {
+            char subPath[MAX_PATH];
+            snprintf(subPath, sizeof(subPath), "%s%c%s", path, PATH_SEP, entry.name);
+            unsigned int sub = manifest_add_dir(m, dir, entry.name, (long long)entry.mtime);
+            manifest_scan(m, sub, &it, entry.name, subPath);
+        } else {
+            manifest_add_file(m, dir, &entry);
+        }
+    }
+    dir_close(&it);
+}
+
+// ルートフォルダだけの空のマニフェストを作成する
+void manifest_init(Manifest *m) {
+    memset(m, 0, sizeof(*m));
+    manifest_add_dir(m, 0, "", 0);
+}
+
+// root 以下を列挙してマニフェストを作成する（root を開けなければ0）
+int manifest_build(Manifest *m, const char *root) {
+    manifest_init(m);
+    manifest_scan(m, 0, NULL, NULL, root);
+    return !m->dirs[0].scan_failed;
+}
+
+// 相対パス rel のファイルを、途中のフォルダとともに追加する（監視モードで届いたファイルだけを処理する場合）
+void manifest_add_path(Manifest *m, const char *rel, unsigned long long size, long long mtime) {
+    char name[MAX_PATH];
+    unsigned int dir = 0;
+    const char *p = rel, *sep;
+    while ((sep = strchr(p, PATH_SEP)) != NULL) {
+        snprintf(name, sizeof(name), "%.*s", (int)(sep - p), p);
+        unsigned int found = 0;
+        for (size_t i = 1; i < m->dir_count && !found; i++)
+            if (m->dirs[i].parent == dir && strcmp(m->dirs[i].name, name) == 0)
+                found = (unsigned int)i;
+        dir = found ? found : manifest_add_dir(m, dir, name, 0);
+        p = sep + 1;
+    }
+    DirEntry entry = { p, 0, size, (time_t)mtime, 0 };
+    manifest_add_file(m, dir, &entry);
+}
+
+void manifest_free(Manifest *m) {
+    arena_free(&m->arena);
+    free(m->files);
+    free(m->dirs);
+    memset(m, 0, sizeof(*m));
+}
+
+// マニフェストのエントリが使用しているメモリ量（バイト、未使用の確保済み領域は含まない）
+unsigned long long manifest_memory(const Manifest *m) {
+    return (unsigned long long)m->arena.used +
+           m->file_count * sizeof(ManifestEntry) +
+           m->dir_count * sizeof(ManifestDir);
+}
+
+// root を基準にフォルダ番号 dir の絶対パスを組み立てる（buf に収まらなければ0）
+int manifest_dir_path(const Manifest *m, const char *root, unsigned int dir, char *buf, size_t bufsize) {
+    const char *rel = m->dirs[dir].rel;
+    int n = rel[0] == '\0' ? snprintf(buf, bufsize, "%s", root) : snprintf(buf, bufsize, "%s%c%s", root, PATH_SEP, rel);
+    return n >= 0 && (size_t)n < bufsize;
+}
+// root を基準にフォルダ番号 dir のコピー先での絶対パス（フォルダ名置換後）を組み立てる（buf に収まらなければ0）
+int manifest_dest_dir_path(const Manifest *m, const char *root, unsigned int dir, char *buf, size_t bufsize) {
+    const char *rel = m->dirs[dir].dest_rel;
+    int n = rel[0] == '\0' ? snprintf(buf, bufsize, "%s", root) : snprintf(buf, bufsize, "%s%c%s", root, PATH_SEP, rel);
+    return n >= 0 && (size_t)n < bufsize;
+}
+// root を基準にファイル番号 index の絶対パスを組み立てる（buf に収まらなければ0）
+int manifest_file_path(const Manifest *m, const char *root, size_t index, char *buf, size_t bufsize) {
+    const ManifestEntry *e = &m->files[index];
+    const char *rel = m->dirs[e->dir].rel;
+    int n = rel[0] == '\0' ? snprintf(buf, bufsize, "%s%c%s", root, PATH_SEP, e->name)
+                           : snprintf(buf, bufsize, "%s%c%s%c%s", root, PATH_SEP, rel, PATH_SEP, e->name);
+    return n >= 0 && (size_t)n < bufsize;
+}
 
 // グローバル変数：コピー完了後にコピー元を削除するかどうか
 int g_deleteSource = 0;
 
-// ログ用ミューテックス
-HANDLE g_logMutex;
+// ログファイルへの書き込み用ミューテックス
+Mutex g_logMutex;
+
+// 同一判定の比較モード（history.txt の6列目で指定）
+typedef enum _CompareMode {
+    COMPARE_FULL,     // 既定：中身を最後まで比較して判定する
+    COMPARE_SAMPLE,   // 先頭・末尾のサンプルが一致すれば同一とみなす
+    COMPARE_META      // サイズと更新日時が一致すれば同一とみなす（中身を読まない）
+} CompareMode;
+
+// ファイルをコピーする順序（history.txt の並び順）
+typedef enum _CopyOrder {
+    ORDER_DIR,      // 列挙順（既定）
+    ORDER_INODE,    // inode 番号順
+    ORDER_EXTENT    // 先頭データの物理位置順（FIEMAP）
+} CopyOrder;
+
+// 同一判定が決着した段階
+enum {
+    COMPARE_TIER_INDEX,   // コピー先インデックスの記録と一致（データを読まない）
+    COMPARE_TIER_META,
+    COMPARE_TIER_SAMPLE,
+    COMPARE_TIER_FULL,
+    COMPARE_TIERS
+};
+
+// ファイル内容のコピー方式（詳細は「コピー方式（バックエンド）」を参照）
+typedef enum _CopyBackend {
+    BACKEND_COPYFILE,       // Windows の CopyFile
+    BACKEND_REFLINK,
+    BACKEND_COPY_RANGE,
+    BACKEND_SENDFILE,
+    BACKEND_READ_WRITE,
+    BACKEND_RANGED,         // 大きなファイルの分割並列コピー
+    BACKEND_DEDUP,          // 同じ内容のコピー済みファイルからのハードリンク・reflink（重複排除）
+    BACKEND_ARCHIVE,        // tar アーカイブへの書き込み
+    BACKEND_URING,          // io_uring による小さなファイルの一括コピー
+    BACKEND_COUNT
+} CopyBackend;
+
+const char *const g_backendNames[BACKEND_COUNT] = {
+    "CopyFile", "reflink", "copy_file_range", "sendfile", "read/write", "ranged", "dedup", "tar", "io_uring"
+};
 
 // コピータスクを表す構造体
 typedef struct _CopyTask {
-    char src[MAX_PATH];
-    char dest[MAX_PATH];
+    const char *src;                    // コピー元フォルダ（履歴のアリーナを指す）
+    const char *dest;                   // コピー先フォルダ
     unsigned long long folder_size;
+    unsigned long long copied_size;     // コピー済みサイズ（ワーカー間で原子的に加算）
+    unsigned long long range_bytes;     // 分割コピー中のファイルのコピー済みサイズ（進捗表示用）
     int task_id;
-    char replace_from[MAX_REPLACE_LEN]; // 置換前文字列（ファイル置換の場合）
-    char replace_to[MAX_REPLACE_LEN];   // 置換後文字列（ファイル置換の場合）
-    char replace_option[MAX_REPLACE_LEN]; // オプション："d"ならフォルダ名置換
+    Manifest manifest;                  // コピー元の列挙結果
+    long *dir_pending;                  // フォルダごとの未完了の子要素数
+    unsigned char *dir_moved;           // フォルダごと移動済みなら1（配下を含む）
+    int same_volume;                    // ソース削除有効かつコピー元と同じボリュームなら1（移動で処理）
+    int partial;                        // 監視モードで届いたファイルだけを処理するタスクなら1
+    unsigned char *file_failed;         // ファイルごとに失敗したら1（監視モードのみ、それ以外は NULL）
+    const struct _RenameRules *rules;   // 名前置換の規則（NULL なら置換しない）
+    CompareMode compare_mode;           // 同一判定の比較モード
+    CopyOrder copy_order;               // ファイルをコピーする順序
+    unsigned long long compare_settled[COMPARE_TIERS]; // 段階ごとの判定件数
+    struct _DestIndex *index;           // コピー先インデックス（タスク実行中のみ）
+    struct _Journal *journal;           // 再開用ジャーナル（タスク実行中のみ）
+    unsigned int *dedup_group;          // ファイルごとの重複グループ番号+1（0 なら対象外、重複排除しなければ NULL）
+    int archive;                        // コピー先が tar アーカイブ（dest はアーカイブのパス）なら1
+    unsigned long long backend_files[BACKEND_COUNT];  // コピー方式ごとのファイル数
+    unsigned long long backend_bytes[BACKEND_COUNT];  // コピー方式ごとのバイト数
+    unsigned long long backend_usec[BACKEND_COUNT];   // コピー方式ごとの転送時間（マイクロ秒）
+    struct _Telemetry *telemetry;       // スレッドごとの計測値（スロット0に合算される）
+    struct _Device *src_device;         // コピー元のデバイス（デバイス別スケジューラ）
+    struct _Device *dest_device;        // コピー先のデバイス（コピー元と同じなら NULL）
+    int telemetry_slots;
+    double start_seconds;               // タスク開始時刻（monotonic_seconds）
+    int progress_state;                 // 進捗表示用の状態（PROGRESS_WAITING など、原子的に更新）
+    unsigned long long files_done;      // 処理を終えたファイル数（原子的に加算）
+    double elapsed_seconds;             // タスクの所要時間（完了時に設定）
 } CopyTask;
 
-// ----- ログ出力用関数 -----
+// ----- 設定 -----
+#define MAX_DEVICE_LIMITS 16
+
+// device_limit で指定するデバイスごとの制限
+typedef struct _DeviceLimit {
+    char path[MAX_PATH];                // このパスが載っているデバイスに適用する
+    int streams;                        // 同時実行数（0 なら無制限）
+    unsigned long long bytes_per_sec;   // 帯域（0 なら無制限）
+} DeviceLimit;
+
+// 重複排除で重複ファイルを作る方法（dedup）
+typedef enum _DedupMode {
+    DEDUP_OFF,          // 重複排除しない（既定）
+    DEDUP_REFLINK,      // reflink（データを共有する別ファイル）
+    DEDUP_HARDLINK      // ハードリンク（同じファイルを共有する）
+} DedupMode;
+
+// settings.txt から読み込む動作設定
+typedef struct _Settings {
+    int worker_threads;   // ワーカースレッド数（0 ならCPUコア数）
+    int content_index;    // コピー先インデックスを使用するか（既定 1）
+    int log_flush_interval_ms;        // ログを書き出す間隔（0 なら1行ごとに書き込む）
+    unsigned long long log_flush_bytes; // 未書き込みのログがこのサイズを超えたら間隔を待たずに書き出す
+    char telemetry_file[MAX_PATH];      // 計測レポート（JSON）の出力先（空なら出力しない）
+    int journal;                        // 再開用ジャーナルを使用するか（既定 1）
+    unsigned long long large_file_threshold; // このサイズ以上のファイルは分割して並列にコピーする（0 なら分割しない）
+    unsigned long long range_size;      // 分割コピーの1範囲のサイズ
+    int direct_io;                      // 分割コピーで OS のキャッシュを通さずに読み書きするか（既定 0）
+    int watch;                          // 常駐してコピー元を監視するか（既定 0）
+    int watch_settle_ms;                // 最後の変更からこの時間が経てば書き込み完了とみなす
+    int watch_rescan_sec;               // 監視モードでコピー元全体を再走査する間隔
+    int hdd_streams;                    // 回転ディスク（HDD）ごとの同時実行数（0 なら無制限）
+    DeviceLimit device_limits[MAX_DEVICE_LIMITS]; // デバイスごとの制限（device_limit）
+    int device_limit_count;
+    int verify;                         // ソース削除前のコピー先の検証（0: しない / 1: 読み直す（既定） / 2: ディスクから読み直す）
+    int delete_threads;                 // 検証・削除ステージのスレッド数
+    int dedup;                          // タスクをまたいだ重複排除（DedupMode）
+    int uring_depth;                    // 小さなファイルの一括コピーの io_uring の深さ（0 なら使わない、Linux のみ）
+    char throughput_profile[MAX_PATH];  // 所要時間の見積もりに使う転送速度の記録（空なら記録しない）
+} Settings;
+
+Settings g_settings = { 0, 1, 200, 256 * 1024, "telemetry.json", 1, 1024ULL * 1024 * 1024, 64 * 1024 * 1024, 0, 0, 2000, 300, 1, { { "", 0, 0 } }, 0, 1, 2, DEDUP_OFF, 64, "throughput.txt" };
+
+// ----- ログ出力 -----
+// 各スレッドは自分の整形バッファで1行を作ってレコードにし、ロックを使わない
+// キュー（CAS で積むスタック）へ追加するだけで戻る。書き込みスレッドが log.txt を
+// 開いたまま、溜まったレコードをまとめて追記する。
+// 終了時（exit(1) による異常終了を含む）は logger_shutdown で残りをすべて書き出す。
+#define LOG_FILE "log.txt"
+#define LOG_LINE_SIZE 2048             // スレッドごとの整形バッファ（超える行は別途整形）
+#define LOG_STREAM_BUFFER (64 * 1024)  // 書き込みスレッドのファイルバッファ
+
+typedef struct _LogRecord {
+    struct _LogRecord *next;
+    size_t len;
+    char text[];
+} LogRecord;
+
+typedef struct _AsyncLogger {
+    LogRecord *head;             // 未書き込みのレコード（新しい順）
+    unsigned long long pending;  // 未書き込みのバイト数
+    FILE *fp;                    // 書き込みスレッドが開いたままにするログファイル
+    Thread thread;
+    Mutex lock;                  // 書き込みスレッドの起床通知用
+    CondVar wake;
+    int running;                 // 書き込みスレッドが動作中なら1
+    int stop;                    // 終了要求
+} AsyncLogger;
+
+AsyncLogger g_logger;
+static THREAD_LOCAL char t_logLine[LOG_LINE_SIZE];
+
+// レコードの連結リスト（新しい順）を古い順に書き込んで解放する（g_logMutex を保持して呼ぶ）
+static void log_write_records(LogRecord *list) {
+    LogRecord *ordered = NULL;
+    while (list) {
+        LogRecord *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    FILE *fp = g_logger.fp ? g_logger.fp : fopen(LOG_FILE, "a");
+    while (ordered) {
+        LogRecord *next = ordered->next;
+        if (fp)
+            fwrite(ordered->text, 1, ordered->len, fp);
+        ATOMIC_SUB(&g_logger.pending, ordered->len);
+        free(ordered);
+        ordered = next;
+    }
+    if (fp && fp != g_logger.fp)
+        fclose(fp);
+}
+
+// キューに溜まっているレコードをすべて書き出す
+static void log_drain(void) {
+    LogRecord *batch = ATOMIC_EXCHANGE(&g_logger.head, NULL);
+    if (!batch)
+        return;
+    mutex_lock(&g_logMutex);
+    log_write_records(batch);
+    if (g_logger.fp)
+        fflush(g_logger.fp);
+    mutex_unlock(&g_logMutex);
+}
+
+// 書き込みスレッド：一定間隔、または未書き込み量がしきい値を超えた時点でまとめて書き出す
+static void log_writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        mutex_lock(&g_logger.lock);
+        if (!g_logger.stop && ATOMIC_LOAD(&g_logger.pending) < g_settings.log_flush_bytes)
+            cond_timedwait(&g_logger.wake, &g_logger.lock, (unsigned int)g_settings.log_flush_interval_ms);
+        int stop = g_logger.stop;
+        mutex_unlock(&g_logger.lock);
+        log_drain();
+        if (stop)
+            break;
+    }
+}
+
+// 書き込みスレッドを停止し、残っているレコードをすべて書き出してファイルを閉じる
+void logger_shutdown(void) {
+    if (!ATOMIC_EXCHANGE(&g_logger.running, 0))
+        return;
+    mutex_lock(&g_logger.lock);
+    g_logger.stop = 1;
+    cond_signal(&g_logger.wake);
+    mutex_unlock(&g_logger.lock);
+    thread_join(g_logger.thread);
+    // 停止までの間に追加されたレコードを書き出す
+    log_drain();
+    mutex_lock(&g_logMutex);
+    fclose(g_logger.fp);
+    g_logger.fp = NULL;
+    mutex_unlock(&g_logMutex);
+}
+
+// 書き込みスレッドを開始する（log_flush_interval_ms が 0 の場合は開始せず1行ずつ書き込む）
+void logger_start(void) {
+    if (g_settings.log_flush_interval_ms <= 0)
+        return;
+    g_logger.fp = fopen(LOG_FILE, "a");
+    if (!g_logger.fp)
+        return;
+    setvbuf(g_logger.fp, NULL, _IOFBF, LOG_STREAM_BUFFER);
+    mutex_init(&g_logger.lock);
+    cond_init(&g_logger.wake);
+    ATOMIC_STORE(&g_logger.running, 1);
+    if (!thread_create(&g_logger.thread, log_writer_main, NULL)) {
+        ATOMIC_STORE(&g_logger.running, 0);
+        fclose(g_logger.fp);
+        g_logger.fp = NULL;
+        return;
+    }
+    atexit(logger_shutdown);
+}
+
 // ログメッセージを "log.txt" に追記（スレッドセーフ）
 void log_message(const char *format, ...) {
-    WaitForSingleObject(g_logMutex, INFINITE);
-    FILE *fp = fopen("log.txt", "a");
-    if (fp) {
-        va_list args;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(t_logLine, sizeof(t_logLine), format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    LogRecord *rec = (LogRecord*)malloc(sizeof(LogRecord) + (size_t)len + 1);
+    if (!rec) {
+        // メモリ不足時は整形できた範囲をその場で書き込む
+        mutex_lock(&g_logMutex);
+        FILE *fp = g_logger.fp ? g_logger.fp : fopen(LOG_FILE, "a");
+        if (fp) {
+            fputs(t_logLine, fp);
+            if (fp != g_logger.fp)
+                fclose(fp);
+        }
+        mutex_unlock(&g_logMutex);
+        return;
+    }
+    if ((size_t)len < sizeof(t_logLine)) {
+        memcpy(rec->text, t_logLine, (size_t)len);
+    } else {
         va_start(args, format);
-        vfprintf(fp, format, args);
+        vsnprintf(rec->text, (size_t)len + 1, format, args);
         va_end(args);
-        fclose(fp);
     }
-    ReleaseMutex(g_logMutex);
+    rec->len = (size_t)len;
+    unsigned long long pending = ATOMIC_ADD(&g_logger.pending, (unsigned long long)len);
+
+    if (!ATOMIC_LOAD(&g_logger.running)) {
+        // 書き込みスレッドが無い（または停止済み）場合はその場で書き込む
+        rec->next = NULL;
+        mutex_lock(&g_logMutex);
+        log_write_records(rec);
+        mutex_unlock(&g_logMutex);
+        return;
+    }
+
+    LogRecord *head = ATOMIC_LOAD(&g_logger.head);
+    do {
+        rec->next = head;
+    } while (!ATOMIC_CAS(&g_logger.head, &head, rec));
+
+    // 追加と停止が競合した場合、停止側の最終書き出しに間に合わなかった分は自分で書き出す
+    if (!ATOMIC_LOAD(&g_logger.running)) {
+        log_drain();
+        return;
+    }
+    if (pending >= g_settings.log_flush_bytes && pending - (unsigned long long)len < g_settings.log_flush_bytes) {
+        mutex_lock(&g_logger.lock);
+        cond_signal(&g_logger.wake);
+        mutex_unlock(&g_logger.lock);
+    }
 }
 
 // ----- ユーティリティ関数 -----
@@ -61,391 +1372,7297 @@ void trim(char *str) {
     }
 }
 
-// サイズを適切な単位（B, KB, MB, GB, TB, PB）でフォーマットする関数（1024単位）
-char* format_size(unsigned long long size, char *buf, size_t bufsize) {
-    const char* units[] = {"B", "KB", "MB", "GB", "TB", "PB"};
-    int unit_index = 0;
-    double dsize = (double) size;
-    while (dsize >= 1024 && unit_index < 5) {
-        dsize /= 1024;
-        unit_index++;
+// サイズを適切な単位（B, KB, MB, GB, TB, PB）でフォーマットする関数（1024単位）
+char* format_size(unsigned long long size, char *buf, size_t bufsize) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB", "PB"};
+    int unit_index = 0;
+    double dsize = (double) size;
+    while (dsize >= 1024 && unit_index < 5) {
+        dsize /= 1024;
+        unit_index++;
+    }
+    snprintf(buf, bufsize, "%.2f %s", dsize, units[unit_index]);
+    return buf;
+}
+
+// 日時を ctime と同じ形式（末尾の改行を含む）にする。ctime と違い複数のスレッドから呼べる
+char *format_time(time_t t, char *buf, size_t bufsize) {
+    struct tm tm;
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+    strftime(buf, bufsize, "%a %b %d %H:%M:%S %Y\n", &tm);
+    return buf;
+}
+
+// パスが tar アーカイブ（".tar" で終わる）なら非0
+int is_archive_path(const char *path) {
+    size_t len = strlen(path);
+    return len > 4 && path[len - 4] == '.' && tolower((unsigned char)path[len - 3]) == 't' &&
+           tolower((unsigned char)path[len - 2]) == 'a' && tolower((unsigned char)path[len - 1]) == 'r';
+}
+
+// タスクのコピー先として作成・空き容量の確認を行うフォルダ（アーカイブならそれを置くフォルダ）
+const char *dest_root_path(const char *dest, char *buf, size_t bufsize) {
+    if (!is_archive_path(dest))
+        return dest;
+    snprintf(buf, bufsize, "%s", dest);
+    char *sep = strrchr(buf, PATH_SEP);
+    if (!sep)
+        snprintf(buf, bufsize, ".");
+    else if (sep == buf)
+        sep[1] = '\0';
+    else
+        *sep = '\0';
+    return buf;
+}
+
+// 単調増加する時刻（秒）。経過時間の計測に使用する。
+double monotonic_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// ----- 進捗表示 -----
+// コピー中の画面表示は専用の表示スレッドだけが行う。ワーカーはタスクの原子的なカウンタ
+// （copied_size・range_bytes・files_done）を加算するだけで、進捗のために標準出力に触れない。
+// タスクの表示中は、ワーカーからのメッセージ（"[新規コピー] ..." など）も console_printf で
+// ロックを使わないキュー（CAS で積むスタック）に追加するだけで戻り、表示スレッドがまとめて出力する。
+// 表示スレッドは一定間隔で、端末ならタスクごとと全体の状態（進捗率・速度・残り時間）を
+// 画面下部に描き直し、端末でない（ファイルにリダイレクトした）場合は一定間隔で進捗を1行ずつ出力する。
+#define PROGRESS_REFRESH_MS 200         // 表示の更新間隔
+#define PROGRESS_LINE_INTERVAL_SEC 5.0  // 端末でない場合に進捗行を出力する間隔
+#define PROGRESS_MAX_ROWS 8             // 端末に状態を表示するタスク数の上限（残りはまとめて件数だけ表示）
+#define PROGRESS_RATE_WEIGHT 0.3        // 速度の移動平均で最新の値に与える重み
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+enum {
+    PROGRESS_WAITING,   // 開始前
+    PROGRESS_RUNNING,   // コピー中
+    PROGRESS_DONE       // 完了
+};
+
+typedef struct _ProgressView {
+    Mutex lock;                     // 表示対象の変更と描画（ワーカーは使わない）
+    CondVar wake;
+    CopyTask **tasks;               // 表示対象のタスク
+    unsigned long long *prev_bytes; // 前回の描画時点の完了バイト数
+    double *rates;                  // タスクごとの速度（バイト/秒、移動平均）
+    int count;
+    int capacity;
+    double prev_time;               // 前回速度を計算した時刻
+    double last_line;               // 端末でない場合に最後に進捗行を出力した時刻
+    int drawn_rows;                 // 画面下部に描いている状態表示の行数
+    int tty;                        // 標準出力が端末なら1
+    LogRecord *messages;            // 未出力のメッセージ（新しい順）
+    Thread thread;
+    int running;                    // 表示スレッドが動作中なら1
+    int active;                     // タスクを表示中なら1（このときだけメッセージをキューに入れる）
+    int stop;
+} ProgressView;
+
+ProgressView g_progress;
+static THREAD_LOCAL char t_consoleLine[LOG_LINE_SIZE];
+
+// 出力をまとめる可変長の文字列
+typedef struct _TextBuffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+} TextBuffer;
+
+static void text_append(TextBuffer *b, const char *text, size_t len) {
+    if (b->len + len + 1 > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->len + len + 1)
+            capacity *= 2;
+        char *p = (char*)realloc(b->data, capacity);
+        if (!p)
+            return;     // 表示できなくてもコピーは続ける
+        b->data = p;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->len, text, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+static void text_printf(TextBuffer *b, const char *format, ...) {
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+        text_append(b, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+// 残り時間を "時:分:秒" にする（速度が分からなければ "--:--:--"）
+static char *format_eta(unsigned long long remaining, double rate, char *buf, size_t bufsize) {
+    if (rate <= 0) {
+        snprintf(buf, bufsize, "--:--:--");
+    } else {
+        unsigned long long sec = (unsigned long long)(remaining / rate);
+        snprintf(buf, bufsize, "%llu:%02llu:%02llu", sec / 3600, sec / 60 % 60, sec % 60);
+    }
+    return buf;
+}
+
+static unsigned long long progress_task_bytes(const CopyTask *task) {
+    return ATOMIC_LOAD(&task->copied_size) + ATOMIC_LOAD(&task->range_bytes);
+}
+
+// 1タスク分の状態の行
+static void progress_task_line(TextBuffer *b, const char *prefix, const CopyTask *task, double rate) {
+    char done_buf[64], total_buf[64], rate_buf[64], eta_buf[32];
+    int state = ATOMIC_LOAD(&task->progress_state);
+    unsigned long long done = progress_task_bytes(task);
+    unsigned long long files = ATOMIC_LOAD(&task->files_done);
+    format_size(task->folder_size, total_buf, sizeof(total_buf));
+    if (state == PROGRESS_WAITING) {
+        text_printf(b, "%s[タスク %d] 待機中  %s  %zu 件\n", prefix, task->task_id, total_buf, task->manifest.file_count);
+    } else if (state == PROGRESS_DONE) {
+        text_printf(b, "%s[タスク %d] 完了  %s  %llu 件\n", prefix, task->task_id, total_buf, files);
+    } else {
+        if (done > task->folder_size)
+            done = task->folder_size;
+        text_printf(b, "%s[タスク %d] %5.1f%%  %s / %s  %s/s  残り %s  (%llu/%zu 件)\n", prefix, task->task_id,
+                    task->folder_size ? (double)done / task->folder_size * 100 : 100.0,
+                    format_size(done, done_buf, sizeof(done_buf)), total_buf,
+                    format_size((unsigned long long)rate, rate_buf, sizeof(rate_buf)),
+                    format_eta(task->folder_size - done, rate, eta_buf, sizeof(eta_buf)), files, task->manifest.file_count);
+    }
+}
+
+// タスクごとの速度を更新し、状態表示の行を b に追加する。追加した行数を返す。
+static int progress_status(TextBuffer *b, const char *prefix, int limit_rows) {
+    double now = monotonic_seconds();
+    double dt = now - g_progress.prev_time;
+    int update = dt >= 0.05;
+    unsigned long long total = 0, done = 0, files = 0;
+    size_t file_total = 0;
+    double rate = 0;
+    int running = 0, finished = 0, rows = 0, hidden = 0;
+    for (int i = 0; i < g_progress.count; i++) {
+        CopyTask *task = g_progress.tasks[i];
+        unsigned long long bytes = progress_task_bytes(task);
+        if (update) {
+            double inst = bytes >= g_progress.prev_bytes[i] ? (bytes - g_progress.prev_bytes[i]) / dt : 0;
+            g_progress.rates[i] = g_progress.rates[i] > 0
+                                ? g_progress.rates[i] * (1 - PROGRESS_RATE_WEIGHT) + inst * PROGRESS_RATE_WEIGHT : inst;
+            g_progress.prev_bytes[i] = bytes;
+        }
+        int state = ATOMIC_LOAD(&task->progress_state);
+        total += task->folder_size;
+        done += bytes < task->folder_size ? bytes : task->folder_size;
+        files += ATOMIC_LOAD(&task->files_done);
+        file_total += task->manifest.file_count;
+        if (state == PROGRESS_RUNNING) {
+            rate += g_progress.rates[i];
+            running++;
+        } else if (state == PROGRESS_DONE) {
+            finished++;
+        }
+    }
+    if (update)
+        g_progress.prev_time = now;
+    // 実行中のタスクを優先して表示する
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < g_progress.count; i++) {
+            int state = ATOMIC_LOAD(&g_progress.tasks[i]->progress_state);
+            if ((pass == 0) != (state == PROGRESS_RUNNING))
+                continue;
+            if (limit_rows && rows >= PROGRESS_MAX_ROWS) {
+                hidden++;
+                continue;
+            }
+            if (!limit_rows && state != PROGRESS_RUNNING)
+                continue;   // 行出力では実行中のタスクだけを出す
+            progress_task_line(b, prefix, g_progress.tasks[i], g_progress.rates[i]);
+            rows++;
+        }
+    }
+    if (hidden > 0) {
+        text_printf(b, "%s他 %d 件のタスク\n", prefix, hidden);
+        rows++;
+    }
+    if (g_progress.count > 1 || !limit_rows) {
+        char done_buf[64], total_buf[64], rate_buf[64], eta_buf[32];
+        text_printf(b, "%s全体: %5.1f%%  %s / %s  %s/s  残り %s  (%llu/%zu 件, タスク 完了 %d / 実行中 %d / 全 %d)\n",
+                    prefix, total ? (double)done / total * 100 : 100.0, format_size(done, done_buf, sizeof(done_buf)),
+                    format_size(total, total_buf, sizeof(total_buf)),
+                    format_size((unsigned long long)rate, rate_buf, sizeof(rate_buf)),
+                    format_eta(total - done, rate, eta_buf, sizeof(eta_buf)), files, file_total, finished, running,
+                    g_progress.count);
+        rows++;
+    }
+    return rows;
+}
+
+// 溜まったメッセージを出力し、状態表示を描き直す（g_progress.lock を保持して呼ぶ）。
+// final が非0なら、端末でない場合も状態を出力する。
+static void progress_render(int final) {
+    TextBuffer b = { NULL, 0, 0 };
+    LogRecord *list = ATOMIC_EXCHANGE(&g_progress.messages, NULL), *ordered = NULL;
+    while (list) {
+        LogRecord *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    if (g_progress.tty && g_progress.drawn_rows > 0 && (ordered || g_progress.count > 0)) {
+        text_printf(&b, "\x1b[%dA\r\x1b[J", g_progress.drawn_rows);
+        g_progress.drawn_rows = 0;
+    }
+    while (ordered) {
+        // 以前の "\r進捗" 表示を改行で区切るための先頭の改行は不要
+        LogRecord *next = ordered->next;
+        const char *text = ordered->text;
+        size_t len = ordered->len;
+        while (len > 0 && *text == '\n') {
+            text++;
+            len--;
+        }
+        if (len > 0) {
+            text_append(&b, text, len);
+            if (text[len - 1] != '\n')
+                text_append(&b, "\n", 1);
+        }
+        free(ordered);
+        ordered = next;
+    }
+    if (g_progress.count > 0) {
+        double now = monotonic_seconds();
+        if (g_progress.tty) {
+            g_progress.drawn_rows = progress_status(&b, "", 1);
+        } else if (final || now - g_progress.last_line >= PROGRESS_LINE_INTERVAL_SEC) {
+            progress_status(&b, "進捗 ", 0);
+            g_progress.last_line = now;
+        } else {
+            TextBuffer scratch = { NULL, 0, 0 };
+            progress_status(&scratch, "", 1);   // 速度の計算だけを進める
+            free(scratch.data);
+        }
+    }
+    if (b.len > 0) {
+        fwrite(b.data, 1, b.len, stdout);
+        fflush(stdout);
+    }
+    free(b.data);
+}
+
+// 表示スレッド：一定間隔でメッセージの出力と状態の描き直しを行う
+static void progress_main(void *arg) {
+    (void)arg;
+    mutex_lock(&g_progress.lock);
+    while (!g_progress.stop) {
+        cond_timedwait(&g_progress.wake, &g_progress.lock, PROGRESS_REFRESH_MS);
+        progress_render(0);
+    }
+    mutex_unlock(&g_progress.lock);
+}
+
+void progress_shutdown(void);
+
+// 表示スレッドを開始する（開始できなければ、メッセージはその場で出力する）
+void progress_start(void) {
+#ifdef _WIN32
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode;
+    g_progress.tty = GetConsoleMode(out, &mode) && SetConsoleMode(out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#else
+    g_progress.tty = isatty(STDOUT_FILENO);
+#endif
+    mutex_init(&g_progress.lock);
+    cond_init(&g_progress.wake);
+    g_progress.prev_time = g_progress.last_line = monotonic_seconds();
+    ATOMIC_STORE(&g_progress.running, 1);
+    if (!thread_create(&g_progress.thread, progress_main, NULL)) {
+        ATOMIC_STORE(&g_progress.running, 0);
+        return;
+    }
+    atexit(progress_shutdown);
+}
+
+// 表示スレッドを停止し、残っているメッセージと最後の状態を出力する
+void progress_shutdown(void) {
+    if (!ATOMIC_EXCHANGE(&g_progress.running, 0))
+        return;
+    mutex_lock(&g_progress.lock);
+    ATOMIC_STORE(&g_progress.active, 0);
+    g_progress.stop = 1;
+    cond_signal(&g_progress.wake);
+    mutex_unlock(&g_progress.lock);
+    thread_join(g_progress.thread);
+    mutex_lock(&g_progress.lock);
+    progress_render(1);
+    mutex_unlock(&g_progress.lock);
+}
+
+// 表示対象のタスクを設定する（前の対象は置き換える）
+void progress_track(CopyTask *tasks, int count) {
+    if (!ATOMIC_LOAD(&g_progress.running))
+        return;
+    mutex_lock(&g_progress.lock);
+    if (count > g_progress.capacity) {
+        g_progress.tasks = (CopyTask**)realloc(g_progress.tasks, sizeof(CopyTask*) * count);
+        g_progress.prev_bytes = (unsigned long long*)realloc(g_progress.prev_bytes, sizeof(unsigned long long) * count);
+        g_progress.rates = (double*)realloc(g_progress.rates, sizeof(double) * count);
+        if (!g_progress.tasks || !g_progress.prev_bytes || !g_progress.rates) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        g_progress.capacity = count;
+    }
+    for (int i = 0; i < count; i++) {
+        g_progress.tasks[i] = &tasks[i];
+        g_progress.prev_bytes[i] = progress_task_bytes(&tasks[i]);
+        g_progress.rates[i] = 0;
+    }
+    g_progress.count = count;
+    g_progress.prev_time = g_progress.last_line = monotonic_seconds();
+    ATOMIC_STORE(&g_progress.active, 1);
+    mutex_unlock(&g_progress.lock);
+}
+
+// 表示対象のタスクを外す。最後の状態を出力し、画面に残したまま次の表示に移る。
+void progress_untrack(void) {
+    if (!ATOMIC_LOAD(&g_progress.running))
+        return;
+    mutex_lock(&g_progress.lock);
+    ATOMIC_STORE(&g_progress.active, 0);
+    progress_render(1);
+    g_progress.count = 0;
+    g_progress.drawn_rows = 0;
+    mutex_unlock(&g_progress.lock);
+}
+
+// 標準出力にメッセージを出す。タスクの表示中はキューに追加するだけで戻る（スレッドセーフ）。
+void console_printf(const char *format, ...) {
+    va_list args;
+    if (!ATOMIC_LOAD(&g_progress.active)) {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    va_start(args, format);
+    int len = vsnprintf(t_consoleLine, sizeof(t_consoleLine), format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    LogRecord *rec = (LogRecord*)malloc(sizeof(LogRecord) + (size_t)len + 1);
+    if (!rec)
+        return;
+    if ((size_t)len < sizeof(t_consoleLine)) {
+        memcpy(rec->text, t_consoleLine, (size_t)len + 1);
+    } else {
+        va_start(args, format);
+        vsnprintf(rec->text, (size_t)len + 1, format, args);
+        va_end(args);
+    }
+    rec->len = (size_t)len;
+    LogRecord *head = ATOMIC_LOAD(&g_progress.messages);
+    do {
+        rec->next = head;
+    } while (!ATOMIC_CAS(&g_progress.messages, &head, rec));
+    // 追加と表示の終了が競合した場合、終了側の最終出力に間に合わなかった分は自分で出力する
+    if (!ATOMIC_LOAD(&g_progress.active)) {
+        mutex_lock(&g_progress.lock);
+        progress_render(1);
+        mutex_unlock(&g_progress.lock);
+    }
+}
+
+// ----- 作成済みコピー先フォルダのキャッシュ -----
+// 実行中に作成した（または存在を確認した）コピー先フォルダを覚えておき、
+// 同じフォルダや親フォルダの存在確認を繰り返さない。コピー先フォルダは削除しないため
+// 1回の実行の間は有効（監視モードでは処理のまとまりごとに捨てる）。
+typedef struct _DirSet {
+    Mutex lock;
+    Arena arena;
+    const char **slots;
+    size_t capacity;
+    size_t count;
+} DirSet;
+
+static DirSet g_knownDirs;
+
+static const char **dir_set_slot(DirSet *set, const char *path) {
+    size_t mask = set->capacity - 1;
+    size_t i = (size_t)content_hash_update(CONTENT_HASH_SEED, path, strlen(path)) & mask;
+    while (set->slots[i] && strcmp(set->slots[i], path) != 0)
+        i = (i + 1) & mask;
+    return &set->slots[i];
+}
+
+// path が作成済み（存在を確認済み）のフォルダなら非0
+int dir_is_known(const char *path) {
+    mutex_lock(&g_knownDirs.lock);
+    int known = g_knownDirs.count > 0 && *dir_set_slot(&g_knownDirs, path) != NULL;
+    mutex_unlock(&g_knownDirs.lock);
+    return known;
+}
+
+void dir_remember(const char *path) {
+    DirSet *set = &g_knownDirs;
+    mutex_lock(&set->lock);
+    if ((set->count + 1) * 2 > set->capacity) {
+        const char **old = set->slots;
+        size_t old_capacity = set->capacity;
+        set->capacity = old_capacity ? old_capacity * 2 : 256;
+        set->slots = (const char**)calloc(set->capacity, sizeof(const char*));
+        if (!set->slots) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i])
+                *dir_set_slot(set, old[i]) = old[i];
+        free(old);
+    }
+    const char **slot = dir_set_slot(set, path);
+    if (!*slot) {
+        *slot = arena_strdup(&set->arena, path);
+        set->count++;
+    }
+    mutex_unlock(&set->lock);
+}
+
+void dir_forget_all(void) {
+    DirSet *set = &g_knownDirs;
+    mutex_lock(&set->lock);
+    free(set->slots);
+    arena_free(&set->arena);
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    mutex_unlock(&set->lock);
+}
+
+// ----- 再帰的ディレクトリ作成関数 -----
+// 指定されたパスのディレクトリが存在しなければ、親ディレクトリも含めて再帰的に作成する
+void create_directory_recursive(const char *path) {
+    if (dir_is_known(path))
+        return;
+    if (path_exists(path)) {
+        dir_remember(path);
+        return; // すでに存在する
+    }
+    char parent[MAX_PATH];
+    strcpy(parent, path);
+    char *lastSlash = strrchr(parent, PATH_SEP);
+    if (lastSlash != NULL && lastSlash != parent) {
+        *lastSlash = '\0';
+        create_directory_recursive(parent);
+    }
+    if (!make_directory(path) && !path_exists(path)) {
+        console_printf("エラー: コピー先フォルダ %s の作成に失敗しました。\n", path);
+        log_message("エラー: コピー先フォルダ %s の作成に失敗しました。\n", path);
+        exit(1);
+    } else {
+        console_printf("コピー先フォルダ %s を作成しました。\n", path);
+    }
+    dir_remember(path);
+}
+
+// 親フォルダが存在するとわかっているフォルダを作成する。
+// 存在確認をせずにまず作成し、失敗した（既にある）場合だけ通常の手順で確認する。
+void ensure_directory(const char *path) {
+    if (dir_is_known(path))
+        return;
+    if (make_directory(path)) {
+        console_printf("コピー先フォルダ %s を作成しました。\n", path);
+        dir_remember(path);
+        return;
+    }
+    create_directory_recursive(path);
+}
+
+// ----- ディスク・フォルダ関数 -----
+// 指定パスの空き容量（バイト単位）を取得
+unsigned long long get_free_space(const char *path) {
+#ifdef _WIN32
+    ULARGE_INTEGER freeBytesAvailable, totalBytes, totalFree;
+    if (GetDiskFreeSpaceEx(path, &freeBytesAvailable, &totalBytes, &totalFree))
+        return freeBytesAvailable.QuadPart;
+#else
+    struct statvfs vfs;
+    if (statvfs(path, &vfs) == 0)
+        return (unsigned long long)vfs.f_bavail * vfs.f_frsize;
+#endif
+    return 0;
+}
+// 指定パスのボリュームの割り当て単位（バイト単位、取得できなければ4096）
+unsigned long long get_block_size(const char *path) {
+#ifdef _WIN32
+    char volume[MAX_PATH];
+    DWORD sectors, bytes, free_clusters, total_clusters;
+    if (GetVolumePathName(path, volume, MAX_PATH) &&
+        GetDiskFreeSpace(volume, &sectors, &bytes, &free_clusters, &total_clusters) && sectors * bytes > 0)
+        return (unsigned long long)sectors * bytes;
+#else
+    struct statvfs vfs;
+    if (statvfs(path, &vfs) == 0 && vfs.f_frsize > 0)
+        return (unsigned long long)vfs.f_frsize;
+#endif
+    return 4096;
+}
+// マニフェストの件数と使用メモリを表示する
+void print_manifest_summary(const Manifest *m) {
+    char mem_buf[64];
+    unsigned long long memory = manifest_memory(m);
+    size_t entries = m->file_count + m->dir_count;
+    console_printf("ファイル一覧: %llu ファイル / %llu フォルダ, 使用メモリ: %s（1件あたり %.1f B）\n",
+           (unsigned long long)m->file_count, (unsigned long long)m->dir_count,
+           format_size(memory, mem_buf, sizeof(mem_buf)),
+           entries ? (double)memory / entries : 0.0);
+}
+
+// ----- コピー方式（バックエンド） -----
+// ファイル内容の転送方法を切り替えられるようにする層。
+// Windows では CopyFile を使用する。Linux では以下の順に試し、使えない方式
+// （EXDEV / EOPNOTSUPP など）は自動的に次の方式へフォールバックする。
+//   1. reflink（FICLONE：btrfs / XFS などでデータを共有し、実データをコピーしない）
+//   2. copy_file_range（カーネル内でコピー）
+//   3. sendfile（カーネル内でコピー）
+//   4. 大きなバッファでの read/write（内容ハッシュも計算する）
+// どの方式が使えるかはファイルシステムの組み合わせで決まるため、
+// (コピー元デバイス, コピー先デバイス) ごとに最初に試す方式を覚えておく。
+// 1ファイル分のコピー結果
+typedef struct _CopyResult {
+    CopyBackend backend;        // 実際にコピーした方式
+    unsigned long long hash;    // 内容ハッシュ（計算できない方式では0）
+    double seconds;             // 転送にかかった時間
+} CopyResult;
+
+#ifndef _WIN32
+#define MAX_FS_PAIRS 64
+
+typedef struct _FsPair {
+    dev_t src_dev;
+    dev_t dest_dev;
+    int first_backend;      // この組み合わせで最初に試す方式
+} FsPair;
+
+FsPair g_fsPairs[MAX_FS_PAIRS];
+int g_fsPairCount = 0;
+Mutex g_fsPairLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int fs_pair_first_backend(dev_t src_dev, dev_t dest_dev) {
+    int first = BACKEND_REFLINK;
+    mutex_lock(&g_fsPairLock);
+    for (int i = 0; i < g_fsPairCount; i++) {
+        if (g_fsPairs[i].src_dev == src_dev && g_fsPairs[i].dest_dev == dest_dev) {
+            first = g_fsPairs[i].first_backend;
+            break;
+        }
+    }
+    mutex_unlock(&g_fsPairLock);
+    return first;
+}
+
+// この組み合わせでは backend が使えないことを記録する
+static void fs_pair_mark_unsupported(dev_t src_dev, dev_t dest_dev, int backend) {
+    mutex_lock(&g_fsPairLock);
+    int i;
+    for (i = 0; i < g_fsPairCount; i++) {
+        if (g_fsPairs[i].src_dev == src_dev && g_fsPairs[i].dest_dev == dest_dev)
+            break;
+    }
+    if (i == g_fsPairCount && g_fsPairCount < MAX_FS_PAIRS) {
+        g_fsPairs[i].src_dev = src_dev;
+        g_fsPairs[i].dest_dev = dest_dev;
+        g_fsPairs[i].first_backend = BACKEND_REFLINK;
+        g_fsPairCount++;
+    }
+    if (i < g_fsPairCount && g_fsPairs[i].first_backend <= backend)
+        g_fsPairs[i].first_backend = backend + 1;
+    mutex_unlock(&g_fsPairLock);
+}
+
+// その方式がこのファイルシステムでは使えないことを示すエラーか
+static int backend_unsupported(int err) {
+    return err == EXDEV || err == EOPNOTSUPP || err == ENOSYS || err == EINVAL || err == ENOTTY;
+}
+
+// 各方式の戻り値：1=成功、0=この方式は使えない（先頭から次の方式でやり直せる）、-1=エラー
+static int copy_by_reflink(int in, int out, unsigned long long size) {
+    (void)size;
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+        return 1;
+    return backend_unsupported(errno) ? 0 : -1;
+#else
+    (void)in;
+    (void)out;
+    return 0;
+#endif
+}
+
+static int copy_by_range(int in, int out, unsigned long long size) {
+#ifdef __linux__
+    unsigned long long done = 0;
+    while (done < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, (size_t)(size - done), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return (done == 0 && backend_unsupported(errno)) ? 0 : -1;
+        if (n == 0)
+            return -1; // コピー中にファイルが短くなった。途中までのコピーを成功にしない
+        done += (unsigned long long)n;
+    }
+    return 1;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    return 0;
+#endif
+}
+
+static int copy_by_sendfile(int in, int out, unsigned long long size) {
+#ifdef __linux__
+    unsigned long long done = 0;
+    while (done < size) {
+        ssize_t n = sendfile(out, in, NULL, (size_t)(size - done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return (done == 0 && backend_unsupported(errno)) ? 0 : -1;
+        if (n == 0)
+            return -1;
+        done += (unsigned long long)n;
+    }
+    return 1;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    return 0;
+#endif
+}
+
+// len バイトになるまで読み込む（ファイル末尾ではそれより少ない。エラーは-1）。
+// 内容ハッシュの区切りを読み込みの都合によらず一定にするため、バッファ単位でまとめて読む。
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+static int copy_by_read_write(int in, int out, unsigned long long *hash) {
+    char *buffer = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buffer)
+        return -1;
+    unsigned long long h = CONTENT_HASH_SEED;
+    int ok = 1;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while (ok) {
+        ssize_t n = read_full(in, buffer, COPY_BUFFER_SIZE);
+        if (n <= 0) {
+            ok = (n == 0);
+            break;
+        }
+        h = content_hash_update(h, buffer, (size_t)n);
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buffer + off, n - off);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                ok = 0;
+                break;
+            }
+            off += w;
+        }
+    }
+    free(buffer);
+    *hash = ok ? content_hash_final(h) : 0;
+    return ok ? 1 : -1;
+}
+#endif
+
+// ファイルをコピーする（CopyFile と同様に上書きし、更新日時を引き継ぐ）。
+// result が NULL でなければ、使用した方式・内容ハッシュ・転送時間を返す。成功で非0。
+int copy_file(const char *src, const char *dest, CopyResult *result) {
+    CopyResult local;
+    if (!result)
+        result = &local;
+    memset(result, 0, sizeof(*result));
+    double start = monotonic_seconds();
+#ifdef _WIN32
+    result->backend = BACKEND_COPYFILE;
+    BOOL ok = CopyFile(src, dest, FALSE);
+    result->seconds = monotonic_seconds() - start;
+    return ok;
+#else
+    int in = open_path(src, O_RDONLY, 0);
+    if (in < 0)
+        return 0;
+    struct stat st, dst;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return 0;
+    }
+    int out = open_path(dest, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out < 0 || fstat(out, &dst) != 0) {
+        if (out >= 0)
+            close(out);
+        close(in);
+        return 0;
+    }
+    unsigned long long size = (unsigned long long)st.st_size;
+    int backend = size > 0 ? fs_pair_first_backend(st.st_dev, dst.st_dev) : BACKEND_READ_WRITE;
+    int status = 0;
+    for (; backend < BACKEND_COUNT; backend++) {
+        switch (backend) {
+        case BACKEND_REFLINK:    status = copy_by_reflink(in, out, size); break;
+        case BACKEND_COPY_RANGE: status = copy_by_range(in, out, size); break;
+        case BACKEND_SENDFILE:   status = copy_by_sendfile(in, out, size); break;
+        default:                 status = copy_by_read_write(in, out, &result->hash); break;
+        }
+        if (status != 0)
+            break;
+        fs_pair_mark_unsupported(st.st_dev, dst.st_dev, backend);
+    }
+    int ok = (status == 1);
+    result->backend = (CopyBackend)backend;
+    if (ok) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(out, times);
+    }
+    if (close(out) != 0)
+        ok = 0;
+    close(in);
+    if (!ok)
+        delete_file(dest);
+    result->seconds = monotonic_seconds() - start;
+    return ok;
+#endif
+}
+
+// 同じ内容のコピー済みファイル from を reflink で to に複製し、src の更新日時を設定する。
+// to が既にある場合や reflink に対応しないファイルシステムでは失敗する。成功で非0
+int clone_file(const char *from, const char *src, const char *to) {
+#if defined(_WIN32) || !defined(FICLONE)
+    (void)from;
+    (void)src;
+    (void)to;
+    return 0;
+#else
+    const char *src_name;
+    int src_dir = dir_cache_parent(src, &src_name);
+    struct stat st;
+    if (fstatat(src_dir, src_name, &st, 0) != 0)
+        return 0;
+    int in = open_path(from, O_RDONLY, 0);
+    if (in < 0)
+        return 0;
+    int out = open_path(to, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+    if (out < 0) {
+        close(in);
+        return 0;
+    }
+    int ok = ioctl(out, FICLONE, in) == 0;
+    if (ok) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(out, times);
+    }
+    if (close(out) != 0)
+        ok = 0;
+    close(in);
+    if (!ok)
+        delete_file(to);
+    return ok;
+#endif
+}
+
+// コピー結果をログ用の文字列にする（例："copy_file_range, 512.00 MB/s"）
+char *format_copy_result(const CopyResult *result, unsigned long long size, char *buf, size_t bufsize) {
+    char rate_buf[64];
+    double rate = result->seconds > 0 ? (double)size / result->seconds : 0.0;
+    format_size((unsigned long long)rate, rate_buf, sizeof(rate_buf));
+    snprintf(buf, bufsize, "%s, %s/s", g_backendNames[result->backend], rate_buf);
+    return buf;
+}
+
+// ----- 性能計測（テレメトリ） -----
+// 段階ごとの所要時間・判定結果・ファイルサイズ区分ごとの転送量を集計し、
+// 実行終了時に JSON 形式のレポート（settings.txt の telemetry_file）に出力する。
+// 計測値はワーカーごとの領域（CopyTask.telemetry[スロット]）に加算するため、
+// 計測中のロックやアトミック操作は不要。タスク完了時にスロット0へ合算する。
+typedef enum _Stage {
+    STAGE_ENUMERATE,    // コピー元の列挙（マニフェスト作成）
+    STAGE_COMPARE,      // 同一判定（インデックス照合を含む）
+    STAGE_COPY,         // ファイル内容のコピー
+    STAGE_MOVE,         // 同一ボリューム内の名前変更による移動
+    STAGE_RENAME,       // 文字列置換による名前変更
+    STAGE_DELETE,       // コピー元ファイル・フォルダの削除
+    STAGE_VERIFY,       // ソース削除前のコピー先の検証
+    STAGE_FILE,         // 1ファイルの処理全体
+    STAGE_COUNT
+} Stage;
+
+const char *const g_stageNames[STAGE_COUNT] = {
+    "enumerate", "compare", "copy", "move", "rename", "delete", "verify", "file"
+};
+
+// ファイルごとの処理結果
+typedef enum _FileOutcome {
+    OUTCOME_IDENTICAL,  // コピー先に同一ファイルがあった
+    OUTCOME_DIFFERENT,  // コピー先に異なるファイルがあり、"_copy" 付きで配置した
+    OUTCOME_NEW,        // コピー先に無く、新規に配置した
+    OUTCOME_FAILED,     // コピー・削除などに失敗した
+    OUTCOME_COUNT
+} FileOutcome;
+
+const char *const g_outcomeNames[OUTCOME_COUNT] = { "identical", "different", "new", "failed" };
+
+// 所要時間の度数分布：区分 i は 2^(i-1) 以上 2^i 未満（マイクロ秒）、区分0は1マイクロ秒未満
+#define LATENCY_BUCKETS 32
+
+// ファイルサイズ区分（上限未満で分類する）
+#define SIZE_CLASSES 8
+const unsigned long long g_sizeClassLimits[SIZE_CLASSES] = {
+    1ULL, 4ULL << 10, 64ULL << 10, 1ULL << 20, 16ULL << 20, 256ULL << 20, 4ULL << 30, ~0ULL
+};
+const char *const g_sizeClassNames[SIZE_CLASSES] = {
+    "empty", "<4KB", "<64KB", "<1MB", "<16MB", "<256MB", "<4GB", ">=4GB"
+};
+
+typedef struct _StageStats {
+    unsigned long long count;
+    unsigned long long total_usec;
+    unsigned long long max_usec;
+    unsigned long long histogram[LATENCY_BUCKETS];
+} StageStats;
+
+typedef struct _SizeClassStats {
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long usec;    // 1ファイルの処理全体の所要時間の合計
+} SizeClassStats;
+
+typedef struct _Telemetry {
+    StageStats stages[STAGE_COUNT];
+    unsigned long long outcomes[OUTCOME_COUNT];
+    SizeClassStats size_classes[SIZE_CLASSES];
+    SizeClassStats copied[SIZE_CLASSES];    // size_classes のうちコピーしたファイル（新規・異なる）
+} Telemetry;
+
+// 現在のスレッドが使う計測スロット（メインスレッドは0、ワーカーは番号+1）
+static THREAD_LOCAL int t_telemetrySlot = 0;
+
+// タスクの計測領域を確保する（slots はワーカー数+1）
+void telemetry_init(CopyTask *task, int slots) {
+    task->telemetry = (Telemetry*)calloc((size_t)slots, sizeof(Telemetry));
+    if (!task->telemetry) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    task->telemetry_slots = slots;
+}
+
+// 現在のスレッドの計測領域
+static Telemetry *telemetry_local(CopyTask *task) {
+    return &task->telemetry[t_telemetrySlot];
+}
+
+static int latency_bucket(unsigned long long usec) {
+    int bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static int size_class(unsigned long long size) {
+    int c = 0;
+    while (c < SIZE_CLASSES - 1 && size >= g_sizeClassLimits[c])
+        c++;
+    return c;
+}
+
+// start（monotonic_seconds の値）から現在までを段階 stage の所要時間として記録し、その値を返す
+unsigned long long stage_record(Telemetry *t, Stage stage, double start) {
+    double seconds = monotonic_seconds() - start;
+    unsigned long long usec = seconds > 0 ? (unsigned long long)(seconds * 1e6) : 0;
+    StageStats *s = &t->stages[stage];
+    s->count++;
+    s->total_usec += usec;
+    if (usec > s->max_usec)
+        s->max_usec = usec;
+    s->histogram[latency_bucket(usec)]++;
+    return usec;
+}
+
+// タスクの段階の所要時間を、現在のスレッドの計測領域に記録する
+unsigned long long task_stage(CopyTask *task, Stage stage, double start) {
+    return stage_record(telemetry_local(task), stage, start);
+}
+
+// 1ファイルの処理結果を記録する
+void task_file_done(CopyTask *task, FileOutcome outcome, unsigned long long size, double start) {
+    Telemetry *t = telemetry_local(task);
+    unsigned long long usec = stage_record(t, STAGE_FILE, start);
+    ATOMIC_ADD(&task->files_done, 1);
+    SizeClassStats *c = &t->size_classes[size_class(size)];
+    t->outcomes[outcome]++;
+    c->files++;
+    c->bytes += size;
+    c->usec += usec;
+    if (outcome == OUTCOME_NEW || outcome == OUTCOME_DIFFERENT) {
+        c = &t->copied[size_class(size)];
+        c->files++;
+        c->bytes += size;
+        c->usec += usec;
+    }
+}
+
+// 計測値 t を total に加算する
+void telemetry_add(Telemetry *total, const Telemetry *t) {
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        total->stages[s].count += t->stages[s].count;
+        total->stages[s].total_usec += t->stages[s].total_usec;
+        if (t->stages[s].max_usec > total->stages[s].max_usec)
+            total->stages[s].max_usec = t->stages[s].max_usec;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            total->stages[s].histogram[b] += t->stages[s].histogram[b];
+    }
+    for (int o = 0; o < OUTCOME_COUNT; o++)
+        total->outcomes[o] += t->outcomes[o];
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        total->size_classes[c].files += t->size_classes[c].files;
+        total->size_classes[c].bytes += t->size_classes[c].bytes;
+        total->size_classes[c].usec += t->size_classes[c].usec;
+        total->copied[c].files += t->copied[c].files;
+        total->copied[c].bytes += t->copied[c].bytes;
+        total->copied[c].usec += t->copied[c].usec;
+    }
+}
+
+// 全スロットの計測値をスロット0に合算する（タスク完了時、他のスレッドが記録し終えてから呼ぶ）
+void telemetry_merge(CopyTask *task) {
+    for (int i = 1; i < task->telemetry_slots; i++)
+        telemetry_add(&task->telemetry[0], &task->telemetry[i]);
+}
+
+// 度数分布から百分位点（区分の上限、最大値で頭打ち）を求める
+static unsigned long long stage_percentile(const StageStats *s, double p) {
+    if (s->count == 0)
+        return 0;
+    unsigned long long target = (unsigned long long)(p * s->count + 0.5);
+    unsigned long long seen = 0;
+    if (target == 0)
+        target = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += s->histogram[b];
+        if (seen >= target) {
+            unsigned long long upper = 1ULL << b;
+            return upper < s->max_usec ? upper : s->max_usec;
+        }
+    }
+    return s->max_usec;
+}
+
+// JSON 文字列として出力する（" と \ と制御文字をエスケープ）
+static void json_write_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\')
+            fprintf(fp, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(fp, "\\u%04x", ch);
+        else
+            fputc(ch, fp);
+    }
+    fputc('"', fp);
+}
+
+// 実行全体のレポート
+// 重複排除の集計（実行全体で1つ、重複排除の処理から加算する）
+typedef struct _DedupStats {
+    unsigned long long candidates;      // サイズが一致してハッシュの対象になったファイル数
+    unsigned long long partial_hashed;  // 先頭・末尾のハッシュを計算したファイル数
+    unsigned long long full_hashed;     // 全体のハッシュを計算したファイル数
+    unsigned long long hashed_bytes;    // ハッシュの計算で読み込んだバイト数
+    double hash_seconds;                // 重複の判定にかかった時間
+    unsigned long long duplicates;      // 重複と判定したファイル数（各グループの最初の1件を除く）
+    unsigned long long linked_files;    // ハードリンク・reflink で作成したファイル数
+    unsigned long long saved_bytes;     // コピーせずに済んだバイト数
+} DedupStats;
+
+DedupStats g_dedupStats;
+
+typedef struct _TelemetryReport {
+    FILE *fp;
+    int task_count;
+    double start;
+    unsigned long long files;
+    unsigned long long bytes;
+} TelemetryReport;
+
+// レポートファイルを開いてヘッダを書き込む（出力しない設定なら fp は NULL）
+void telemetry_report_open(TelemetryReport *report, int worker_count) {
+    memset(report, 0, sizeof(*report));
+    report->start = monotonic_seconds();
+    if (g_settings.telemetry_file[0] == '\0')
+        return;
+    report->fp = fopen(g_settings.telemetry_file, "w");
+    if (!report->fp) {
+        console_printf("警告: 計測レポート %s を作成できません。\n", g_settings.telemetry_file);
+        return;
+    }
+    time_t now = time(NULL);
+    char started[32];
+    strftime(started, sizeof(started), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(report->fp, "{\n  \"version\": 1,\n  \"started\": \"%s\",\n  \"worker_threads\": %d,\n"
+            "  \"delete_source\": %s,\n  \"tasks\": [",
+            started, worker_count, g_deleteSource ? "true" : "false");
+}
+
+// 完了したタスクの計測結果を書き込む
+void telemetry_report_task(TelemetryReport *report, const CopyTask *task) {
+    FILE *fp = report->fp;
+    if (!fp)
+        return;
+    const Telemetry *t = &task->telemetry[0];
+    unsigned long long files = 0;
+    for (int o = 0; o < OUTCOME_COUNT; o++)
+        files += t->outcomes[o];
+    double elapsed = task->elapsed_seconds;
+    report->files += files;
+    report->bytes += task->copied_size;
+
+    fprintf(fp, "%s\n    {\n      \"task_id\": %d,\n      \"src\": ", report->task_count++ ? "," : "", task->task_id);
+    json_write_string(fp, task->src);
+    fprintf(fp, ",\n      \"dest\": ");
+    json_write_string(fp, task->dest);
+    fprintf(fp, ",\n      \"elapsed_sec\": %.6f,\n      \"files\": %llu,\n      \"bytes\": %llu,\n"
+            "      \"files_per_sec\": %.2f,\n      \"bytes_per_sec\": %.0f,\n",
+            elapsed, files, task->copied_size,
+            elapsed > 0 ? files / elapsed : 0.0, elapsed > 0 ? task->copied_size / elapsed : 0.0);
+
+    fprintf(fp, "      \"outcomes\": {");
+    for (int o = 0; o < OUTCOME_COUNT; o++)
+        fprintf(fp, "%s\"%s\": %llu", o ? ", " : " ", g_outcomeNames[o], t->outcomes[o]);
+    fprintf(fp, " },\n      \"stages\": {");
+    for (int s = 0, first = 1; s < STAGE_COUNT; s++) {
+        const StageStats *st = &t->stages[s];
+        if (st->count == 0)
+            continue;
+        fprintf(fp, "%s\n        \"%s\": { \"count\": %llu, \"total_usec\": %llu, \"mean_usec\": %.1f, "
+                "\"p50_usec\": %llu, \"p90_usec\": %llu, \"p99_usec\": %llu, \"max_usec\": %llu, \"histogram\": [",
+                first ? "" : ",", g_stageNames[s], st->count, st->total_usec, (double)st->total_usec / st->count,
+                stage_percentile(st, 0.50), stage_percentile(st, 0.90), stage_percentile(st, 0.99), st->max_usec);
+        // 度数のある区分のみ [上限（マイクロ秒）, 件数] で出力する
+        for (int b = 0, first_bucket = 1; b < LATENCY_BUCKETS; b++) {
+            if (st->histogram[b] == 0)
+                continue;
+            fprintf(fp, "%s[%llu, %llu]", first_bucket ? "" : ", ", 1ULL << b, st->histogram[b]);
+            first_bucket = 0;
+        }
+        fprintf(fp, "] }");
+        first = 0;
+    }
+    fprintf(fp, "\n      },\n      \"size_classes\": [");
+    for (int c = 0, first = 1; c < SIZE_CLASSES; c++) {
+        const SizeClassStats *sc = &t->size_classes[c];
+        if (sc->files == 0)
+            continue;
+        double seconds = sc->usec / 1e6;
+        fprintf(fp, "%s\n        { \"class\": \"%s\", \"files\": %llu, \"bytes\": %llu, \"usec\": %llu, "
+                "\"files_per_sec\": %.2f, \"bytes_per_sec\": %.0f }",
+                first ? "" : ",", g_sizeClassNames[c], sc->files, sc->bytes, sc->usec,
+                seconds > 0 ? sc->files / seconds : 0.0, seconds > 0 ? sc->bytes / seconds : 0.0);
+        first = 0;
+    }
+    fprintf(fp, "\n      ],\n      \"backends\": {");
+    for (int b = 0, first = 1; b < BACKEND_COUNT; b++) {
+        if (task->backend_files[b] == 0)
+            continue;
+        fprintf(fp, "%s\n        \"%s\": { \"files\": %llu, \"bytes\": %llu, \"usec\": %llu }",
+                first ? "" : ",", g_backendNames[b], task->backend_files[b], task->backend_bytes[b],
+                task->backend_usec[b]);
+        first = 0;
+    }
+    fprintf(fp, "\n      }\n    }");
+    fflush(fp);
+}
+
+// 実行全体の集計を書き込んでレポートを閉じる
+void telemetry_report_close(TelemetryReport *report) {
+    FILE *fp = report->fp;
+    if (!fp)
+        return;
+    double elapsed = monotonic_seconds() - report->start;
+    fprintf(fp, "\n  ],\n");
+    if (g_settings.dedup != DEDUP_OFF) {
+        const DedupStats *d = &g_dedupStats;
+        fprintf(fp, "  \"dedup\": {\"mode\": \"%s\", \"candidates\": %llu, \"partial_hashed\": %llu, "
+                    "\"full_hashed\": %llu, \"hashed_bytes\": %llu, \"hash_sec\": %.6f, \"duplicates\": %llu, "
+                    "\"linked_files\": %llu, \"saved_bytes\": %llu},\n",
+                g_settings.dedup == DEDUP_HARDLINK ? "hardlink" : "reflink", d->candidates, d->partial_hashed,
+                d->full_hashed, d->hashed_bytes, d->hash_seconds, d->duplicates, d->linked_files, d->saved_bytes);
+    }
+    fprintf(fp, "  \"elapsed_sec\": %.6f,\n  \"files\": %llu,\n  \"bytes\": %llu,\n"
+            "  \"files_per_sec\": %.2f,\n  \"bytes_per_sec\": %.0f\n}\n",
+            elapsed, report->files, report->bytes,
+            elapsed > 0 ? report->files / elapsed : 0.0, elapsed > 0 ? report->bytes / elapsed : 0.0);
+    fclose(fp);
+    report->fp = NULL;
+}
+
+// ----- ファイル比較・新規ファイル名生成 -----
+// 2つのファイルが同一かどうかを3段階で判定する（同一なら非0、異なれば0）。
+// できるだけ早い段階で結論を出し、決着した段階を *tier に返す。
+//   第1段階（メタデータ）：サイズが違えば異なる。同じ実体（同一 inode）なら同一。
+//                          比較モードが COMPARE_META なら、サイズと更新日時の一致で同一とみなす。
+//   第2段階（サンプル）：先頭と末尾の SAMPLE_SIZE バイトを比較し、違えば異なる。
+//                        全体がサンプルに収まる場合、または COMPARE_SAMPLE なら一致で同一。
+//   第3段階（全比較）：残りの範囲を COMPARE_BLOCK_SIZE 単位の大きな読み込みで比較する。
+static int read_exact(FILE *fp, char *buf, size_t len) {
+    return fread(buf, 1, len, fp) == len;
+}
+static int compare_range(FILE *fp1, FILE *fp2, unsigned long long offset, unsigned long long len,
+                         char *buf1, char *buf2, size_t bufsize) {
+    if (fseek64(fp1, (long long)offset, SEEK_SET) != 0 || fseek64(fp2, (long long)offset, SEEK_SET) != 0)
+        return 0;
+    while (len > 0) {
+        size_t chunk = len < bufsize ? (size_t)len : bufsize;
+        if (!read_exact(fp1, buf1, chunk) || !read_exact(fp2, buf2, chunk))
+            return 0;
+        if (memcmp(buf1, buf2, chunk) != 0)
+            return 0;
+        len -= chunk;
+    }
+    return 1;
+}
+
+int files_are_identical(const char *file1, const char *file2, CompareMode mode, int *tier) {
+    FileInfo info1, info2;
+    *tier = COMPARE_TIER_META;
+    if (!get_file_info(file1, &info1) || !get_file_info(file2, &info2))
+        return 0;
+    if (info1.size != info2.size)
+        return 0;
+    if (info1.ino != 0 && info1.dev == info2.dev && info1.ino == info2.ino)
+        return 1;
+    if (mode == COMPARE_META && info1.mtime == info2.mtime)
+        return 1;
+    
+    *tier = COMPARE_TIER_SAMPLE;
+    FILE *fp1 = file_open_stream(file1);
+    FILE *fp2 = file_open_stream(file2);
+    if (!fp1 || !fp2) {
+        if (fp1) fclose(fp1);
+        if (fp2) fclose(fp2);
+        return 0;
+    }
+    unsigned long long size = info1.size;
+    size_t bufsize = size < COMPARE_BLOCK_SIZE ? (size > SAMPLE_SIZE ? (size_t)size : SAMPLE_SIZE) : COMPARE_BLOCK_SIZE;
+    char *buf1 = (char*)malloc(bufsize);
+    char *buf2 = (char*)malloc(bufsize);
+    int identical = 0;
+    if (buf1 && buf2) {
+        setvbuf(fp1, NULL, _IONBF, 0);
+        setvbuf(fp2, NULL, _IONBF, 0);
+        if (size <= 2 * (unsigned long long)SAMPLE_SIZE) {
+            // サンプルで全体を比較できる
+            identical = compare_range(fp1, fp2, 0, size, buf1, buf2, bufsize);
+        } else if (compare_range(fp1, fp2, 0, SAMPLE_SIZE, buf1, buf2, bufsize) &&
+                   compare_range(fp1, fp2, size - SAMPLE_SIZE, SAMPLE_SIZE, buf1, buf2, bufsize)) {
+            if (mode == COMPARE_SAMPLE) {
+                identical = 1;
+            } else {
+                *tier = COMPARE_TIER_FULL;
+                identical = compare_range(fp1, fp2, SAMPLE_SIZE, size - 2 * (unsigned long long)SAMPLE_SIZE,
+                                          buf1, buf2, bufsize);
+            }
+        }
+    }
+    free(buf1);
+    free(buf2);
+    fclose(fp1);
+    fclose(fp2);
+    return identical;
+}
+// 新しいファイル名を生成する（例："file.txt" -> "file_copy.txt"）
+void generate_new_filename(const char *dest, char *new_dest, size_t new_dest_size) {
+    strncpy(new_dest, dest, new_dest_size);
+    new_dest[new_dest_size - 1] = '\0';
+    char *dot = strrchr(new_dest, '.');
+    if (dot) {
+        size_t pos = dot - new_dest;
+        char temp[MAX_PATH];
+        strncpy(temp, new_dest, pos);
+        temp[pos] = '\0';
+        strncat(temp, "_copy", sizeof(temp) - strlen(temp) - 1);
+        strncat(temp, dot, sizeof(temp) - strlen(temp) - 1);
+        strncpy(new_dest, temp, new_dest_size);
+    } else {
+        strncat(new_dest, "_copy", new_dest_size - strlen(new_dest) - 1);
+    }
+}
+
+// ----- 名前置換 -----
+// history.txt の置換前・置換後の文字列から、タスクごとの置換規則を読み込み時に一度だけ作る。
+// 規則は "|" 区切りで複数指定でき、置換前の先頭の "^" は名前の先頭だけ、末尾の "$" は名前の末尾だけ、
+// "^...$" は名前全体に一致する。位置を問わない規則は Aho-Corasick 法のオートマトンにまとめ、
+// 名前を1回走査するだけですべての規則を照合する（先に終わる一致を優先し、各規則は最初の1か所だけ置換する）。
+// コピー先の名前はこの規則でメモリ上で決め、データは最初から最終的な名前で書き込む。
+// オプションが "d" ならコピー元直下のフォルダ名に、空または "f" ならファイル名に、"df" なら両方に適用する。
+#define RENAME_MAX_RULES 256
+
+enum {
+    RULE_ANYWHERE,  // 名前のどこでも
+    RULE_PREFIX,    // "^..."：名前の先頭
+    RULE_SUFFIX,    // "...$"：名前の末尾
+    RULE_WHOLE      // "^...$"：名前全体
+};
+
+typedef struct _RenameRule {
+    const char *from;           // 置換前（アンカーを除く）
+    size_t from_len;
+    const char *to;
+    int anchor;
+} RenameRule;
+
+typedef struct _RenameRules {
+    int valid;                  // 規則が正しく読み込めたら1
+    int files;                  // ファイル名に適用する
+    int folders;                // コピー元直下のフォルダ名に適用する
+    char *text;                 // 規則の文字列（from / to はこの中を指す）
+    RenameRule *rules;
+    int rule_count;
+    int (*next)[256];           // ノードごと・文字ごとの遷移（失敗時の遷移も展開済み）
+    int *out;                   // そのノードで終わる規則（なければ-1）
+    int *dict;                  // 接尾辞をたどって次に規則が終わるノード（なければ-1）
+    int node_count;
+} RenameRules;
+
+static int rename_add_node(RenameRules *r, size_t *capacity) {
+    if ((size_t)r->node_count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        r->next = (int(*)[256])realloc(r->next, *capacity * sizeof(*r->next));
+        r->out = (int*)realloc(r->out, *capacity * sizeof(int));
+        r->dict = (int*)realloc(r->dict, *capacity * sizeof(int));
+        if (!r->next || !r->out || !r->dict) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+    }
+    int node = r->node_count++;
+    for (int c = 0; c < 256; c++)
+        r->next[node][c] = -1;
+    r->out[node] = -1;
+    r->dict[node] = -1;
+    return node;
+}
+
+// 位置を問わない規則から照合用のオートマトンを作る
+static void rename_build_matcher(RenameRules *r) {
+    size_t capacity = 0;
+    rename_add_node(r, &capacity);
+    for (int i = 0; i < r->rule_count; i++) {
+        const RenameRule *rule = &r->rules[i];
+        if (rule->anchor != RULE_ANYWHERE)
+            continue;
+        int node = 0;
+        for (size_t k = 0; k < rule->from_len; k++) {
+            unsigned char c = (unsigned char)rule->from[k];
+            if (r->next[node][c] < 0) {
+                int child = rename_add_node(r, &capacity);
+                r->next[node][c] = child;
+            }
+            node = r->next[node][c];
+        }
+        if (r->out[node] < 0)
+            r->out[node] = i;   // 同じ置換前の規則が複数あれば先の規則を使う
+    }
+    // 幅優先で失敗リンクを求め、遷移表に展開する
+    int *fail = (int*)calloc(r->node_count, sizeof(int));
+    int *queue = (int*)malloc(r->node_count * sizeof(int));
+    if (!fail || !queue) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int child = r->next[0][c];
+        if (child < 0) {
+            r->next[0][c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int node = queue[head++];
+        for (int c = 0; c < 256; c++) {
+            int child = r->next[node][c];
+            if (child < 0) {
+                r->next[node][c] = r->next[fail[node]][c];
+                continue;
+            }
+            int f = r->next[fail[node]][c];
+            fail[child] = f;
+            r->dict[child] = r->out[f] >= 0 ? f : r->dict[f];
+            queue[tail++] = child;
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+// "|" で区切られた次の項目を取り出す（区切り文字は '\0' に置き換える）
+static char *rename_next_item(char **p) {
+    if (!*p)
+        return NULL;
+    char *item = *p;
+    char *bar = strchr(item, '|');
+    if (bar) {
+        *bar = '\0';
+        *p = bar + 1;
+    } else {
+        *p = NULL;
+    }
+    trim(item);
+    return item;
+}
+
+// 置換規則を作る。規則が正しくなければ r->valid を0にしてエラーを表示する。
+void rename_rules_compile(RenameRules *r, const char *from, const char *to, const char *option) {
+    memset(r, 0, sizeof(*r));
+    r->files = option[0] == '\0' || strchr(option, 'f') != NULL;
+    r->folders = strchr(option, 'd') != NULL;
+    if (!r->files && !r->folders) {
+        console_printf("警告: 不明なオプション \"%s\" のため、ファイル名に置換を適用します。\n", option);
+        r->files = 1;
+    }
+    r->valid = 1;
+    if (from[0] == '\0')
+        return;
+    size_t from_len = strlen(from), to_len = strlen(to);
+    size_t items = 1;
+    for (const char *c = from; *c; c++)
+        items += *c == '|';
+    if (items > RENAME_MAX_RULES) {
+        console_printf("エラー: 置換規則は %d 個までです。\n", RENAME_MAX_RULES);
+        r->valid = 0;
+        return;
+    }
+    r->text = (char*)malloc(from_len + to_len + 2);
+    r->rules = (RenameRule*)calloc(items, sizeof(RenameRule));
+    if (!r->text || !r->rules) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    memcpy(r->text, from, from_len + 1);
+    memcpy(r->text + from_len + 1, to, to_len + 1);
+    char *from_p = r->text, *to_p = r->text + from_len + 1;
+    char *item;
+    while ((item = rename_next_item(&from_p)) != NULL) {
+        char *replacement = rename_next_item(&to_p);
+        if (!replacement) {
+            console_printf("エラー: 置換前 \"%s\" に対応する置換後の文字列がありません。\n", item);
+            r->valid = 0;
+            return;
+        }
+        if (strchr(replacement, '/') || strchr(replacement, '\\')) {
+            console_printf("エラー: 置換後の文字列 \"%s\" にパス区切り文字は使えません。\n", replacement);
+            r->valid = 0;
+            return;
+        }
+        RenameRule *rule = &r->rules[r->rule_count];
+        size_t len = strlen(item);
+        int prefix = item[0] == '^';
+        int suffix = len > (size_t)prefix && item[len - 1] == '$';
+        if (suffix)
+            item[--len] = '\0';
+        if (prefix) {
+            item++;
+            len--;
+        }
+        rule->anchor = prefix && suffix ? RULE_WHOLE : prefix ? RULE_PREFIX : suffix ? RULE_SUFFIX : RULE_ANYWHERE;
+        if (len == 0 && rule->anchor == RULE_ANYWHERE) {
+            console_printf("エラー: 置換前の文字列が空の規則があります。\n");
+            r->valid = 0;
+            return;
+        }
+        rule->from = item;
+        rule->from_len = len;
+        rule->to = replacement;
+        r->rule_count++;
+    }
+    if (rename_next_item(&to_p)) {
+        console_printf("エラー: 置換後の文字列が置換前より多く指定されています。\n");
+        r->valid = 0;
+        return;
+    }
+    rename_build_matcher(r);
+}
+
+void rename_rules_free(RenameRules *r) {
+    free(r->text);
+    free(r->rules);
+    free(r->next);
+    free(r->out);
+    free(r->dict);
+    memset(r, 0, sizeof(*r));
+}
+
+// out の pos の位置に len バイトを追加する（収まらなければ0）
+static int rename_append(char *out, size_t outsize, size_t *pos, const char *data, size_t len) {
+    if (*pos + len >= outsize)
+        return 0;
+    memcpy(out + *pos, data, len);
+    *pos += len;
+    out[*pos] = '\0';
+    return 1;
+}
+
+// name に置換規則を適用した名前を out に作る。名前が変わった場合は1を返す。
+int rename_apply(const RenameRules *r, const char *name, char *out, size_t outsize) {
+    if (!r || r->rule_count == 0)
+        return 0;
+    size_t n = strlen(name);
+    int prefix = -1, suffix = -1;
+    for (int i = 0; i < r->rule_count; i++) {
+        const RenameRule *rule = &r->rules[i];
+        if (rule->anchor == RULE_ANYWHERE || rule->from_len > n)
+            continue;
+        if (rule->anchor == RULE_WHOLE) {
+            if (rule->from_len == n && memcmp(name, rule->from, n) == 0) {
+                size_t pos = 0;
+                return rename_append(out, outsize, &pos, rule->to, strlen(rule->to)) &&
+                       strcmp(out, name) != 0 && out[0] != '\0';
+            }
+        } else if (rule->anchor == RULE_PREFIX) {
+            if (memcmp(name, rule->from, rule->from_len) == 0 &&
+                (prefix < 0 || rule->from_len > r->rules[prefix].from_len))
+                prefix = i;
+        } else if (memcmp(name + n - rule->from_len, rule->from, rule->from_len) == 0 &&
+                   (suffix < 0 || rule->from_len > r->rules[suffix].from_len)) {
+            suffix = i;
+        }
+    }
+    size_t lo = prefix >= 0 ? r->rules[prefix].from_len : 0;
+    size_t hi = suffix >= 0 ? n - r->rules[suffix].from_len : n;
+    if (hi < lo) {
+        suffix = -1;    // 先頭と末尾の一致が重なる場合は先頭を優先する
+        hi = n;
+    }
+    size_t pos = 0, copied = lo;
+    out[0] = '\0';
+    if (prefix >= 0 && !rename_append(out, outsize, &pos, r->rules[prefix].to, strlen(r->rules[prefix].to)))
+        return 0;
+    // 位置を問わない規則：1回の走査で照合する
+    unsigned char fired[RENAME_MAX_RULES];
+    memset(fired, 0, (size_t)r->rule_count);
+    int node = 0;
+    for (size_t i = lo; i < hi; i++) {
+        node = r->next[node][(unsigned char)name[i]];
+        for (int hit = r->out[node] >= 0 ? node : r->dict[node]; hit >= 0; hit = r->dict[hit]) {
+            const RenameRule *rule = &r->rules[r->out[hit]];
+            size_t start = i + 1 - rule->from_len;
+            if (start < copied || start < lo || fired[r->out[hit]])
+                continue;
+            if (!rename_append(out, outsize, &pos, name + copied, start - copied) ||
+                !rename_append(out, outsize, &pos, rule->to, strlen(rule->to)))
+                return 0;
+            fired[r->out[hit]] = 1;
+            copied = i + 1;
+            break;
+        }
+    }
+    if (!rename_append(out, outsize, &pos, name + copied, hi - copied))
+        return 0;
+    if (suffix >= 0 && !rename_append(out, outsize, &pos, r->rules[suffix].to, strlen(r->rules[suffix].to)))
+        return 0;
+    return strcmp(out, name) != 0 && out[0] != '\0';
+}
+
+// ----- コピー先インデックス -----
+// コピー先フォルダごとに、相対パス → (サイズ, 更新日時, 内容ハッシュ) の対応を
+// INDEX_FILE_NAME に保存する。次回の実行では、コピー元のサイズ・更新日時と
+// コピー先の現在のサイズ・更新日時がどちらも記録と一致すれば、中身を読まずに同一と判定する。
+//
+// ファイル形式（1行1レコード、後の行が優先）：
+//   "AFMINDEX 1"                              ヘッダ
+//   "+\t<サイズ>\t<更新日時>\t<ハッシュ>\t<相対パス>"  追加・更新
+//   "-\t<相対パス>"                           削除
+//   "END"                                     正常終了の印（最終行）
+// 実行中はレコードを追記し、タスク完了時に END を書く。END が無いインデックスは
+// 前回の実行が途中で終了した可能性があるため信用せず、通常の比較に切り替える。
+// 同じコピー先に書き込むタスクは1つのインデックスを共有する（dest_index_acquire）。
+#define INDEX_HEADER "AFMINDEX 1"
+
+typedef struct _IndexEntry {
+    const char *path;           // コピー先フォルダからの相対パス（NULL は未使用スロット）
+    unsigned long long size;
+    long long mtime;
+    unsigned long long hash;    // 内容ハッシュ（未計算なら0）
+    int removed;
+} IndexEntry;
+
+typedef struct _DestIndex {
+    Mutex lock;
+    Arena arena;
+    IndexEntry *slots;          // オープンアドレス法のハッシュ表（容量は2のべき乗）
+    size_t capacity;
+    size_t used;                // 使用中スロット数（削除済みを含む）
+    FILE *journal;              // 追記用に開いたインデックスファイル
+    int trusted;                // 前回正常終了したインデックスなら非0
+    int enabled;
+    const char *root;           // コピー先フォルダ（共有中のインデックスの検索用、アリーナ内）
+    int refs;                   // 共有しているタスク数
+    struct _DestIndex *next;    // 共有中のインデックスの一覧
+} DestIndex;
+
+// 開いているインデックスの一覧（g_indexLock で保護する）
+DestIndex *g_openIndexes = NULL;
+Mutex g_indexLock;
+
+static unsigned long long string_hash(const char *s) {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static IndexEntry *dest_index_slot(DestIndex *index, const char *path) {
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)string_hash(path) & mask;
+    while (index->slots[i].path && strcmp(index->slots[i].path, path) != 0)
+        i = (i + 1) & mask;
+    return &index->slots[i];
+}
+
+static void dest_index_grow(DestIndex *index) {
+    IndexEntry *old = index->slots;
+    size_t old_capacity = index->capacity;
+    index->capacity = old_capacity ? old_capacity * 2 : 1024;
+    index->slots = (IndexEntry*)calloc(index->capacity, sizeof(IndexEntry));
+    if (!index->slots) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    index->used = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].path && !old[i].removed) {
+            *dest_index_slot(index, old[i].path) = old[i];
+            index->used++;
+        }
+    }
+    free(old);
+}
+
+static void dest_index_put(DestIndex *index, const char *path, unsigned long long size, long long mtime, unsigned long long hash) {
+    if ((index->used + 1) * 4 >= index->capacity * 3)
+        dest_index_grow(index);
+    IndexEntry *e = dest_index_slot(index, path);
+    if (!e->path) {
+        e->path = arena_strdup(&index->arena, path);
+        index->used++;
+    }
+    e->size = size;
+    e->mtime = mtime;
+    e->hash = hash;
+    e->removed = 0;
+}
+
+static IndexEntry *dest_index_find(DestIndex *index, const char *path) {
+    if (index->capacity == 0)
+        return NULL;
+    IndexEntry *e = dest_index_slot(index, path);
+    return (e->path && !e->removed) ? e : NULL;
+}
+
+static void dest_index_file_path(const char *dest_root, char *buf, size_t bufsize) {
+    snprintf(buf, bufsize, "%s%c%s", dest_root, PATH_SEP, INDEX_FILE_NAME);
+}
+
+// インデックスを読み込む（正常終了の印が無いインデックスは破棄し、trusted を0にする）
+static void dest_index_load(DestIndex *index, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char line[MAX_PATH + 128];
+        int valid = fgets(line, sizeof(line), fp) && strncmp(line, INDEX_HEADER, strlen(INDEX_HEADER)) == 0;
+        int ended = 0;
+        while (valid && fgets(line, sizeof(line), fp)) {
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n' || ended) {
+                valid = 0;  // 途中で切れた行、または END より後の行
+                break;
+            }
+            line[len - 1] = '\0';
+            if (strcmp(line, "END") == 0) {
+                ended = 1;
+            } else if (line[0] == '+' && line[1] == '\t') {
+                unsigned long long size, hash;
+                long long mtime;
+                int consumed = 0;
+                if (sscanf(line + 2, "%llu\t%lld\t%llx\t%n", &size, &mtime, &hash, &consumed) != 3 || consumed == 0) {
+                    valid = 0;
+                    break;
+                }
+                dest_index_put(index, line + 2 + consumed, size, mtime, hash);
+            } else if (line[0] == '-' && line[1] == '\t') {
+                IndexEntry *e = dest_index_find(index, line + 2);
+                if (e)
+                    e->removed = 1;
+            } else {
+                valid = 0;
+                break;
+            }
+        }
+        fclose(fp);
+        index->trusted = valid && ended;
+        if (!index->trusted) {
+            console_printf("警告: %s は前回正常に終了していないため使用しません（通常の比較を行います）。\n", path);
+            log_message("インデックス破棄: %s（前回の実行が未完了）\n", path);
+            arena_free(&index->arena);
+            free(index->slots);
+            index->slots = NULL;
+            index->capacity = 0;
+            index->used = 0;
+        }
+    }
+}
+
+// インデックスを読み込み、圧縮して書き直した上で追記用に開く
+void dest_index_open(DestIndex *index, const char *dest_root, int enabled) {
+    memset(index, 0, sizeof(*index));
+    mutex_init(&index->lock);
+    index->enabled = enabled;
+    if (!enabled)
+        return;
+    
+    char path[MAX_PATH], tmp_path[MAX_PATH + sizeof(".tmp")];
+    dest_index_file_path(dest_root, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    dest_index_load(index, path);
+    
+    // 有効なエントリだけを書き出して置き換え、END の無い状態で追記を続ける
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        console_printf("警告: インデックス %s を作成できません。インデックスを使わずに続行します。\n", path);
+        return;
+    }
+    fprintf(out, "%s\n", INDEX_HEADER);
+    for (size_t i = 0; i < index->capacity; i++) {
+        const IndexEntry *e = &index->slots[i];
+        if (e->path && !e->removed)
+            fprintf(out, "+\t%llu\t%lld\t%llx\t%s\n", e->size, e->mtime, e->hash, e->path);
+    }
+    if (fclose(out) != 0 || !replace_file(tmp_path, path)) {
+        delete_file(tmp_path);
+        console_printf("警告: インデックス %s を更新できません。インデックスを使わずに続行します。\n", path);
+        return;
+    }
+    index->journal = fopen(path, "a");
+}
+
+// 正常終了の印を書いて閉じる
+void dest_index_close(DestIndex *index) {
+    if (index->journal) {
+        fprintf(index->journal, "END\n");
+        fclose(index->journal);
+    }
+    arena_free(&index->arena);
+    free(index->slots);
+    mutex_destroy(&index->lock);
+    memset(index, 0, sizeof(*index));
+}
+
+// コピー先フォルダ dest_root のインデックスを参照する。同じコピー先に書き込むタスクは
+// 1つのインデックスを共有し、最初のタスクが開いて最後のタスクが閉じる
+// （タスクごとに開くと、後から開いたタスクの書き直しで先のタスクが追記中のファイルが置き換えられる）。
+DestIndex *dest_index_acquire(const char *dest_root, int enabled) {
+    mutex_lock(&g_indexLock);
+    DestIndex *index = g_openIndexes;
+    while (index && strcmp(index->root, dest_root) != 0)
+        index = index->next;
+    if (!index) {
+        index = (DestIndex*)malloc(sizeof(DestIndex));
+        if (!index) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        dest_index_open(index, dest_root, enabled);
+        index->root = arena_strdup(&index->arena, dest_root);
+        index->next = g_openIndexes;
+        g_openIndexes = index;
+    }
+    index->refs++;
+    mutex_unlock(&g_indexLock);
+    return index;
+}
+
+// インデックスの参照を終える（最後のタスクなら正常終了の印を書いて閉じる）
+void dest_index_release(DestIndex *index) {
+    mutex_lock(&g_indexLock);
+    if (--index->refs == 0) {
+        DestIndex **link = &g_openIndexes;
+        while (*link != index)
+            link = &(*link)->next;
+        *link = index->next;
+        dest_index_close(index);
+        free(index);
+    }
+    mutex_unlock(&g_indexLock);
+}
+
+// 記録を追加・更新する。hash が0の場合は既存の記録のハッシュを引き継ぐ。
+void dest_index_record(DestIndex *index, const char *rel, unsigned long long size, long long mtime, unsigned long long hash) {
+    if (!index->enabled)
+        return;
+    mutex_lock(&index->lock);
+    if (hash == 0) {
+        IndexEntry *old = dest_index_find(index, rel);
+        if (old && old->size == size)
+            hash = old->hash;
+    }
+    dest_index_put(index, rel, size, mtime, hash);
+    if (index->journal)
+        fprintf(index->journal, "+\t%llu\t%lld\t%llx\t%s\n", size, mtime, hash, rel);
+    mutex_unlock(&index->lock);
+}
+
+// コピー元（size, mtime）とコピー先の現在のメタデータが記録と一致すれば非0
+int dest_index_matches(DestIndex *index, const char *rel, unsigned long long size, long long mtime, const FileInfo *dest_info) {
+    if (!index->enabled || !index->trusted)
+        return 0;
+    mutex_lock(&index->lock);
+    IndexEntry *e = dest_index_find(index, rel);
+    int match = e && e->size == size && e->mtime == mtime &&
+                dest_info->size == size && dest_info->mtime == mtime;
+    mutex_unlock(&index->lock);
+    return match;
+}
+
+// ----- 再開用ジャーナル -----
+// タスクの実行中、コピー元ファイルごとの状態遷移をコピー先フォルダ直下の
+// JOURNAL_FILE_NAME_<コピー元フォルダのハッシュ> に追記する。タスクが最後まで完了したらジャーナルは削除する。
+// 同じコピー先に書き込む別のコピー元のタスクは、それぞれ別のジャーナルを使う。
+// 次回の開始時にジャーナルが残っていれば前回の実行が途中で終了したとみなし、
+// 記録を読み込んで、完了済みの処理（同一判定・コピー）をやり直さずに続きから再開する。
+//
+// ファイル形式（1行1レコード、同じファイルは後の行が優先）：
+//   "AFMJOURNAL 2"                                         ヘッダ
+//   "S\t<コピー元フォルダ>"                                 対象タスクの確認用
+//   "P\t<種別>\t<サイズ>\t<更新日時>\t<元の相対パス>\t<先の相対パス>"  処理の予定（種別 n:新規 d:異なる i:同一）
+//   "C\t<元の相対パス>"                                    コピー完了（コピー先のファイルは完全）
+//   "D\t<元の相対パス>"                                    コピー元の削除（移動）完了
+// レコードは書くたびにフラッシュし、プロセスが異常終了しても書いた分は失われない。
+// 名前にタブ・改行を含むファイルは記録しない（再開時は通常どおり処理する）。
+#define JOURNAL_HEADER "AFMJOURNAL 2"  // 先の相対パスは名前置換後の最終的な名前
+
+typedef struct _JournalEntry {
+    const char *src;            // コピー元フォルダからの相対パス（NULL は未使用スロット）
+    const char *dest;           // コピー先フォルダからの相対パス（名前置換後）
+    unsigned long long size;    // 予定時のコピー元のサイズ
+    long long mtime;            // 予定時のコピー元の更新日時
+    char kind;                  // 'n' 新規 / 'd' 異なる / 'i' 同一
+    char state;                 // 'P' 予定 / 'C' コピー完了 / 'D' 削除完了
+} JournalEntry;
+
+typedef struct _Journal {
+    Mutex lock;
+    Arena arena;
+    JournalEntry *slots;        // オープンアドレス法のハッシュ表（容量は2のべき乗）
+    size_t capacity;
+    size_t used;
+    FILE *fp;                   // 追記用に開いたジャーナル
+    char path[MAX_PATH];
+    size_t resumable;           // 前回の実行から引き継いだ未完了の記録数
+    int enabled;
+} Journal;
+
+static JournalEntry *journal_slot(Journal *j, const char *src) {
+    size_t mask = j->capacity - 1;
+    size_t i = (size_t)string_hash(src) & mask;
+    while (j->slots[i].src && strcmp(j->slots[i].src, src) != 0)
+        i = (i + 1) & mask;
+    return &j->slots[i];
+}
+
+static void journal_grow(Journal *j) {
+    JournalEntry *old = j->slots;
+    size_t old_capacity = j->capacity;
+    j->capacity = old_capacity ? old_capacity * 2 : 1024;
+    j->slots = (JournalEntry*)calloc(j->capacity, sizeof(JournalEntry));
+    if (!j->slots) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].src)
+            *journal_slot(j, old[i].src) = old[i];
+    }
+    free(old);
+}
+
+static JournalEntry *journal_find(Journal *j, const char *src) {
+    if (j->capacity == 0)
+        return NULL;
+    JournalEntry *e = journal_slot(j, src);
+    return e->src ? e : NULL;
+}
+
+static JournalEntry *journal_put(Journal *j, const char *src) {
+    if ((j->used + 1) * 4 >= j->capacity * 3)
+        journal_grow(j);
+    JournalEntry *e = journal_slot(j, src);
+    if (!e->src) {
+        e->src = arena_strdup(&j->arena, src);
+        j->used++;
+    }
+    return e;
+}
+
+// 読み込んだ1行を反映する（形式が正しければ非0）
+static int journal_apply(Journal *j, char *line) {
+    char *fields[6];
+    int n = 0;
+    for (char *p = line; n < 6; n++) {
+        fields[n] = p;
+        p = strchr(p, '\t');
+        if (!p) {
+            n++;
+            break;
+        }
+        *p++ = '\0';
+    }
+    if (strcmp(fields[0], "P") == 0 && n == 6) {
+        JournalEntry *e = journal_put(j, fields[4]);
+        e->kind = fields[1][0];
+        e->size = strtoull(fields[2], NULL, 10);
+        e->mtime = strtoll(fields[3], NULL, 10);
+        e->dest = arena_strdup(&j->arena, fields[5]);
+        e->state = 'P';
+        return 1;
+    }
+    JournalEntry *e = n >= 2 ? journal_find(j, fields[1]) : NULL;
+    if (!e)
+        return 0;
+    if (!((fields[0][0] == 'C' || fields[0][0] == 'D') && n == 2))
+        return 0;
+    e->state = fields[0][0];
+    return 1;
+}
+
+// ジャーナルを開く。前回の未完了のジャーナルがあれば読み込み、未完了の記録だけを残して書き直す。
+void journal_open(Journal *j, const char *src_root, const char *dest_root, int enabled) {
+    memset(j, 0, sizeof(*j));
+    mutex_init(&j->lock);
+    j->enabled = enabled;
+    if (!enabled)
+        return;
+    snprintf(j->path, sizeof(j->path), "%s%c%s_%016llx", dest_root, PATH_SEP, JOURNAL_FILE_NAME, string_hash(src_root));
+    char tmp_path[MAX_PATH + sizeof(".tmp")];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", j->path);
+
+    FILE *fp = fopen(j->path, "r");
+    if (fp) {
+        char line[2 * MAX_PATH + 128];
+        int valid = fgets(line, sizeof(line), fp) && strncmp(line, JOURNAL_HEADER, strlen(JOURNAL_HEADER)) == 0;
+        int same_task = 0;
+        while (valid && fgets(line, sizeof(line), fp)) {
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n')
+                break;  // 異常終了で途中まで書かれた最終行は無視する
+            line[len - 1] = '\0';
+            if (line[0] == 'S' && line[1] == '\t')
+                same_task = strcmp(line + 2, src_root) == 0;
+            else if (!same_task || !journal_apply(j, line))
+                valid = 0;
+        }
+        fclose(fp);
+        if (!valid || !same_task) {
+            arena_free(&j->arena);
+            free(j->slots);
+            j->slots = NULL;
+            j->capacity = 0;
+            j->used = 0;
+        }
+        for (size_t i = 0; i < j->capacity; i++) {
+            if (j->slots[i].src && j->slots[i].state != 'D')
+                j->resumable++;
+        }
+        if (j->resumable > 0) {
+            console_printf("前回の実行が途中で終了しています。%llu 件の記録から続きを再開します。\n",
+                   (unsigned long long)j->resumable);
+            log_message("再開: %s（未完了の記録 %llu 件）\n", j->path, (unsigned long long)j->resumable);
+        }
+    }
+
+    // 未完了の記録だけを書き出して置き換え、以降は追記する
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        console_printf("警告: ジャーナル %s を作成できません。ジャーナルを使わずに続行します。\n", j->path);
+        return;
+    }
+    fprintf(out, "%s\nS\t%s\n", JOURNAL_HEADER, src_root);
+    for (size_t i = 0; i < j->capacity; i++) {
+        const JournalEntry *e = &j->slots[i];
+        if (!e->src || e->state == 'D')
+            continue;
+        fprintf(out, "P\t%c\t%llu\t%lld\t%s\t%s\n", e->kind, e->size, e->mtime, e->src, e->dest);
+        if (e->state == 'C')
+            fprintf(out, "C\t%s\n", e->src);
+    }
+    if (fclose(out) != 0 || !replace_file(tmp_path, j->path)) {
+        delete_file(tmp_path);
+        console_printf("警告: ジャーナル %s を更新できません。ジャーナルを使わずに続行します。\n", j->path);
+        return;
+    }
+    j->fp = fopen(j->path, "a");
+}
+
+// タスクの完了：すべて処理済みなのでジャーナルを削除する
+void journal_close(Journal *j) {
+    if (j->fp) {
+        fclose(j->fp);
+        delete_file(j->path);
+    }
+    arena_free(&j->arena);
+    free(j->slots);
+    mutex_destroy(&j->lock);
+    memset(j, 0, sizeof(*j));
+}
+
+static int journal_name_ok(const char *rel) {
+    return rel && strpbrk(rel, "\t\n") == NULL;
+}
+
+// 処理の予定を記録する
+void journal_plan(Journal *j, const char *src_rel, char kind, const ManifestEntry *entry, const char *dest_rel) {
+    if (!j->fp || !journal_name_ok(src_rel) || !journal_name_ok(dest_rel))
+        return;
+    mutex_lock(&j->lock);
+    fprintf(j->fp, "P\t%c\t%llu\t%lld\t%s\t%s\n", kind, entry->size, entry->mtime, src_rel, dest_rel);
+    fflush(j->fp);
+    mutex_unlock(&j->lock);
+}
+
+// 状態の遷移を記録する（'C' / 'D'）
+void journal_mark(Journal *j, const char *src_rel, char state) {
+    if (!j->fp || !journal_name_ok(src_rel))
+        return;
+    mutex_lock(&j->lock);
+    fprintf(j->fp, "%c\t%s\n", state, src_rel);
+    fflush(j->fp);
+    mutex_unlock(&j->lock);
+}
+
+// 前回の実行の記録のうち、コピー元が記録時から変わっていないものを取り出す（あれば非0）
+int journal_lookup(Journal *j, const char *src_rel, const ManifestEntry *entry, JournalEntry *out) {
+    if (j->resumable == 0)
+        return 0;
+    // 前回の記録の表は開いた後は変更しないため、ロックせずに参照できる
+    JournalEntry *e = journal_find(j, src_rel);
+    int found = e && e->state != 'D' && e->size == entry->size && e->mtime == entry->mtime;
+    if (found)
+        *out = *e;
+    return found;
+}
+
+// ----- コピー・削除処理 -----
+// ファイルの場合：
+//   - 宛先が存在し、内容が同一なら、
+//       g_deleteSource 有効ならコピーせずソース削除、無効なら保持。
+//   - 宛先が存在し、内容が異なるなら、
+//       g_deleteSource 有効なら "_copy" 付加でコピー＆削除、無効ならコピーのみ。
+//   - 宛先が存在しなければ通常コピーし、g_deleteSource に応じて削除または保持。
+// dest は名前置換後の最終的なコピー先で、コピー・移動は最初からこの名前で行う。
+// コピー先に置いた（または同一と確認した）ファイルは、コピー先インデックスに記録する。
+// 各段階の完了は再開用ジャーナルに記録し、コピー元の削除はコピー先が完全になってから行う。
+// ソース削除が有効でコピー元と同じボリュームの場合は、コピー＋削除の代わりに名前変更で移動する
+// （移動先が既にある、または別ボリュームなどで失敗した場合のみコピー＋削除に戻る）。
+
+// コピー先の絶対パスから、コピー先フォルダからの相対パスを取り出す
+static const char *dest_relative(const CopyTask *task, const char *path) {
+    size_t len = strlen(task->dest);
+    if (strncmp(path, task->dest, len) == 0 && path[len] == PATH_SEP)
+        return path + len + 1;
+    return path;
+}
+
+// コピー元の絶対パスから、コピー元フォルダからの相対パスを取り出す
+static const char *source_relative(const CopyTask *task, const char *path) {
+    size_t len = strlen(task->src);
+    if (strncmp(path, task->src, len) == 0 && path[len] == PATH_SEP)
+        return path + len + 1;
+    return path;
+}
+
+// マニフェストのファイル番号 index のコピー先の絶対パス（フォルダ名・ファイル名の置換後）を組み立てる。
+// buf に収まらなければ0
+int task_dest_file_path(const CopyTask *task, size_t index, char *buf, size_t bufsize) {
+    const ManifestEntry *e = &task->manifest.files[index];
+    char dir[MAX_PATH], renamed[MAX_PATH];
+    const char *name = e->name;
+    if (task->rules && task->rules->files && rename_apply(task->rules, name, renamed, sizeof(renamed)))
+        name = renamed;
+    if (!manifest_dest_dir_path(&task->manifest, task->dest, e->dir, dir, sizeof(dir)))
+        return 0;
+    int n = snprintf(buf, bufsize, "%s%c%s", dir, PATH_SEP, name);
+    return n >= 0 && (size_t)n < bufsize;
+}
+
+// コピー元またはコピー先のパスが長すぎて組み立てられないファイルを失敗として報告し、-1 を返す。
+// 途中で切れたパスに書き込んだり別のファイルを削除したりしないよう、入出力の前に判定する（ソースは残す）。
+static int report_path_too_long(CopyTask *task, size_t index) {
+    char path[2 * MAX_PATH];
+    if (!manifest_file_path(&task->manifest, task->src, index, path, sizeof(path)))
+        snprintf(path, sizeof(path), "%s", task->manifest.files[index].name);
+    console_printf("\nエラー: %s のパスが長すぎます。ソースは残します。\n", path);
+    log_message("%s: パスが長すぎるためコピーしない、ソース保持\n", path);
+    return -1;
+}
+
+// フォルダごと移動したファイルは元の名前のままなので、ファイル名置換が必要なら名前を変える。
+// コピー先の現在のパスを path に返す。成功で1、名前を変えられなければ-1（path は元の名前のまま）、
+// パスが長すぎて組み立てられなければ0。
+static int rename_moved_file(CopyTask *task, const ManifestEntry *entry, const char *dest, char *path, size_t pathsize) {
+    char dir[MAX_PATH];
+    manifest_dest_dir_path(&task->manifest, task->dest, entry->dir, dir, sizeof(dir));
+    if (snprintf(path, pathsize, "%s%c%s", dir, PATH_SEP, entry->name) >= (int)pathsize) {
+        console_printf("エラー: %s%c%s のパスが長すぎます。\n", dir, PATH_SEP, entry->name);
+        log_message("%s%c%s: パスが長すぎるため名前変更できない\n", dir, PATH_SEP, entry->name);
+        return 0;
+    }
+    if (strcmp(path, dest) == 0)
+        return 1;
+    double start = monotonic_seconds();
+    int ok = move_path(path, dest);
+    task_stage(task, STAGE_RENAME, start);
+    if (!ok) {
+        console_printf("エラー: %s の置換に失敗しました。\n", path);
+        log_message("%s -> %s: 名前変更失敗\n", path, dest);
+        return -1;
+    }
+    log_message("名前変更: %s -> %s\n", path, dest);
+    snprintf(path, pathsize, "%s", dest);
+    return 1;
+}
+
+// コピー元ファイルを削除する（成功で非0）
+static int delete_source_file(CopyTask *task, const char *src) {
+    double start = monotonic_seconds();
+    int ok = delete_file(src);
+    task_stage(task, STAGE_DELETE, start);
+    return ok;
+}
+
+// 同一ボリューム内で名前変更により移動する（成功で非0）
+static int move_source_file(CopyTask *task, const char *src, const char *dest) {
+    double start = monotonic_seconds();
+    int ok = move_path(src, dest);
+    task_stage(task, STAGE_MOVE, start);
+    return ok;
+}
+
+int copy_file_ranged(CopyTask *task, const char *src, const char *dest, unsigned long long size, CopyResult *result);
+void delete_stage_submit(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest, const char *label,
+                         FileOutcome outcome, int verify, unsigned long long hash, const char *note, double start);
+static int pool_worker_count(void);
+void device_throttle(CopyTask *task, unsigned long long bytes, double start);
+int dedup_materialize(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest, CopyResult *result);
+void dedup_register(CopyTask *task, const ManifestEntry *entry, const char *dest);
+void uring_release(void);
+
+// ファイル内容をコピーする（成功で非0）。大きなファイルは複数のワーカーで分割してコピーする。
+// 重複排除の対象で、同じ内容のファイルを既にコピーしていれば、そこからリンクで作成する。
+static int copy_source_file(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest, CopyResult *result) {
+    double start = monotonic_seconds();
+    unsigned long long size = entry->size;
+    if (dedup_materialize(task, entry, src, dest, result)) {
+        task_stage(task, STAGE_COPY, start);
+        return 1;
+    }
+    int ok = g_settings.large_file_threshold > 0 && size >= g_settings.large_file_threshold && pool_worker_count() > 1
+           ? copy_file_ranged(task, src, dest, size, result)
+           : copy_file(src, dest, result);
+    if (ok) {
+        dedup_register(task, entry, dest);
+        device_throttle(task, size, start);
+    }
+    task_stage(task, STAGE_COPY, start);
+    return ok;
+}
+
+// コピーしたファイルのソース削除の前に、コピー先を検証するか
+// （reflink はコピー元とデータを共有するため、読み直しても意味がない）
+static int copy_needs_verify(const CopyResult *result) {
+    return g_settings.verify > 0 && result->backend != BACKEND_REFLINK;
+}
+
+// 前回の実行のジャーナルの記録から続きを処理する。
+// 処理を終えたら0（失敗は-1、検証・削除ステージに送ったら1）、通常の処理（同一判定から）が必要なら2を返す。
+static int resume_file(CopyTask *task, const ManifestEntry *entry, const char *src, const JournalEntry *je,
+                       FileOutcome *outcome, double start) {
+    char placed[MAX_PATH];
+    FileInfo info;
+    if (snprintf(placed, sizeof(placed), "%s%c%s", task->dest, PATH_SEP, je->dest) >= (int)sizeof(placed)) {
+        console_printf("\nエラー: %s の再開先 %s%c%s のパスが長すぎます。ソースは残します。\n", src, task->dest, PATH_SEP,
+                       je->dest);
+        log_message("%s: 再開、記録されたコピー先のパスが長すぎるため処理しない、ソース保持\n", src);
+        return -1;
+    }
+    if (je->state == 'P' && je->kind != 'i') {
+        // コピーの途中で終了した可能性がある：途中までのコピー先を削除してやり直す
+        char part[MAX_PATH + sizeof(PART_SUFFIX)];
+        snprintf(part, sizeof(part), "%s%s", placed, PART_SUFFIX);
+        if (path_exists(placed) && delete_file(placed))
+            log_message("%s: 再開、途中までのコピー先 %s を削除\n", src, placed);
+        if (path_exists(part) && delete_file(part))
+            log_message("%s: 再開、途中までのコピー先 %s を削除\n", src, part);
+        return 2;
+    }
+    if (!get_file_info(placed, &info) || info.size != entry->size)
+        return 2;   // 記録とコピー先が食い違う場合は通常どおり処理する
+    *outcome = je->kind == 'i' ? OUTCOME_IDENTICAL : je->kind == 'd' ? OUTCOME_DIFFERENT : OUTCOME_NEW;
+    if (g_deleteSource) {
+        // コピー中に計算したハッシュは残っていないため、検証ではコピー元も読み直す
+        int verify = g_settings.verify > 0 && je->kind != 'i';
+        if (!verify)
+            dest_index_record(task->index, dest_relative(task, placed), entry->size, entry->mtime, 0);
+        delete_stage_submit(task, entry, src, placed, "再開", *outcome, verify, 0, "前回の実行で処理済み", start);
+        return 1;
+    }
+    dest_index_record(task->index, dest_relative(task, placed), entry->size, entry->mtime, 0);
+    console_printf("\n[再開] %s -> %s : 前回の実行で処理済み（ソース保持）\n", src, placed);
+    log_message("%s -> %s: 再開、前回の実行で処理済み、ソース保持\n", src, placed);
+    return 0;
+}
+
+// コピー方式ごとの件数・バイト数・時間をタスクに加算する
+static void record_copy_result(CopyTask *task, const CopyResult *result, unsigned long long size) {
+    ATOMIC_ADD(&task->backend_files[result->backend], 1);
+    ATOMIC_ADD(&task->backend_bytes[result->backend], size);
+    ATOMIC_ADD(&task->backend_usec[result->backend], (unsigned long long)(result->seconds * 1e6));
+}
+
+// 新規ファイルのコピーを終えた後の処理（ジャーナル・インデックスへの記録とソースの削除）。
+// 戻り値は copy_or_delete_file と同じ。
+static int finish_new_copy(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest,
+                           const CopyResult *result, double start) {
+    char result_buf[96];
+    journal_mark(task->journal, source_relative(task, src), 'C');
+    record_copy_result(task, result, entry->size);
+    format_copy_result(result, entry->size, result_buf, sizeof(result_buf));
+    if (g_deleteSource) {
+        int verify = copy_needs_verify(result);
+        if (!verify)
+            dest_index_record(task->index, dest_relative(task, dest), entry->size, entry->mtime, result->hash);
+        delete_stage_submit(task, entry, src, dest, "新規コピー", OUTCOME_NEW, verify, result->hash, result_buf, start);
+        return 1;
+    }
+    dest_index_record(task->index, dest_relative(task, dest), entry->size, entry->mtime, result->hash);
+    console_printf("\n[新規コピー] %s を %s にコピー、ソース保持\n", src, dest);
+    log_message("%s -> %s: 新規コピー、ソース保持 [%s]\n", src, dest, result_buf);
+    return 0;
+}
+
+// 処理を終えたら0（失敗は-1）、ソース削除を検証・削除ステージに送ったら1を返す
+// （1の場合、ファイルの完了はステージが通知する）。start はこのファイルの処理を始めた時刻。
+int copy_or_delete_file(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest,
+                        FileOutcome *outcome, double start) {
+    FileInfo dest_info;
+    CopyResult result;
+    char result_buf[96];
+    const char *src_rel = source_relative(task, src);
+    JournalEntry resume;
+    *outcome = OUTCOME_NEW;
+    if (task->dir_moved && task->dir_moved[entry->dir]) {
+        // フォルダごと移動済み：ファイル名置換とインデックスの記録のみ
+        char moved[MAX_PATH];
+        int renamed = rename_moved_file(task, entry, dest, moved, sizeof(moved));
+        if (renamed != 0)
+            dest_index_record(task->index, dest_relative(task, moved), entry->size, entry->mtime, 0);
+        return renamed > 0 ? 0 : -1;
+    }
+    if (journal_lookup(task->journal, src_rel, entry, &resume)) {
+        int status = resume_file(task, entry, src, &resume, outcome, start);
+        if (status != 2)
+            return status;
+    }
+    if (get_file_info(dest, &dest_info)) {
+        int tier;
+        int identical;
+        double compare_start = monotonic_seconds();
+        if (dest_index_matches(task->index, dest_relative(task, dest), entry->size, entry->mtime, &dest_info)) {
+            tier = COMPARE_TIER_INDEX;
+            identical = 1;
+        } else {
+            identical = files_are_identical(src, dest, task->compare_mode, &tier);
+        }
+        task_stage(task, STAGE_COMPARE, compare_start);
+        ATOMIC_ADD(&task->compare_settled[tier], 1);
+        *outcome = identical ? OUTCOME_IDENTICAL : OUTCOME_DIFFERENT;
+        if (identical) {
+            dest_index_record(task->index, dest_relative(task, dest), entry->size, entry->mtime, 0);
+            if (g_deleteSource) {
+                // 同一判定を済ませているため、検証はせずに削除だけをステージに任せる
+                journal_plan(task->journal, src_rel, 'i', entry, dest_relative(task, dest));
+                delete_stage_submit(task, entry, src, dest, "同一ファイル", OUTCOME_IDENTICAL, 0, 0, "コピーせず", start);
+                return 1;
+            } else {
+                console_printf("\n[同一ファイル] %s と %s は同一。ソース保持\n", src, dest);
+                log_message("%s -> %s: 同一ファイル、ソース保持\n", src, dest);
+                return 0;
+            }
+        } else {
+            char new_dest[MAX_PATH];
+            generate_new_filename(dest, new_dest, sizeof(new_dest));
+            journal_plan(task->journal, src_rel, 'd', entry, dest_relative(task, new_dest));
+            if (task->same_volume && move_source_file(task, src, new_dest)) {
+                journal_mark(task->journal, src_rel, 'D');
+                dest_index_record(task->index, dest_relative(task, new_dest), entry->size, entry->mtime, 0);
+                console_printf("\n[異なるファイル] %s を %s として移動（同一ボリューム）\n", src, new_dest);
+                log_message("%s -> %s: 異なるファイル、同一ボリューム内で移動\n", src, new_dest);
+                return 0;
+            }
+            if (!copy_source_file(task, entry, src, new_dest, &result)) {
+                console_printf("\nエラー: %s を %s にコピーできませんでした。\n", src, new_dest);
+                log_message("%s -> %s: コピー失敗\n", src, new_dest);
+                return -1;
+            }
+            journal_mark(task->journal, src_rel, 'C');
+            record_copy_result(task, &result, entry->size);
+            format_copy_result(&result, entry->size, result_buf, sizeof(result_buf));
+            if (g_deleteSource) {
+                int verify = copy_needs_verify(&result);
+                if (!verify)
+                    dest_index_record(task->index, dest_relative(task, new_dest), entry->size, entry->mtime, result.hash);
+                delete_stage_submit(task, entry, src, new_dest, "異なるファイル", OUTCOME_DIFFERENT, verify, result.hash,
+                                    result_buf, start);
+                return 1;
+            }
+            dest_index_record(task->index, dest_relative(task, new_dest), entry->size, entry->mtime, result.hash);
+            console_printf("\n[異なるファイル] %s を %s としてコピー（ソース保持）\n", src, new_dest);
+            log_message("%s -> %s: 異なるファイル、ソース保持 [%s]\n", src, new_dest, result_buf);
+            return 0;
+        }
+    } else {
+        journal_plan(task->journal, src_rel, 'n', entry, dest_relative(task, dest));
+        if (task->same_volume && move_source_file(task, src, dest)) {
+            journal_mark(task->journal, src_rel, 'D');
+            dest_index_record(task->index, dest_relative(task, dest), entry->size, entry->mtime, 0);
+            console_printf("\n[新規移動] %s を %s に移動（同一ボリューム）\n", src, dest);
+            log_message("%s -> %s: 新規移動、同一ボリューム内で移動\n", src, dest);
+            return 0;
+        }
+        if (!copy_source_file(task, entry, src, dest, &result)) {
+            console_printf("\nエラー: %s を %s にコピーできませんでした。\n", src, dest);
+            log_message("%s -> %s: コピー失敗\n", src, dest);
+            return -1;
+        }
+        return finish_new_copy(task, entry, src, dest, &result, start);
+    }
+}
+
+// ----- ワークスティーリング・ワーカープール -----
+// 固定数のワーカースレッドがファイル単位のジョブを処理する。
+// 各ワーカーは専用の両端キュー（deque）を持ち、自分で積んだジョブは末尾から LIFO で取り出す。
+// 自分の deque が空になると、他のワーカーの deque の先頭（最も古いジョブ）から盗む。
+// これにより、1つの巨大なタスクのファイルも全ワーカーに分散される。
+typedef enum _JobType {
+    JOB_START_TASK,  // タスクのコピー先フォルダを作成し、ファイルジョブを投入する
+    JOB_COPY_FILES,  // マニフェスト上の連続したファイル範囲をコピー（または削除）する
+    JOB_COPY_RANGE   // 分割コピー中の大きなファイルの残りの範囲を手伝う
+} JobType;
+
+// 1ジョブで順に処理するファイル数の上限。これより大きい範囲は半分に分割して積み直し、
+// 他のワーカーが盗めるようにする。
+#define FILES_PER_JOB 16
+
+typedef struct _Job {
+    JobType type;
+    CopyTask *task;
+    size_t first;       // ファイル範囲の先頭（マニフェストのファイル番号）
+    size_t count;       // ファイル範囲の件数
+    struct _RangeCopy *range; // 手伝う分割コピー（JOB_COPY_RANGE のみ）
+    struct _Job *next;  // デバイスに預けられている間の連結
+} Job;
+
+typedef struct _WorkDeque {
+    Mutex lock;
+    Job **items;        // リングバッファ
+    size_t capacity;
+    size_t head;        // 盗む側の位置（最も古いジョブ）
+    size_t count;
+} WorkDeque;
+
+typedef struct _WorkerPool {
+    int worker_count;
+    WorkDeque *deques;
+    Thread *threads;
+    struct _WorkerContext *contexts;
+    Mutex lock;
+    CondVar work_available;
+    CondVar all_done;
+    long queued;        // deque に積まれているジョブ数
+    long sleeping;      // 待機中のワーカー数
+    long active;        // 投入済みで未完了のジョブ数
+    unsigned long next_deque; // ワーカー外からの投入先（ラウンドロビン）
+    int delete_threads; // 検証・削除ステージのスレッド数（ソース削除時のみ）
+    int shutdown;
+} WorkerPool;
+
+typedef struct _WorkerContext {
+    WorkerPool *pool;
+    int worker_id;
+} WorkerContext;
+
+WorkerPool g_pool;
+
+// 実行中のワーカーの番号（ワーカー以外のスレッドでは-1）
+static THREAD_LOCAL int t_workerId = -1;
+
+static int pool_worker_count(void) {
+    return g_pool.worker_count;
+}
+
+static void deque_init(WorkDeque *dq) {
+    mutex_init(&dq->lock);
+    dq->capacity = 64;
+    dq->items = (Job**)malloc(dq->capacity * sizeof(Job*));
+    dq->head = 0;
+    dq->count = 0;
+}
+static void deque_destroy(WorkDeque *dq) {
+    free(dq->items);
+    mutex_destroy(&dq->lock);
+}
+// 末尾にジョブを積む（容量不足なら2倍に拡張）
+static void deque_push(WorkDeque *dq, Job *job) {
+    mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t new_capacity = dq->capacity * 2;
+        Job **items = (Job**)malloc(new_capacity * sizeof(Job*));
+        if (!items) {
+            printf("エラー: ジョブキューのメモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < dq->count; i++)
+            items[i] = dq->items[(dq->head + i) % dq->capacity];
+        free(dq->items);
+        dq->items = items;
+        dq->capacity = new_capacity;
+        dq->head = 0;
+    }
+    dq->items[(dq->head + dq->count) % dq->capacity] = job;
+    dq->count++;
+    mutex_unlock(&dq->lock);
+}
+// 所有ワーカー用：末尾から取り出す（LIFO）
+static Job *deque_pop(WorkDeque *dq) {
+    Job *job = NULL;
+    mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        job = dq->items[(dq->head + dq->count) % dq->capacity];
+    }
+    mutex_unlock(&dq->lock);
+    return job;
+}
+// 他ワーカー用：先頭から盗む（FIFO）
+static Job *deque_steal(WorkDeque *dq) {
+    Job *job = NULL;
+    mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        job = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->count--;
+    }
+    mutex_unlock(&dq->lock);
+    return job;
+}
+
+void run_job(WorkerPool *pool, Job *job, int worker_id);
+
+// ジョブを投入する。worker_id が負の場合はワーカー外（メインスレッド）からの投入
+void pool_submit(WorkerPool *pool, Job *job, int worker_id) {
+    ATOMIC_ADD(&pool->active, 1);
+    int target = worker_id >= 0 ? worker_id
+                                : (int)(ATOMIC_ADD(&pool->next_deque, 1) % pool->worker_count);
+    deque_push(&pool->deques[target], job);
+    ATOMIC_ADD(&pool->queued, 1);
+    // 待機中のワーカーがいる場合のみ起こす（queued と sleeping の順序で起こし漏れを防ぐ）
+    if (ATOMIC_LOAD(&pool->sleeping) > 0) {
+        mutex_lock(&pool->lock);
+        cond_signal(&pool->work_available);
+        mutex_unlock(&pool->lock);
+    }
+}
+
+static Job *pool_take(WorkerPool *pool, int worker_id) {
+    Job *job = deque_pop(&pool->deques[worker_id]);
+    for (int i = 1; !job && i < pool->worker_count; i++)
+        job = deque_steal(&pool->deques[(worker_id + i) % pool->worker_count]);
+    if (job)
+        ATOMIC_SUB(&pool->queued, 1);
+    return job;
+}
+
+// 投入済みの処理が1つ完了した（最後の1つなら pool_wait を起こす）
+static void pool_job_done(WorkerPool *pool) {
+    if (ATOMIC_SUB(&pool->active, 1) == 0) {
+        mutex_lock(&pool->lock);
+        cond_broadcast(&pool->all_done);
+        mutex_unlock(&pool->lock);
+    }
+}
+
+static void worker_main(void *arg) {
+    WorkerContext *ctx = (WorkerContext*)arg;
+    WorkerPool *pool = ctx->pool;
+    t_telemetrySlot = ctx->worker_id + 1;
+    t_workerId = ctx->worker_id;
+    for (;;) {
+        Job *job = pool_take(pool, ctx->worker_id);
+        if (job) {
+            run_job(pool, job, ctx->worker_id);
+            pool_job_done(pool);
+            continue;
+        }
+        mutex_lock(&pool->lock);
+        ATOMIC_ADD(&pool->sleeping, 1);
+        while (ATOMIC_LOAD(&pool->queued) == 0 && !pool->shutdown)
+            cond_wait(&pool->work_available, &pool->lock);
+        ATOMIC_SUB(&pool->sleeping, 1);
+        int stop = pool->shutdown && ATOMIC_LOAD(&pool->queued) == 0;
+        mutex_unlock(&pool->lock);
+        if (stop)
+            break;
+    }
+    dir_cache_release();
+    uring_release();
+}
+
+// ----- 検証・削除ステージ -----
+// ソース削除が有効な場合、コピーを終えたファイルはその場で削除せずにこのステージへ送る。
+// 専用のスレッドがまとめて取り出し、コピー先を読み直してコピー中に計算した内容ハッシュと
+// 照合してから、一致したコピー元だけをまとめて削除する。コピーを行うワーカーは検証・削除を
+// 待たずに次のファイルへ進み、ステージはその後を追いかける。
+// ステージに送ったファイルはプールの未完了数に数えるため、pool_wait は削除の完了まで待つ。
+#define DELETE_BATCH 64           // 1回にまとめて取り出す件数
+#define DELETE_QUEUE_LIMIT 4096   // これを超えて溜まったら、送る側が空くまで待つ
+
+typedef struct _DeleteItem {
+    struct _DeleteItem *next;
+    CopyTask *task;
+    const ManifestEntry *entry;
+    const char *label;          // 表示用の処理の種類（"新規コピー" など）
+    FileOutcome outcome;
+    int verify;                 // 非0ならコピー先を検証してから削除する
+    int ok;
+    unsigned long long hash;    // コピー中に計算したコピー元の内容ハッシュ（0 なら未計算）
+    double start;               // ファイルの処理を始めた時刻
+    char note[96];              // ログに添える情報（コピー方式と速度など）
+    char *dest;                 // paths 内のコピー先
+    char paths[];               // コピー元とコピー先（'\0' 区切り）
+} DeleteItem;
+
+typedef struct _DeleteStage {
+    WorkerPool *pool;
+    Mutex lock;
+    CondVar available;
+    CondVar space;
+    DeleteItem *head;
+    DeleteItem *tail;
+    size_t queued;
+    int stopping;
+    Thread *threads;
+    int *ids;
+} DeleteStage;
+
+static DeleteStage g_deleteStage;
+
+void release_directory(CopyTask *task, unsigned int dir);
+
+// コピー元のソース削除をステージに送る
+void delete_stage_submit(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest, const char *label,
+                         FileOutcome outcome, int verify, unsigned long long hash, const char *note, double start) {
+    DeleteStage *stage = &g_deleteStage;
+    size_t src_len = strlen(src), dest_len = strlen(dest);
+    DeleteItem *item = (DeleteItem*)malloc(sizeof(DeleteItem) + src_len + dest_len + 2);
+    if (!item) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    item->next = NULL;
+    item->task = task;
+    item->entry = entry;
+    item->label = label;
+    item->outcome = outcome;
+    item->verify = verify;
+    item->ok = 0;
+    item->hash = hash;
+    item->start = start;
+    snprintf(item->note, sizeof(item->note), "%s", note);
+    memcpy(item->paths, src, src_len + 1);
+    item->dest = item->paths + src_len + 1;
+    memcpy(item->dest, dest, dest_len + 1);
+    ATOMIC_ADD(&stage->pool->active, 1);
+    mutex_lock(&stage->lock);
+    while (stage->queued >= DELETE_QUEUE_LIMIT)
+        cond_wait(&stage->space, &stage->lock);
+    if (stage->tail)
+        stage->tail->next = item;
+    else
+        stage->head = item;
+    stage->tail = item;
+    stage->queued++;
+    cond_signal(&stage->available);
+    mutex_unlock(&stage->lock);
+}
+
+// ファイルを先頭から COPY_BUFFER_SIZE ずつ読み、内容ハッシュを計算する（コピー中の計算と同じ区切り）。
+// direct が非0なら OS のキャッシュを通さずに読む（開けなければ通常どおり読む）。成功で非0
+static int hash_file(const char *path, unsigned long long size, int direct, char *buf, unsigned long long *hash) {
+    FileHandle h = direct ? file_open_read(path, 1) : INVALID_FILE_HANDLE;
+    if (h == INVALID_FILE_HANDLE) {
+        direct = 0;
+        h = file_open_read(path, 0);
+        if (h == INVALID_FILE_HANDLE)
+            return 0;
+    }
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    if (!direct)
+        posix_fadvise(h, 0, 0, POSIX_FADV_SEQUENTIAL);  // 先読みを広げる
+#endif
+    unsigned long long h64 = CONTENT_HASH_SEED, offset = 0;
+    int ok = 1;
+    while (ok && offset < size) {
+        size_t want = size - offset < COPY_BUFFER_SIZE ? (size_t)(size - offset) : COPY_BUFFER_SIZE;
+        size_t got = 0;
+        while (got < want) {
+            size_t len = want - got;
+            if (direct)
+                len = (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+            long long n = file_pread(h, buf + got, len, offset + got);
+            if (n <= 0) {
+                ok = 0;
+                break;
+            }
+            got += (size_t)n < want - got ? (size_t)n : want - got;
+        }
+        if (ok) {
+            h64 = content_hash_update(h64, buf, want);
+            offset += want;
+        }
+    }
+    file_close(h);
+    *hash = content_hash_final(h64);
+    return ok;
+}
+
+// コピー先がコピー元と同じ内容か確かめる。コピー元のハッシュが無い場合はコピー元も読む。
+// 一致すれば非0を返し、dest_hash にコピー先の内容ハッシュを設定する。
+static int verify_copy(const DeleteItem *item, char *buf, unsigned long long *dest_hash) {
+    FileInfo info;
+    unsigned long long size = item->entry->size, src_hash = item->hash;
+    if (!get_file_info(item->dest, &info) || info.size != size)
+        return 0;
+    if (!hash_file(item->dest, size, g_settings.verify >= 2, buf, dest_hash))
+        return 0;
+    if (src_hash == 0 && !hash_file(item->paths, size, 0, buf, &src_hash))
+        return 0;
+    return src_hash == *dest_hash;
+}
+
+// 取り出した分を検証し、検証できたコピー元をまとめて削除する
+static void delete_stage_process(DeleteItem **batch, int count, char *buf) {
+    for (int i = 0; i < count; i++) {
+        DeleteItem *item = batch[i];
+        CopyTask *task = item->task;
+        item->ok = 1;
+        if (!item->verify)
+            continue;
+        unsigned long long hash = 0;
+        double start = monotonic_seconds();
+        item->ok = verify_copy(item, buf, &hash);
+        task_stage(task, STAGE_VERIFY, start);
+        if (item->ok) {
+            dest_index_record(task->index, dest_relative(task, item->dest), item->entry->size, item->entry->mtime, hash);
+        } else {
+            // 壊れたコピー先は削除し、次回の実行でコピーし直させる
+            console_printf("\nエラー: %s のコピー先 %s の検証に失敗しました。ソースは削除しません。\n", item->paths, item->dest);
+            log_message("%s -> %s: 検証失敗、コピー先を削除しソース保持\n", item->paths, item->dest);
+            delete_file(item->dest);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        DeleteItem *item = batch[i];
+        CopyTask *task = item->task;
+        const ManifestEntry *entry = item->entry;
+        const char *src = item->paths;
+        if (item->ok) {
+            if (delete_source_file(task, src)) {
+                journal_mark(task->journal, source_relative(task, src), 'D');
+                console_printf("\n[%s] %s -> %s : ソース削除%s\n", item->label, src, item->dest, item->verify ? "（検証済み）" : "");
+                log_message("%s -> %s: %s、%sソース削除 [%s]\n", src, item->dest, item->label,
+                            item->verify ? "検証済み、" : "", item->note);
+            } else {
+                console_printf("\nエラー: %s の削除に失敗しました。\n", src);
+                log_message("%s -> %s: 削除失敗\n", src, item->dest);
+                item->ok = 0;
+            }
+        }
+        task_file_done(task, item->ok ? item->outcome : OUTCOME_FAILED, entry->size, item->start);
+        if (!item->ok && task->file_failed)
+            task->file_failed[entry - task->manifest.files] = 1;
+        if (item->ok)
+            ATOMIC_ADD(&task->copied_size, entry->size);
+        release_directory(task, entry->dir);
+        free(item);
+        pool_job_done(g_deleteStage.pool);
+    }
+}
+
+static void delete_stage_main(void *arg) {
+    DeleteStage *stage = &g_deleteStage;
+    t_telemetrySlot = stage->pool->worker_count + 1 + *(int*)arg;
+    char *buf = (char*)aligned_buffer_alloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    DeleteItem *batch[DELETE_BATCH];
+    for (;;) {
+        mutex_lock(&stage->lock);
+        while (!stage->head && !stage->stopping)
+            cond_wait(&stage->available, &stage->lock);
+        int count = 0;
+        while (stage->head && count < DELETE_BATCH) {
+            batch[count++] = stage->head;
+            stage->head = stage->head->next;
+        }
+        if (!stage->head)
+            stage->tail = NULL;
+        stage->queued -= (size_t)count;
+        if (count > 0)
+            cond_broadcast(&stage->space);
+        mutex_unlock(&stage->lock);
+        if (count == 0)
+            break;      // 停止要求があり、残りも無い
+        delete_stage_process(batch, count, buf);
+    }
+    aligned_buffer_free(buf);
+    dir_cache_release();
+}
+
+// ステージのスレッドを開始する（成功で非0）
+static int delete_stage_start(WorkerPool *pool, int thread_count) {
+    DeleteStage *stage = &g_deleteStage;
+    memset(stage, 0, sizeof(*stage));
+    stage->pool = pool;
+    mutex_init(&stage->lock);
+    cond_init(&stage->available);
+    cond_init(&stage->space);
+    stage->threads = (Thread*)calloc(thread_count, sizeof(Thread));
+    stage->ids = (int*)calloc(thread_count, sizeof(int));
+    if (!stage->threads || !stage->ids)
+        return 0;
+    pool->delete_threads = 0;
+    for (int i = 0; i < thread_count; i++) {
+        stage->ids[i] = i;
+        if (!thread_create(&stage->threads[i], delete_stage_main, &stage->ids[i])) {
+            console_printf("エラー: 削除スレッド %d の作成に失敗しました。\n", i + 1);
+            break;
+        }
+        pool->delete_threads++;
+    }
+    return pool->delete_threads > 0;
+}
+
+static void delete_stage_stop(WorkerPool *pool) {
+    DeleteStage *stage = &g_deleteStage;
+    mutex_lock(&stage->lock);
+    stage->stopping = 1;
+    cond_broadcast(&stage->available);
+    mutex_unlock(&stage->lock);
+    for (int i = 0; i < pool->delete_threads; i++)
+        thread_join(stage->threads[i]);
+    cond_destroy(&stage->space);
+    cond_destroy(&stage->available);
+    mutex_destroy(&stage->lock);
+    free(stage->threads);
+    free(stage->ids);
+    pool->delete_threads = 0;
+}
+
+// タスクの計測領域の数（メインスレッド、ワーカー、検証・削除ステージのスレッド）
+int pool_telemetry_slots(const WorkerPool *pool) {
+    return pool->worker_count + 1 + pool->delete_threads;
+}
+
+// ワーカープールを開始する（成功で非0）
+int pool_start(WorkerPool *pool, int worker_count) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker_count = worker_count > 0 ? worker_count : 1;
+    pool->deques = (WorkDeque*)calloc(pool->worker_count, sizeof(WorkDeque));
+    pool->threads = (Thread*)calloc(pool->worker_count, sizeof(Thread));
+    pool->contexts = (WorkerContext*)calloc(pool->worker_count, sizeof(WorkerContext));
+    if (!pool->deques || !pool->threads || !pool->contexts)
+        return 0;
+    mutex_init(&pool->lock);
+    cond_init(&pool->work_available);
+    cond_init(&pool->all_done);
+    for (int i = 0; i < pool->worker_count; i++)
+        deque_init(&pool->deques[i]);
+    for (int i = 0; i < pool->worker_count; i++) {
+        pool->contexts[i].pool = pool;
+        pool->contexts[i].worker_id = i;
+        if (!thread_create(&pool->threads[i], worker_main, &pool->contexts[i])) {
+            console_printf("エラー: ワーカースレッド %d の作成に失敗しました。\n", i + 1);
+            pool->worker_count = i;
+            break;
+        }
+    }
+    // ソース削除が有効なら、検証・削除ステージも開始する
+    if (pool->worker_count > 0 && g_deleteSource && !delete_stage_start(pool, g_settings.delete_threads))
+        return 0;
+    return pool->worker_count > 0;
+}
+
+// 投入済みのジョブがすべて完了するまで待機する
+void pool_wait(WorkerPool *pool) {
+    mutex_lock(&pool->lock);
+    while (ATOMIC_LOAD(&pool->active) > 0)
+        cond_wait(&pool->all_done, &pool->lock);
+    mutex_unlock(&pool->lock);
+}
+
+// ワーカーを終了させ、資源を解放する
+void pool_stop(WorkerPool *pool) {
+    mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    cond_broadcast(&pool->work_available);
+    mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->worker_count; i++)
+        thread_join(pool->threads[i]);
+    if (pool->delete_threads > 0)
+        delete_stage_stop(pool);
+    for (int i = 0; i < pool->worker_count; i++)
+        deque_destroy(&pool->deques[i]);
+    cond_destroy(&pool->all_done);
+    cond_destroy(&pool->work_available);
+    mutex_destroy(&pool->lock);
+    free(pool->contexts);
+    free(pool->threads);
+    free(pool->deques);
+}
+
+Job *job_create(JobType type, CopyTask *task, size_t first, size_t count) {
+    Job *job = (Job*)malloc(sizeof(Job));
+    if (!job) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    job->type = type;
+    job->task = task;
+    job->first = first;
+    job->count = count;
+    job->range = NULL;
+    job->next = NULL;
+    return job;
+}
+
+// ----- 重複排除 -----
+// 実行するすべてのタスクのファイルから、同じ内容のファイルを事前に見つけておく。
+// 判定はサイズ → 先頭・末尾のハッシュ → 全体のハッシュの順に絞り込み、
+// 前の段階で候補が1件だけになったファイルはそれ以上読まない。
+// コピー時には、同じグループのファイルが既にどこかにコピーされていれば、
+// そのコピー先からハードリンクまたは reflink で作成する。別のファイルシステム上にある、
+// 削除されたなどで作成できなければ、通常どおりコピーする（そのコピーが次の作成元になる）。
+// リンクを作る前にコピー元と作成元の中身を最後まで比較し、一致しなければ通常どおりコピーする
+// （ハッシュの衝突で別の内容のファイルを作ることはない）。
+#define DEDUP_MIN_SIZE (64 * 1024)      // これより小さいファイルは対象にしない
+
+// 同じ内容のファイルのグループ
+typedef struct _DedupGroup {
+    unsigned long long size;
+    unsigned long long partial;
+    unsigned long long full;
+    char *path;                 // このグループで最初に書き込んだコピー先（まだなければ NULL）
+} DedupGroup;
+
+// 重複判定の候補
+typedef struct _DedupCandidate {
+    CopyTask *task;             // NULL なら前のタスクで作ったグループ
+    size_t index;               // マニフェストのファイル番号（グループなら g_dedup.groups の添字）
+    unsigned long long size;
+    unsigned long long partial; // 先頭・末尾のハッシュ
+    unsigned long long full;    // 全体のハッシュ
+    int level;                  // 計算済みの段階（0: なし / 1: 先頭・末尾 / 2: 全体、-1: 対象外）
+} DedupCandidate;
+
+typedef struct _Dedup {
+    Mutex lock;                 // groups[].path を保護する
+    DedupGroup *groups;
+    size_t group_count;
+    size_t group_capacity;
+} Dedup;
+
+Dedup g_dedup;
+
+// ハッシュを計算するスレッドの共有情報
+typedef struct _DedupHashWork {
+    DedupCandidate *cands;
+    size_t *items;              // 計算する候補の番号
+    size_t count;
+    size_t next;                // 次に取り出す items の位置（原子的に進める）
+    int level;                  // 計算する段階
+} DedupHashWork;
+
+// 先頭と末尾の SAMPLE_SIZE バイトのハッシュ（ファイル全体がこれに収まる場合は呼ばない）
+static int dedup_partial_hash(const char *path, unsigned long long size, char *buf, unsigned long long *hash) {
+    FileHandle h = file_open_read(path, 0);
+    if (h == INVALID_FILE_HANDLE)
+        return 0;
+    int ok = file_pread(h, buf, SAMPLE_SIZE, 0) == SAMPLE_SIZE &&
+             file_pread(h, buf + SAMPLE_SIZE, SAMPLE_SIZE, size - SAMPLE_SIZE) == SAMPLE_SIZE;
+    file_close(h);
+    *hash = content_hash_final(content_hash_update(CONTENT_HASH_SEED, buf, 2 * SAMPLE_SIZE));
+    return ok;
+}
+
+static void dedup_hash_main(void *arg) {
+    DedupHashWork *work = (DedupHashWork*)arg;
+    char *buf = (char*)malloc(COPY_BUFFER_SIZE > 2 * SAMPLE_SIZE ? COPY_BUFFER_SIZE : 2 * SAMPLE_SIZE);
+    if (!buf) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    for (;;) {
+        size_t at = ATOMIC_ADD(&work->next, 1) - 1;
+        if (at >= work->count)
+            break;
+        DedupCandidate *c = &work->cands[work->items[at]];
+        char path[MAX_PATH];
+        if (work->level == 1) {
+            // コピー先が既にあるファイルは同一判定に回るため、読まずに対象から外す
+            task_dest_file_path(c->task, c->index, path, sizeof(path));
+            if (path_exists(path)) {
+                c->level = -1;
+                continue;
+            }
+        }
+        manifest_file_path(&c->task->manifest, c->task->src, c->index, path, sizeof(path));
+        if (work->level == 2 || c->size <= 2 * (unsigned long long)SAMPLE_SIZE) {
+            // 全体が先頭・末尾に収まるファイルは、はじめから全体のハッシュにする
+            if (!hash_file(path, c->size, 0, buf, &c->full)) {
+                c->level = -1;
+                continue;
+            }
+            if (work->level == 1)
+                c->partial = c->full;
+            c->level = 2;
+            ATOMIC_ADD(&g_dedupStats.full_hashed, 1);
+            ATOMIC_ADD(&g_dedupStats.hashed_bytes, c->size);
+        } else {
+            if (!dedup_partial_hash(path, c->size, buf, &c->partial)) {
+                c->level = -1;
+                continue;
+            }
+            c->level = 1;
+            ATOMIC_ADD(&g_dedupStats.partial_hashed, 1);
+            ATOMIC_ADD(&g_dedupStats.hashed_bytes, 2 * (unsigned long long)SAMPLE_SIZE);
+        }
+    }
+    free(buf);
+    dir_cache_release();
+}
+
+// items の候補のハッシュを、ワーカーと同じ数のスレッドで並列に計算する
+static void dedup_hash_all(DedupCandidate *cands, size_t *items, size_t count, int level) {
+    DedupHashWork work = { cands, items, count, 0, level };
+    int thread_count = pool_worker_count() > 0 ? pool_worker_count() : 1;
+    if ((size_t)thread_count > count)
+        thread_count = (int)count;
+    if (thread_count <= 1) {
+        if (count > 0)
+            dedup_hash_main(&work);
+        return;
+    }
+    Thread *threads = (Thread*)malloc(sizeof(Thread) * thread_count);
+    if (!threads) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    int started = 0;
+    for (; started < thread_count; started++) {
+        if (!thread_create(&threads[started], dedup_hash_main, &work))
+            break;
+    }
+    if (started == 0)
+        dedup_hash_main(&work);
+    for (int i = 0; i < started; i++)
+        thread_join(threads[i]);
+    free(threads);
+}
+
+// サイズ → 先頭・末尾 → 全体の順に並べる（対象外は同じサイズの先頭に、同じ値ならグループを先に置く）
+static int dedup_compare(const void *a, const void *b) {
+    const DedupCandidate *x = (const DedupCandidate*)a, *y = (const DedupCandidate*)b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    if ((x->level < 0) != (y->level < 0))
+        return x->level < 0 ? -1 : 1;
+    if (x->partial != y->partial)
+        return x->partial < y->partial ? -1 : 1;
+    if (x->full != y->full)
+        return x->full < y->full ? -1 : 1;
+    if ((x->task == NULL) != (y->task == NULL))
+        return x->task == NULL ? -1 : 1;
+    return 0;
+}
+
+// 2つの候補が段階 level まで同じ内容とみなせるか
+static int dedup_same(const DedupCandidate *a, const DedupCandidate *b, int level) {
+    if (a->size != b->size || a->level < level || b->level < level)
+        return 0;
+    if (level >= 1 && a->partial != b->partial)
+        return 0;
+    return level < 2 || a->full == b->full;
+}
+
+// 並び替えた候補を同じ内容（段階 level まで）の並びに区切り、2件以上でファイルを含む並びについて
+// まだ段階 level+1 を計算していないファイルの番号を items に集める。集めた件数を返す。
+static size_t dedup_collect(DedupCandidate *cands, size_t count, int level, size_t *items) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; ) {
+        size_t j = i + 1;
+        int files = cands[i].task != NULL;
+        while (j < count && dedup_same(&cands[i], &cands[j], level)) {
+            files |= cands[j].task != NULL;
+            j++;
+        }
+        if (j - i >= 2 && files && cands[i].level >= level) {
+            for (size_t k = i; k < j; k++) {
+                if (cands[k].task && cands[k].level == level)
+                    items[n++] = k;
+            }
+        }
+        i = j;
+    }
+    return n;
+}
+
+// 実行するタスクのファイルの重複を判定し、各ファイルのグループを task->dedup_group に設定する。
+// 前に呼んだときに作ったグループ（個別確認で先に実行したタスク）も判定に含める。
+void dedup_plan(CopyTask *tasks, int task_count) {
+    if (g_settings.dedup == DEDUP_OFF)
+        return;
+    double start = monotonic_seconds();
+    size_t count = g_dedup.group_count, capacity = 0;
+    for (int t = 0; t < task_count; t++) {
+        if (!tasks[t].archive && !(g_deleteSource && same_volume(tasks[t].src, tasks[t].dest)))
+            capacity += tasks[t].manifest.file_count;   // アーカイブと同一ボリュームでの移動は対象外
+    }
+    if (capacity == 0)
+        return;
+    capacity += count;
+    DedupCandidate *cands = (DedupCandidate*)calloc(capacity, sizeof(DedupCandidate));
+    size_t *items = (size_t*)malloc(capacity * sizeof(size_t));
+    if (!cands || !items) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    for (size_t g = 0; g < count; g++) {
+        cands[g].index = g;
+        cands[g].size = g_dedup.groups[g].size;
+        cands[g].partial = g_dedup.groups[g].partial;
+        cands[g].full = g_dedup.groups[g].full;
+        cands[g].level = 2;
+    }
+    for (int t = 0; t < task_count; t++) {
+        const Manifest *m = &tasks[t].manifest;
+        if (tasks[t].archive || (g_deleteSource && same_volume(tasks[t].src, tasks[t].dest)))
+            continue;
+        for (size_t i = 0; i < m->file_count; i++) {
+            if (m->files[i].size < DEDUP_MIN_SIZE)
+                continue;
+            cands[count].task = &tasks[t];
+            cands[count].index = i;
+            cands[count].size = m->files[i].size;
+            count++;
+        }
+    }
+    // サイズ → 先頭・末尾 → 全体の順に、候補が2件以上残るものだけを読む
+    for (int level = 0; level < 2; level++) {
+        qsort(cands, count, sizeof(DedupCandidate), dedup_compare);
+        size_t n = dedup_collect(cands, count, level, items);
+        if (level == 0)
+            g_dedupStats.candidates += n;
+        dedup_hash_all(cands, items, n, level + 1);
+    }
+    qsort(cands, count, sizeof(DedupCandidate), dedup_compare);
+    unsigned long long duplicates = 0;
+    for (size_t i = 0; i < count; ) {
+        size_t j = i + 1;
+        while (j < count && dedup_same(&cands[i], &cands[j], 2))
+            j++;
+        if (j - i >= 2 && cands[i].level == 2) {
+            size_t group;
+            if (cands[i].task == NULL) {
+                group = cands[i].index;
+            } else {
+                if (g_dedup.group_count == g_dedup.group_capacity)
+                    g_dedup.groups = (DedupGroup*)grow_array(g_dedup.groups, &g_dedup.group_capacity, sizeof(DedupGroup));
+                group = g_dedup.group_count++;
+                DedupGroup *g = &g_dedup.groups[group];
+                g->size = cands[i].size;
+                g->partial = cands[i].partial;
+                g->full = cands[i].full;
+                g->path = NULL;
+            }
+            for (size_t k = i; k < j; k++) {
+                CopyTask *task = cands[k].task;
+                if (!task)
+                    continue;
+                if (!task->dedup_group) {
+                    task->dedup_group = (unsigned int*)calloc(task->manifest.file_count, sizeof(unsigned int));
+                    if (!task->dedup_group) {
+                        printf("エラー: メモリ確保に失敗しました。\n");
+                        exit(1);
+                    }
+                }
+                task->dedup_group[cands[k].index] = (unsigned int)group + 1;
+                if (k > i)
+                    duplicates++;   // 最初の1件（新しいグループの場合）は重複に数えない
+            }
+        }
+        i = j;
+    }
+    free(items);
+    free(cands);
+    g_dedupStats.duplicates += duplicates;
+    g_dedupStats.hash_seconds += monotonic_seconds() - start;
+    char size_buf[64];
+    format_size(g_dedupStats.hashed_bytes, size_buf, sizeof(size_buf));
+    console_printf("重複排除: 候補 %llu 件, 重複 %llu 件（ハッシュ %s 読み込み, %.2f 秒）\n",
+           g_dedupStats.candidates, duplicates, size_buf, monotonic_seconds() - start);
+    log_message("重複排除: 候補 %llu 件, 先頭・末尾ハッシュ %llu 件, 全体ハッシュ %llu 件, 重複 %llu 件, "
+                "読み込み %s, %.2f 秒\n", g_dedupStats.candidates, g_dedupStats.partial_hashed,
+                g_dedupStats.full_hashed, duplicates, size_buf, monotonic_seconds() - start);
+}
+
+// 重複グループのファイルなら、同じグループのコピー済みのファイルから dest を作る。
+// 作成できたら非0（result の方式は BACKEND_DEDUP、ハッシュはグループの全体のハッシュ）。
+int dedup_materialize(CopyTask *task, const ManifestEntry *entry, const char *src, const char *dest, CopyResult *result) {
+    if (!task->dedup_group)
+        return 0;
+    unsigned int group = task->dedup_group[entry - task->manifest.files];
+    if (group == 0)
+        return 0;
+    DedupGroup *g = &g_dedup.groups[group - 1];
+    char from[MAX_PATH];
+    mutex_lock(&g_dedup.lock);
+    int have = g->path != NULL;
+    if (have)
+        snprintf(from, sizeof(from), "%s", g->path);
+    mutex_unlock(&g_dedup.lock);
+    if (!have)
+        return 0;
+    double start = monotonic_seconds();
+    // ハッシュの一致だけでは別の内容の可能性が残るため、作成元と中身を最後まで比べてからリンクする
+    int tier;
+    if (!files_are_identical(src, from, COMPARE_FULL, &tier)) {
+        log_message("%s: 重複排除の作成元 %s と内容が異なるため通常どおりコピー\n", src, from);
+        return 0;
+    }
+    int ok = g_settings.dedup == DEDUP_HARDLINK ? link_file(from, dest) : clone_file(from, src, dest);
+    if (!ok)
+        return 0;
+    memset(result, 0, sizeof(*result));
+    result->backend = BACKEND_DEDUP;
+    result->hash = g->full;
+    result->seconds = monotonic_seconds() - start;
+    ATOMIC_ADD(&g_dedupStats.linked_files, 1);
+    ATOMIC_ADD(&g_dedupStats.saved_bytes, entry->size);
+    return 1;
+}
+
+// 重複グループのファイルを通常どおりコピーしたら、以降のリンクの作成元として登録する
+void dedup_register(CopyTask *task, const ManifestEntry *entry, const char *dest) {
+    if (!task->dedup_group)
+        return;
+    unsigned int group = task->dedup_group[entry - task->manifest.files];
+    if (group == 0)
+        return;
+    DedupGroup *g = &g_dedup.groups[group - 1];
+    mutex_lock(&g_dedup.lock);
+    // 前の作成元からリンクできなかった（削除された、別のファイルシステムにある）場合も置き換える
+    char *path = strdup(dest);
+    if (path) {
+        free(g->path);
+        g->path = path;
+    }
+    mutex_unlock(&g_dedup.lock);
+}
+
+// 実行全体の重複排除の結果を表示・記録し、グループを解放する
+void dedup_finish(void) {
+    if (g_settings.dedup == DEDUP_OFF)
+        return;
+    const DedupStats *d = &g_dedupStats;
+    char saved_buf[64], hashed_buf[64];
+    format_size(d->saved_bytes, saved_buf, sizeof(saved_buf));
+    format_size(d->hashed_bytes, hashed_buf, sizeof(hashed_buf));
+    console_printf("重複排除: %llu 件を%sで作成、%s のコピーを省略（ハッシュ %s 読み込み, %.2f 秒）\n",
+           d->linked_files, g_settings.dedup == DEDUP_HARDLINK ? "ハードリンク" : "reflink", saved_buf,
+           hashed_buf, d->hash_seconds);
+    log_message("重複排除: %llu 件を%sで作成, 節約 %s (%llu バイト), ハッシュ読み込み %s, %.2f 秒\n",
+                d->linked_files, g_settings.dedup == DEDUP_HARDLINK ? "ハードリンク" : "reflink", saved_buf,
+                d->saved_bytes, hashed_buf, d->hash_seconds);
+    for (size_t i = 0; i < g_dedup.group_count; i++)
+        free(g_dedup.groups[i].path);
+    free(g_dedup.groups);
+    g_dedup.groups = NULL;
+    g_dedup.group_count = g_dedup.group_capacity = 0;
+}
+
+// ----- デバイス別スケジューラ -----
+// タスクのコピー元・コピー先が載っている物理デバイスごとに、同時にファイルを処理するジョブ数（ストリーム数）と
+// 転送帯域を制限する。同じ HDD を複数のタスクが同時に読み書きするとシークが増えて遅くなるため、
+// 回転ディスク（HDD）は既定で hdd_streams 本に絞り、SSD やメモリ上のファイルシステムは制限しない。
+// settings.txt の device_limit で、パスごとに同時実行数と帯域（MB/s）を指定できる。
+// 上限に達したデバイスのジョブはそのデバイスに預けられ、ワーカーは他のデバイスのジョブを処理する。
+// 預けたジョブは、同じデバイスのジョブが終わったときに投入し直される。
+#define MAX_DEVICES 64
+
+typedef struct _Device {
+    unsigned long long id;          // 物理デバイスの識別子（パーティションはディスク単位にまとめる）
+    char name[64];                  // 表示名（例: sda, C:\）
+    int rotational;                 // 回転ディスク（HDD）なら1
+    int max_streams;                // 同時に処理するジョブ数の上限（0 なら無制限）
+    int active;                     // 処理中のジョブ数
+    unsigned long long bytes_per_sec; // 帯域の上限（0 なら無制限）
+    double next_free;               // 帯域制限：次の転送を始められる時刻（monotonic_seconds）
+    Job *parked;                    // 空きを待っているジョブ
+} Device;
+
+Device g_devices[MAX_DEVICES];
+int g_deviceCount = 0;
+Mutex g_deviceLock;
+
+// path が載っている物理デバイスを調べる（識別子、調べられなければ0）
+static unsigned long long device_identify(const char *path, char *name, size_t namesize, int *rotational) {
+    *rotational = 0;
+#ifdef _WIN32
+    char volume[MAX_PATH];
+    DWORD serial = 0;
+    if (!GetVolumePathName(path, volume, MAX_PATH) ||
+        !GetVolumeInformation(volume, NULL, 0, &serial, NULL, NULL, NULL, 0))
+        return 0;
+    snprintf(name, namesize, "%s", volume);
+    // ドライブ文字のボリュームなら、シークの有無（HDD かどうか）を問い合わせる
+    if (volume[0] != '\0' && volume[1] == ':') {
+        char device_path[16];
+        snprintf(device_path, sizeof(device_path), "\\\\.\\%c:", volume[0]);
+        HANDLE h = CreateFile(device_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (h != INVALID_HANDLE_VALUE) {
+            STORAGE_PROPERTY_QUERY query;
+            DEVICE_SEEK_PENALTY_DESCRIPTOR desc;
+            DWORD bytes = 0;
+            memset(&query, 0, sizeof(query));
+            query.PropertyId = StorageDeviceSeekPenaltyProperty;
+            query.QueryType = PropertyStandardQuery;
+            if (DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &desc, sizeof(desc), &bytes, NULL))
+                *rotational = desc.IncursSeekPenalty ? 1 : 0;
+            CloseHandle(h);
+        }
+    }
+    return (unsigned long long)serial + 1;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    unsigned int dev_major = major(st.st_dev), dev_minor = minor(st.st_dev);
+    snprintf(name, namesize, "%u:%u", dev_major, dev_minor);
+#ifdef __linux__
+    // /sys/dev/block からディスクを求める（パーティションなら親のディスク）
+    char sys_path[MAX_PATH], disk[MAX_PATH], file[MAX_PATH + 32];
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", dev_major, dev_minor);
+    if (realpath(sys_path, disk)) {
+        snprintf(file, sizeof(file), "%s/partition", disk);
+        if (path_exists(file)) {
+            char *slash = strrchr(disk, '/');
+            if (slash)
+                *slash = '\0';
+            snprintf(file, sizeof(file), "%s/dev", disk);
+            FILE *fp = fopen(file, "r");
+            if (fp) {
+                if (fscanf(fp, "%u:%u", &dev_major, &dev_minor) != 2)
+                    dev_major = major(st.st_dev), dev_minor = minor(st.st_dev);
+                fclose(fp);
+            }
+        }
+        const char *base = strrchr(disk, '/');
+        base = base ? base + 1 : disk;
+        size_t len = strlen(base);
+        if (len < namesize)
+            memcpy(name, base, len + 1);    // 収まらない名前なら番号のまま表示する
+        snprintf(file, sizeof(file), "%s/queue/rotational", disk);
+        FILE *fp = fopen(file, "r");
+        if (fp) {
+            if (fscanf(fp, "%d", rotational) != 1)
+                *rotational = 0;
+            fclose(fp);
+        }
+    }
+#endif
+    return ((unsigned long long)dev_major << 32 | dev_minor) + 1;
+#endif
+}
+
+// path が載っているデバイスを返す（初めてのデバイスなら登録する。調べられなければ NULL）
+Device *device_for_path(const char *path) {
+    char name[64];
+    int rotational;
+    unsigned long long id = device_identify(path, name, sizeof(name), &rotational);
+    if (id == 0)
+        return NULL;
+    mutex_lock(&g_deviceLock);
+    Device *d = NULL;
+    for (int i = 0; i < g_deviceCount && !d; i++)
+        if (g_devices[i].id == id)
+            d = &g_devices[i];
+    if (!d && g_deviceCount < MAX_DEVICES) {
+        d = &g_devices[g_deviceCount++];
+        memset(d, 0, sizeof(*d));
+        d->id = id;
+        d->rotational = rotational;
+        snprintf(d->name, sizeof(d->name), "%s", name);
+        d->max_streams = rotational ? g_settings.hdd_streams : 0;
+        // settings.txt の device_limit で指定されたデバイスなら、その値を使う
+        for (int i = 0; i < g_settings.device_limit_count; i++) {
+            char limit_name[64];
+            int limit_rotational;
+            if (device_identify(g_settings.device_limits[i].path, limit_name, sizeof(limit_name), &limit_rotational) == id) {
+                d->max_streams = g_settings.device_limits[i].streams;
+                d->bytes_per_sec = g_settings.device_limits[i].bytes_per_sec;
+            }
+        }
+        char streams_buf[32], rate_buf[64];
+        snprintf(streams_buf, sizeof(streams_buf), "%d", d->max_streams);
+        log_message("デバイス %s: %s, 同時実行 %s, 帯域 %s%s\n", d->name, d->rotational ? "HDD" : "SSD/その他",
+                    d->max_streams > 0 ? streams_buf : "無制限",
+                    d->bytes_per_sec ? format_size(d->bytes_per_sec, rate_buf, sizeof(rate_buf)) : "無制限",
+                    d->bytes_per_sec ? "/s" : "");
+    }
+    mutex_unlock(&g_deviceLock);
+    return d;
+}
+
+// タスクのコピー元・コピー先のデバイスを設定する
+void task_assign_devices(CopyTask *task) {
+    task->src_device = device_for_path(task->src);
+    char root[MAX_PATH];
+    task->dest_device = device_for_path(dest_root_path(task->dest, root, sizeof(root)));
+    if (task->dest_device == task->src_device)
+        task->dest_device = NULL;   // 同じデバイスなら1回だけ数える
+}
+
+static int device_has_room(const Device *d) {
+    return !d || d->max_streams <= 0 || d->active < d->max_streams;
+}
+
+// ジョブの処理を始めてよいか確認する。上限に達したデバイスがあれば、ジョブを預けて0を返す。
+int device_acquire(Job *job) {
+    CopyTask *task = job->task;
+    if (!task->src_device && !task->dest_device)
+        return 1;
+    mutex_lock(&g_deviceLock);
+    Device *full = !device_has_room(task->src_device) ? task->src_device
+                 : !device_has_room(task->dest_device) ? task->dest_device : NULL;
+    if (full) {
+        job->next = full->parked;
+        full->parked = job;
+    } else {
+        if (task->src_device)
+            task->src_device->active++;
+        if (task->dest_device)
+            task->dest_device->active++;
+    }
+    mutex_unlock(&g_deviceLock);
+    return full == NULL;
+}
+
+// ジョブの処理を終え、空いたデバイスで待っているジョブを投入し直す
+void device_release(WorkerPool *pool, CopyTask *task, int worker_id) {
+    if (!task->src_device && !task->dest_device)
+        return;
+    Device *devices[2] = { task->src_device, task->dest_device };
+    Job *resume[2] = { NULL, NULL };
+    mutex_lock(&g_deviceLock);
+    for (int i = 0; i < 2; i++) {
+        if (!devices[i])
+            continue;
+        devices[i]->active--;
+        resume[i] = devices[i]->parked;
+        if (resume[i])
+            devices[i]->parked = resume[i]->next;
+    }
+    mutex_unlock(&g_deviceLock);
+    for (int i = 0; i < 2; i++)
+        if (resume[i])
+            pool_submit(pool, resume[i], worker_id);
+}
+
+// タスクのデバイスで同時に使えるストリーム数（無制限なら0）
+int device_stream_budget(const CopyTask *task) {
+    int budget = 0;
+    const Device *devices[2] = { task->src_device, task->dest_device };
+    for (int i = 0; i < 2; i++)
+        if (devices[i] && devices[i]->max_streams > 0 && (budget == 0 || devices[i]->max_streams < budget))
+            budget = devices[i]->max_streams;
+    return budget;
+}
+
+// start に始めた bytes バイトの転送を帯域の上限に合わせる（必要なだけ待つ）
+void device_throttle(CopyTask *task, unsigned long long bytes, double start) {
+    Device *devices[2] = { task->src_device, task->dest_device };
+    double wait = 0;
+    for (int i = 0; i < 2; i++) {
+        Device *d = devices[i];
+        if (!d || d->bytes_per_sec == 0)
+            continue;
+        mutex_lock(&g_deviceLock);
+        double begin = d->next_free > start ? d->next_free : start;
+        d->next_free = begin + (double)bytes / d->bytes_per_sec;
+        double w = d->next_free - monotonic_seconds();
+        mutex_unlock(&g_deviceLock);
+        if (w > wait)
+            wait = w;
+    }
+    if (wait > 0.001)
+        sleep_ms((unsigned int)(wait * 1000));
+}
+
+// ----- 大きなファイルの分割並列コピー -----
+// settings.txt の large_file_threshold 以上のファイルは range_size ごとの範囲に分け、
+// 複数のワーカーが位置指定の読み書きで同時にコピーする。
+// コピー先は "<コピー先>.afm_part" に作成して先に領域を確保し、全範囲の完了後に
+// 更新日時を設定してから本来の名前に変更する（途中の状態のファイルは本来の名前に現れない）。
+// 担当するワーカー（所有者）は自分でも範囲を処理し、手伝いのジョブ（JOB_COPY_RANGE）を
+// 自分の deque に積む。空いているワーカーがそれを盗んで残りの範囲を引き受ける。
+// 範囲は next_range をアトミックに進めて1つずつ割り当てるため、手伝いが来なくても
+// 所有者だけで完了できる。direct_io が有効なら OS のキャッシュを通さずに読み書きする。
+
+typedef struct _RangeCopy {
+    CopyTask *task;
+    char src[MAX_PATH];
+    char part[MAX_PATH + sizeof(PART_SUFFIX)];
+    unsigned long long size;
+    unsigned long long range_size;
+    size_t range_count;
+    size_t next_range;          // 次に割り当てる範囲（アトミック）
+    size_t ranges_done;         // 処理を終えた範囲の数（アトミック）
+    unsigned long long credited; // 進捗表示に計上したバイト数（アトミック）
+    int failed;
+    int direct;
+    long refs;                  // 所有者と手伝いのジョブの参照数（最後に解放した側が破棄する）
+    Mutex lock;
+    CondVar done;
+} RangeCopy;
+
+static void range_copy_release(RangeCopy *rc) {
+    if (ATOMIC_SUB(&rc->refs, 1) != 0)
+        return;
+    mutex_destroy(&rc->lock);
+    cond_destroy(&rc->done);
+    free(rc);
+}
+
+// 1つの範囲 [begin, end) をコピーする（成功で非0）
+static int range_copy_one(RangeCopy *rc, FileHandle in, FileHandle out, char *buf,
+                          unsigned long long begin, unsigned long long end) {
+    for (unsigned long long off = begin; off < end; ) {
+        size_t len = end - off < COPY_BUFFER_SIZE ? (size_t)(end - off) : COPY_BUFFER_SIZE;
+        // direct 時は長さもブロック境界に揃える（末尾の余分は最後に切り詰める）
+        size_t io_len = rc->direct ? (len + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN : len;
+        size_t got = 0;
+        while (got < len) {
+            long long n = file_pread(in, buf + got, io_len - got, off + got);
+            if (n <= 0)
+                return 0;
+            got += (size_t)n;
+        }
+        if (!file_pwrite(out, buf, rc->direct ? io_len : len, off))
+            return 0;
+        off += len;
+    }
+    return 1;
+}
+
+// 空いている範囲を順に引き受けてコピーする（所有者と手伝いのジョブの両方が呼ぶ）
+static void range_copy_work(RangeCopy *rc) {
+    FileHandle in = INVALID_FILE_HANDLE, out = INVALID_FILE_HANDLE;
+    char *buf = NULL;
+    for (;;) {
+        size_t r = ATOMIC_ADD(&rc->next_range, 1) - 1;
+        if (r >= rc->range_count)
+            break;
+        if (!buf) {
+            // 範囲を引き受けてから開く（すべて割り当て済みなら何もしない）
+            buf = (char*)aligned_buffer_alloc(COPY_BUFFER_SIZE);
+            in = file_open_read(rc->src, rc->direct);
+            out = file_open_write(rc->part, 0, rc->direct);
+        }
+        unsigned long long begin = r * rc->range_size;
+        unsigned long long end = begin + rc->range_size < rc->size ? begin + rc->range_size : rc->size;
+        if (!ATOMIC_LOAD(&rc->failed)) {
+            if (buf && in != INVALID_FILE_HANDLE && out != INVALID_FILE_HANDLE &&
+                range_copy_one(rc, in, out, buf, begin, end)) {
+                ATOMIC_ADD(&rc->credited, end - begin);
+                ATOMIC_ADD(&rc->task->range_bytes, end - begin);
+            } else {
+                ATOMIC_STORE(&rc->failed, 1);
+            }
+        }
+        if (ATOMIC_ADD(&rc->ranges_done, 1) == rc->range_count) {
+            mutex_lock(&rc->lock);
+            cond_broadcast(&rc->done);
+            mutex_unlock(&rc->lock);
+        }
+    }
+    if (in != INVALID_FILE_HANDLE)
+        file_close(in);
+    if (out != INVALID_FILE_HANDLE && !file_close(out))
+        ATOMIC_STORE(&rc->failed, 1);
+    if (buf)
+        aligned_buffer_free(buf);
+}
+
+// 大きなファイルを分割して並列にコピーする（copy_file と同様に上書きし、更新日時を引き継ぐ）
+int copy_file_ranged(CopyTask *task, const char *src, const char *dest, unsigned long long size, CopyResult *result) {
+    memset(result, 0, sizeof(*result));
+    result->backend = BACKEND_RANGED;
+    double start = monotonic_seconds();
+    RangeCopy *rc = (RangeCopy*)calloc(1, sizeof(RangeCopy));
+    if (!rc)
+        return 0;
+    rc->task = task;
+    rc->size = size;
+    snprintf(rc->src, sizeof(rc->src), "%s", src);
+    snprintf(rc->part, sizeof(rc->part), "%s%s", dest, PART_SUFFIX);
+    rc->range_size = (g_settings.range_size + COPY_BUFFER_SIZE - 1) / COPY_BUFFER_SIZE * COPY_BUFFER_SIZE;
+    if (rc->range_size == 0)
+        rc->range_size = COPY_BUFFER_SIZE;
+    rc->range_count = (size_t)((size + rc->range_size - 1) / rc->range_size);
+    mutex_init(&rc->lock);
+    cond_init(&rc->done);
+    rc->refs = 1;
+
+    // コピー先の一時ファイルを作成して領域を確保する。direct で開けなければ通常の読み書きにする
+    rc->direct = g_settings.direct_io;
+    FileHandle in = file_open_read(src, rc->direct);
+    FileHandle out = file_open_write(rc->part, 1, rc->direct);
+    if (rc->direct && (in == INVALID_FILE_HANDLE || out == INVALID_FILE_HANDLE)) {
+        if (in != INVALID_FILE_HANDLE)
+            file_close(in);
+        if (out != INVALID_FILE_HANDLE)
+            file_close(out);
+        rc->direct = 0;
+        in = file_open_read(src, 0);
+        out = file_open_write(rc->part, 1, 0);
+    }
+    int ok = in != INVALID_FILE_HANDLE && out != INVALID_FILE_HANDLE;
+    int cloned = 0;
+#ifndef _WIN32
+    if (ok && !rc->direct) {
+        // 共有（reflink）できるファイルシステムなら、データをコピーせずに済ませる
+        struct stat sst, dst;
+        if (fstat(in, &sst) == 0 && fstat(out, &dst) == 0 &&
+            fs_pair_first_backend(sst.st_dev, dst.st_dev) == BACKEND_REFLINK) {
+            int status = copy_by_reflink(in, out, size);
+            if (status == 0)
+                fs_pair_mark_unsupported(sst.st_dev, dst.st_dev, BACKEND_REFLINK);
+            cloned = status == 1;
+            if (cloned)
+                result->backend = BACKEND_REFLINK;
+        }
+    }
+#endif
+    if (ok && !cloned) {
+        ok = file_set_size(out, size, 1);
+        if (ok) {
+            int helpers = g_pool.worker_count - 1;
+            if ((size_t)helpers > rc->range_count - 1)
+                helpers = (int)(rc->range_count - 1);
+            // 同時実行数を制限しているデバイス（HDD など）では、その本数までに抑える
+            int budget = device_stream_budget(task);
+            if (budget > 0 && helpers > budget - 1)
+                helpers = budget - 1;
+            rc->refs += helpers;
+            for (int i = 0; i < helpers; i++) {
+                Job *job = job_create(JOB_COPY_RANGE, task, 0, 0);
+                job->range = rc;
+                pool_submit(&g_pool, job, t_workerId);
+            }
+            range_copy_work(rc);
+            mutex_lock(&rc->lock);
+            while (ATOMIC_LOAD(&rc->ranges_done) < rc->range_count)
+                cond_wait(&rc->done, &rc->lock);
+            mutex_unlock(&rc->lock);
+            ok = !ATOMIC_LOAD(&rc->failed);
+            // direct 時にブロック境界まで書いた末尾を切り詰める
+            if (ok && rc->direct)
+                ok = file_set_size(out, size, 0);
+        }
+    }
+    if (ok)
+        ok = file_copy_times(in, out);
+    if (in != INVALID_FILE_HANDLE)
+        file_close(in);
+    if (out != INVALID_FILE_HANDLE && !file_close(out))
+        ok = 0;
+    if (ok)
+        ok = replace_file(rc->part, dest);
+    if (!ok)
+        delete_file(rc->part);
+    // 範囲ごとに計上した進捗は、呼び出し元がファイル単位で計上し直す
+    ATOMIC_SUB(&task->range_bytes, ATOMIC_LOAD(&rc->credited));
+    result->seconds = monotonic_seconds() - start;
+    range_copy_release(rc);
+    return ok;
+}
+
+// ----- 再帰的コピー処理 -----
+void finish_copy_task(CopyTask *task);
+
+// フォルダ dir の子要素の完了を通知する。最後の子が完了したら、
+// ソース削除を行い、親フォルダへ完了を伝播する。
+// 監視モードではフォルダを削除しない（書き込み中のフォルダを消さないよう、監視側で削除する）。
+void release_directory(CopyTask *task, unsigned int dir) {
+    const Manifest *m = &task->manifest;
+    for (;;) {
+        if (ATOMIC_SUB(&task->dir_pending[dir], 1) != 0)
+            return;
+        const ManifestDir *d = &m->dirs[dir];
+        char srcPath[MAX_PATH];
+        // パスが長すぎるフォルダは、途中で切れた別のフォルダを削除しないよう残す
+        int fits = manifest_dir_path(m, task->src, dir, srcPath, sizeof(srcPath));
+        if (fits && !task->partial && g_deleteSource && !d->scan_failed && !task->dir_moved[dir]) {
+            double start = monotonic_seconds();
+            int removed = remove_directory(srcPath);
+            task_stage(task, STAGE_DELETE, start);
+            if (d->level == 0) {
+                if (!removed)
+                    console_printf("\nエラー: ソースフォルダ %s の削除に失敗しました。\n", srcPath);
+                else
+                    console_printf("\n[フォルダ削除] ソースフォルダ %s を削除しました。\n", srcPath);
+            } else {
+                if (!removed)
+                    console_printf("エラー: ディレクトリ %s の削除に失敗しました。\n", srcPath);
+                else
+                    console_printf("\n[フォルダ削除] %s を削除しました。\n", srcPath);
+            }
+        }
+        if (d->level == 0) {
+            finish_copy_task(task);
+            return;
+        }
+        dir = d->parent;
+    }
+}
+
+// フォルダ名置換：コピー元直下のフォルダのコピー先での名前を先に決め、配下のフォルダもその下に置く
+static void plan_folder_names(CopyTask *task) {
+    Manifest *m = &task->manifest;
+    if (!task->rules || !task->rules->folders)
+        return;
+    for (size_t i = 1; i < m->dir_count; i++) {
+        ManifestDir *d = &m->dirs[i];
+        const ManifestDir *parent = &m->dirs[d->parent];
+        char renamed[MAX_PATH];
+        if (d->level == 1) {
+            if (rename_apply(task->rules, d->name, renamed, sizeof(renamed))) {
+                d->dest_rel = arena_strdup(&m->arena, renamed);
+                log_message("フォルダ名置換: %s -> %s\n", d->rel, d->dest_rel);
+            }
+        } else if (parent->dest_rel != parent->rel) {
+            snprintf(renamed, sizeof(renamed), "%s%c%s", parent->dest_rel, PATH_SEP, d->name);
+            d->dest_rel = arena_strdup(&m->arena, renamed);
+        }
+    }
+}
+
+// マニフェストに従って task->src の内容を task->dest にコピーする。
+// コピー先フォルダは列挙順（親が先）にまとめて作成し、ファイルは範囲ジョブとして
+// 自分の deque に積む（他のワーカーが分割・盗みながら並列にコピーする）。
+// 同一ボリューム内の移動では、コピー先にまだ無いフォルダは配下ごと名前変更で移動する。
+// コピー先のフォルダは名前置換後の名前で作成し、ソース削除は配下がすべて完了した時点で
+// release_directory が行う。
+int copy_folder_recursive(WorkerPool *pool, CopyTask *task, int worker_id) {
+    Manifest *m = &task->manifest;
+    char srcPath[MAX_PATH], destPath[MAX_PATH];
+    
+    task->dir_pending = (long*)malloc(m->dir_count * sizeof(long));
+    task->dir_moved = (unsigned char*)calloc(m->dir_count, 1);
+    if (!task->dir_pending || !task->dir_moved) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    plan_folder_names(task);
+    for (size_t i = 0; i < m->dir_count; i++) {
+        const ManifestDir *d = &m->dirs[i];
+        // 子要素数 + この関数が保持する分（1）
+        task->dir_pending[i] = (long)d->children + 1;
+        if (i > 0 && task->dir_moved[d->parent]) {
+            task->dir_moved[i] = 1;
+            continue;
+        }
+        // パスが長すぎるフォルダは作らない（配下のファイルはそれぞれ失敗として扱う）
+        if (!manifest_dest_dir_path(m, task->dest, (unsigned int)i, destPath, sizeof(destPath)))
+            continue;
+        // 監視モードではフォルダ内にまだ書き込み中のファイルがあり得るため、フォルダごとは移動しない
+        if (i > 0 && task->same_volume && !task->partial && !d->scan_failed && !dir_is_known(destPath) &&
+            !path_exists(destPath) && manifest_dir_path(m, task->src, (unsigned int)i, srcPath, sizeof(srcPath))) {
+            if (move_source_file(task, srcPath, destPath)) {
+                dir_cache_invalidate();
+                task->dir_moved[i] = 1;
+                console_printf("\n[フォルダ移動] %s を %s に移動（同一ボリューム）\n", srcPath, destPath);
+                log_message("%s -> %s: フォルダ移動、同一ボリューム内で移動\n", srcPath, destPath);
+                continue;
+            }
+        }
+        // 親フォルダは列挙順で先に作成済みのため、存在確認を省いて作成する
+        if (i == 0)
+            create_directory_recursive(destPath);
+        else
+            ensure_directory(destPath);
+    }
+    
+    if (m->file_count > 0)
+        pool_submit(pool, job_create(JOB_COPY_FILES, task, 0, m->file_count), worker_id);
+    
+    // 保持分を子から順に解放する（空フォルダはここで後処理される）
+    for (size_t i = m->dir_count; i-- > 0; )
+        release_directory(task, (unsigned int)i);
+    return 0;
+}
+
+// ----- アーカイブ出力 -----
+// コピー先に ".tar" で終わるパスを指定したタスクは、コピー元のツリー全体を1つの tar 形式
+// （POSIX ustar。長い名前や 8GB 以上のファイルは pax 拡張ヘッダ）のアーカイブに書き込む。
+// 小さなファイルが多くても、コピー先ではファイルごとの作成・属性設定が不要になり、
+// 大きなバッファにまとめて先頭から順に書き込むだけになる。
+// メンバー名には名前置換を適用し、アーカイブと並べて各メンバーの位置を記した索引
+// （"<アーカイブ>.idx"）を作る。書き込み中は PART_SUFFIX を付けた名前で作成し、
+// アーカイブと索引をディスクまで書き出して（verify が有効なら読み直して照合して）から
+// 本来の名前に変更する。ソース削除はそのすべてが終わった後に行う。
+// "--unpack" で元のツリーに展開できる（索引を使って1件だけ取り出すこともできる）。
+//
+// 索引の形式（1行1メンバー、タブ区切り）：
+//   "AFMTARINDEX 1"                                        ヘッダ
+//   "d\t<位置>\t0\t<更新日時>\t0\t<名前>/"                    フォルダ
+//   "f\t<データの位置>\t<サイズ>\t<更新日時>\t<内容ハッシュ>\t<名前>"  ファイル（ハッシュは16進）
+#define TAR_BLOCK 512
+#define TAR_NAME_LEN 100
+#define TAR_PREFIX_LEN 155
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL          // ustar のサイズ欄に書ける上限（8GB - 1）
+#define ARCHIVE_BUFFER_SIZE (8 * 1024 * 1024)       // アーカイブにまとめて書き込む単位
+#define ARCHIVE_INDEX_BUFFER_SIZE (256 * 1024)
+#define ARCHIVE_INDEX_SUFFIX ".idx"
+#define ARCHIVE_INDEX_HEADER "AFMTARINDEX 1"
+
+// 先頭から順に書き込むバッファ付きの出力
+typedef struct _ArchiveWriter {
+    FileHandle h;
+    char *buf;
+    size_t capacity;
+    size_t used;
+    unsigned long long offset;  // buf の先頭のファイル内の位置
+    CopyTask *task;             // 帯域制限を適用するタスク（NULL なら適用しない）
+    int ok;
+} ArchiveWriter;
+
+static int archive_writer_open(ArchiveWriter *w, const char *path, size_t capacity, CopyTask *task) {
+    memset(w, 0, sizeof(*w));
+    w->h = file_open_write(path, 1, 0);
+    if (w->h == INVALID_FILE_HANDLE)
+        return 0;
+    w->buf = (char*)malloc(capacity);
+    if (!w->buf) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    w->capacity = capacity;
+    w->task = task;
+    w->ok = 1;
+    return 1;
+}
+
+static void archive_flush(ArchiveWriter *w) {
+    if (w->used == 0)
+        return;
+    double start = monotonic_seconds();
+    if (w->ok && !file_pwrite(w->h, w->buf, w->used, w->offset))
+        w->ok = 0;
+    if (w->task)
+        device_throttle(w->task, w->used, start);
+    w->offset += w->used;
+    w->used = 0;
+}
+
+static void archive_put(ArchiveWriter *w, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    while (len > 0) {
+        if (w->used == w->capacity)
+            archive_flush(w);
+        size_t n = w->capacity - w->used < len ? w->capacity - w->used : len;
+        memcpy(w->buf + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void archive_printf(ArchiveWriter *w, const char *fmt, ...) {
+    char line[MAX_PATH + 128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        archive_put(w, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// 書き込み位置を TAR_BLOCK の境界まで0で埋める
+static void archive_pad(ArchiveWriter *w) {
+    static const char zeros[TAR_BLOCK];
+    size_t rest = (size_t)((w->offset + w->used) % TAR_BLOCK);
+    if (rest)
+        archive_put(w, zeros, TAR_BLOCK - rest);
+}
+
+// 残りを書き出してディスクまで同期し、実際の長さに切り詰めて閉じる（すべて成功で非0）
+static int archive_writer_close(ArchiveWriter *w) {
+    archive_flush(w);
+    int ok = w->ok && file_set_size(w->h, w->offset, 0) && file_sync(w->h);
+    if (!file_close(w->h))
+        ok = 0;
+    free(w->buf);
+    w->buf = NULL;
+    return ok;
+}
+
+// width - 1 桁の8進数と NUL をヘッダのフィールドに書く（桁に収まらない値は最大値にする）
+static void tar_octal(char *field, size_t width, unsigned long long value) {
+    unsigned long long max = (1ULL << (3 * (width - 1))) - 1;
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", (int)(width - 1), value < max ? value : max);
+    memcpy(field, digits, width);
+}
+
+// pax 拡張ヘッダの1レコード（"<長さ> <キー>=<値>\n"、長さは自身の桁を含む）を out に作り、長さを返す
+static size_t pax_record(char *out, size_t outsize, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3;
+    size_t len = base + 1;
+    while (len < base + (size_t)snprintf(NULL, 0, "%zu", len))
+        len++;
+    snprintf(out, outsize, "%zu %s=%s\n", len, key, value);
+    return len < outsize ? len : 0;
+}
+
+// メンバーのヘッダを書き込む。ustar に収まらない名前・サイズは直前に pax 拡張ヘッダで渡す。
+static void archive_header(ArchiveWriter *w, const char *name, char type, unsigned long long size, long long mtime) {
+    char h[TAR_BLOCK];
+    size_t len = strlen(name);
+    size_t split = 0;   // 0 以外なら name[split] の '/' で prefix と name に分ける
+    if (len > TAR_NAME_LEN) {
+        for (size_t i = len - 1; i > 0; i--) {
+            if (name[i] == '/' && i <= TAR_PREFIX_LEN && len - i - 1 <= TAR_NAME_LEN && len - i - 1 > 0) {
+                split = i;
+                break;
+            }
+        }
+    }
+    int long_name = len > TAR_NAME_LEN && split == 0;
+    int large = size > TAR_MAX_OCTAL_SIZE;
+    if (long_name || large) {
+        char pax[MAX_PATH + 128], size_buf[32];
+        size_t pax_len = 0;
+        if (long_name)
+            pax_len += pax_record(pax, sizeof(pax), "path", name);
+        if (large) {
+            snprintf(size_buf, sizeof(size_buf), "%llu", size);
+            pax_len += pax_record(pax + pax_len, sizeof(pax) - pax_len, "size", size_buf);
+        }
+        archive_header(w, "././@PaxHeader", 'x', pax_len, mtime);
+        archive_put(w, pax, pax_len);
+        archive_pad(w);
+    }
+    memset(h, 0, sizeof(h));
+    if (split) {
+        memcpy(h + 345, name, split);
+        memcpy(h, name + split + 1, len - split - 1);
+    } else {
+        memcpy(h, name, len < TAR_NAME_LEN ? len : TAR_NAME_LEN);
+    }
+    tar_octal(h + 100, 8, type == '5' ? 0755 : 0644);
+    tar_octal(h + 108, 8, 0);
+    tar_octal(h + 116, 8, 0);
+    tar_octal(h + 124, 12, large ? 0 : size);
+    tar_octal(h + 136, 12, mtime > 0 ? (unsigned long long)mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)h[i];
+    snprintf(h + 148, 7, "%06o", sum);
+    h[155] = ' ';
+    archive_put(w, h, TAR_BLOCK);
+}
+
+// 名前置換後のコピー先での相対パスを、アーカイブのメンバー名（区切りは '/'）にする。
+// 名前が buf に収まらなければ0
+static int archive_member_name(const CopyTask *task, size_t index, char *buf, size_t bufsize) {
+    const ManifestEntry *e = &task->manifest.files[index];
+    const char *dir = task->manifest.dirs[e->dir].dest_rel;
+    char renamed[MAX_PATH];
+    const char *name = e->name;
+    if (task->rules && task->rules->files && rename_apply(task->rules, name, renamed, sizeof(renamed)))
+        name = renamed;
+    int n = dir[0] == '\0' ? snprintf(buf, bufsize, "%s", name) : snprintf(buf, bufsize, "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= bufsize)
+        return 0;
+#ifdef _WIN32
+    for (char *p = buf; *p; p++) {
+        if (*p == PATH_SEP)
+            *p = '/';
+    }
+#endif
+    return 1;
+}
+
+// アーカイブに書き込んだ1ファイルの結果
+typedef struct _ArchiveMember {
+    unsigned long long offset;  // データのアーカイブ内の位置（0 なら書き込んでいない）
+    unsigned long long hash;    // 読み込みながら計算した内容ハッシュ
+    double seconds;             // 読み込み・書き込みにかかった時間
+    int ok;                     // 列挙時の内容をそのまま書き込めたら1
+} ArchiveMember;
+
+// 1ファイルをアーカイブに追加する。コピー元を開けなければ何も書かずに0を返す。
+// 読み込み中にファイルが縮んだ・伸びた場合は、ヘッダのサイズに合わせて（不足は0で埋めて）書き込み、
+// member->ok を0にする（ソースは削除しない）。
+static int archive_add_file(ArchiveWriter *w, const char *src, const char *name, const ManifestEntry *e,
+                            ArchiveMember *member) {
+    FileHandle in = file_open_read(src, 0);
+    if (in == INVALID_FILE_HANDLE)
+        return 0;
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    if (e->size > COPY_BUFFER_SIZE)
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    archive_header(w, name, '0', e->size, e->mtime);
+    member->offset = w->offset + w->used;
+    member->ok = 1;
+    unsigned long long h64 = CONTENT_HASH_SEED, done = 0;
+    while (done < e->size) {
+        if (w->used == w->capacity)
+            archive_flush(w);
+        // バッファの残りはブロック境界から始まるため、8バイト単位のハッシュの区切りはずれない
+        size_t want = w->capacity - w->used;
+        if (want > e->size - done)
+            want = (size_t)(e->size - done);
+        size_t got = 0;
+        while (member->ok && got < want) {
+            long long n = file_pread(in, w->buf + w->used + got, want - got, done + got);
+            if (n <= 0)
+                member->ok = 0;
+            else
+                got += (size_t)n;
+        }
+        if (got < want)
+            memset(w->buf + w->used + got, 0, want - got);
+        h64 = content_hash_update(h64, w->buf + w->used, want);
+        w->used += want;
+        done += want;
+    }
+    char extra;
+    if (member->ok && file_pread(in, &extra, 1, e->size) > 0)
+        member->ok = 0;     // 列挙後に書き足された
+    file_close(in);
+    archive_pad(w);
+    member->hash = content_hash_final(h64);
+    return 1;
+}
+
+// 同期済みのアーカイブを先頭から大きな単位で読み直し、各メンバーの内容ハッシュを照合する。
+// 一致しないメンバーがあれば0を返す。verify が2なら OS のキャッシュを捨ててから読む。
+static int archive_verify(const char *path, const Manifest *m, const ArchiveMember *members, char *buf, size_t bufsize) {
+    FileHandle h = file_open_read(path, 0);
+    if (h == INVALID_FILE_HANDLE)
+        return 0;
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    if (g_settings.verify == 2)
+        posix_fadvise(h, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(h, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    unsigned long long win_start = 0, win_end = 0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < m->file_count; i++) {
+        const ArchiveMember *member = &members[i];
+        if (member->offset == 0)
+            continue;
+        unsigned long long pos = member->offset, end = member->offset + m->files[i].size;
+        unsigned long long h64 = CONTENT_HASH_SEED;
+        while (ok && pos < end) {
+            if (pos < win_start || pos >= win_end) {
+                // 読み込み位置は常にブロック境界なので、ハッシュの区切りはずれない
+                size_t got = 0;
+                while (got < bufsize) {
+                    long long n = file_pread(h, buf + got, bufsize - got, pos + got);
+                    if (n <= 0)
+                        break;
+                    got += (size_t)n;
+                }
+                win_start = pos;
+                win_end = pos + got;
+                if (got == 0) {
+                    ok = 0;
+                    break;
+                }
+            }
+            unsigned long long n = (end < win_end ? end : win_end) - pos;
+            h64 = content_hash_update(h64, buf + (pos - win_start), (size_t)n);
+            pos += n;
+        }
+        if (ok && content_hash_final(h64) != member->hash)
+            ok = 0;
+    }
+    file_close(h);
+    return ok;
+}
+
+// アーカイブ・索引を削除する（失敗時の後始末）
+static void archive_discard(const char *part, const char *index_part) {
+    delete_file(part);
+    delete_file(index_part);
+}
+
+// タスクのコピー元のツリーを task->dest のアーカイブに書き込み、ソース削除まで行う
+void archive_task_run(CopyTask *task) {
+    Manifest *m = &task->manifest;
+    char root[MAX_PATH], path[MAX_PATH], part[MAX_PATH + sizeof(PART_SUFFIX)];
+    char index_path[MAX_PATH + sizeof(ARCHIVE_INDEX_SUFFIX)];
+    char index_part[MAX_PATH + sizeof(ARCHIVE_INDEX_SUFFIX) + sizeof(PART_SUFFIX)];
+    char name[MAX_PATH], src[MAX_PATH];
+    create_directory_recursive(dest_root_path(task->dest, root, sizeof(root)));
+    // 既にあるアーカイブは上書きせず、別の名前で作る
+    snprintf(path, sizeof(path), "%s", task->dest);
+    while (path_exists(path)) {
+        char next[MAX_PATH];
+        generate_new_filename(path, next, sizeof(next));
+        snprintf(path, sizeof(path), "%s", next);
+    }
+    snprintf(part, sizeof(part), "%s%s", path, PART_SUFFIX);
+    snprintf(index_path, sizeof(index_path), "%s%s", path, ARCHIVE_INDEX_SUFFIX);
+    snprintf(index_part, sizeof(index_part), "%s%s", index_path, PART_SUFFIX);
+    plan_folder_names(task);
+
+    ArchiveMember *members = (ArchiveMember*)calloc(m->file_count ? m->file_count : 1, sizeof(ArchiveMember));
+    if (!members) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    ArchiveWriter w, idx;
+    if (!archive_writer_open(&w, part, ARCHIVE_BUFFER_SIZE, task)) {
+        console_printf("\nエラー: アーカイブ %s を作成できませんでした。\n", part);
+        log_message("[タスク %d] アーカイブ %s を作成できませんでした\n", task->task_id, part);
+        for (size_t i = 0; i < m->file_count; i++)
+            task_file_done(task, OUTCOME_FAILED, m->files[i].size, monotonic_seconds());
+        free(members);
+        return;
+    }
+    if (!archive_writer_open(&idx, index_part, ARCHIVE_INDEX_BUFFER_SIZE, NULL)) {
+        console_printf("\nエラー: 索引 %s を作成できませんでした。\n", index_part);
+        file_close(w.h);
+        free(w.buf);
+        delete_file(part);
+        for (size_t i = 0; i < m->file_count; i++)
+            task_file_done(task, OUTCOME_FAILED, m->files[i].size, monotonic_seconds());
+        free(members);
+        return;
+    }
+    // 書き込む量は事前に分かるため、領域を先に確保して断片化を避ける
+    unsigned long long estimate = (unsigned long long)(m->dir_count + 2) * TAR_BLOCK;
+    for (size_t i = 0; i < m->file_count; i++)
+        estimate += TAR_BLOCK + (m->files[i].size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    file_set_size(w.h, estimate, 1);
+
+    archive_printf(&idx, "%s\n", ARCHIVE_INDEX_HEADER);
+    for (size_t i = 1; i < m->dir_count; i++) {
+        const ManifestDir *d = &m->dirs[i];
+        snprintf(name, sizeof(name), "%s/", d->dest_rel);
+#ifdef _WIN32
+        for (char *p = name; *p; p++) {
+            if (*p == PATH_SEP)
+                *p = '/';
+        }
+#endif
+        archive_printf(&idx, "d\t%llu\t0\t%lld\t0\t%s\n", w.offset + w.used, d->mtime, name);
+        archive_header(&w, name, '5', 0, d->mtime);
+    }
+    for (size_t i = 0; i < m->file_count; i++) {
+        const ManifestEntry *e = &m->files[i];
+        double start = monotonic_seconds();
+        if (!manifest_file_path(m, task->src, i, src, sizeof(src))) {
+            report_path_too_long(task, i);
+        } else if (!archive_member_name(task, i, name, sizeof(name))) {
+            console_printf("\nエラー: %s のメンバー名が長すぎます。ソースは残します。\n", src);
+            log_message("%s: メンバー名が長すぎるため、アーカイブに含めません\n", src);
+        } else if (!archive_add_file(&w, src, name, e, &members[i])) {
+            console_printf("\nエラー: %s を読み込めませんでした。\n", src);
+            log_message("%s: 読み込み失敗、アーカイブに含めません\n", src);
+        } else if (!members[i].ok) {
+            console_printf("\nエラー: %s は書き込み中に変更されました。ソースは残します。\n", src);
+            log_message("%s -> %s:%s: 書き込み中に変更、ソース保持\n", src, path, name);
+        } else {
+            archive_printf(&idx, "f\t%llu\t%llu\t%lld\t%016llx\t%s\n", members[i].offset, e->size, e->mtime,
+                           members[i].hash, name);
+        }
+        members[i].seconds = monotonic_seconds() - start;
+        task_stage(task, STAGE_COPY, start);
+        ATOMIC_ADD(&task->copied_size, e->size);
+    }
+    static const char end_blocks[2 * TAR_BLOCK];
+    archive_put(&w, end_blocks, sizeof(end_blocks));
+    unsigned long long archive_size = w.offset + w.used;
+    int ok = archive_writer_close(&w);
+    ok = archive_writer_close(&idx) && ok;
+    if (!ok) {
+        console_printf("\nエラー: アーカイブ %s を書き込めませんでした。ソースは残します。\n", path);
+        log_message("[タスク %d] アーカイブ %s の書き込み失敗、ソース保持\n", task->task_id, path);
+    } else if (g_settings.verify > 0) {
+        double start = monotonic_seconds();
+        char *buf = (char*)malloc(ARCHIVE_BUFFER_SIZE);
+        if (!buf) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        ok = archive_verify(part, m, members, buf, ARCHIVE_BUFFER_SIZE);
+        free(buf);
+        task_stage(task, STAGE_VERIFY, start);
+        if (!ok) {
+            console_printf("\nエラー: アーカイブ %s の内容が一致しません。ソースは残します。\n", path);
+            log_message("[タスク %d] アーカイブ %s の検証失敗、アーカイブを削除しソース保持\n", task->task_id, path);
+        }
+    }
+    if (ok) {
+        double start = monotonic_seconds();
+        ok = replace_file(part, path) && replace_file(index_part, index_path);
+        if (ok) {
+            dir_cache_invalidate();
+            sync_directory(root);
+        }
+        task_stage(task, STAGE_RENAME, start);
+    }
+    if (!ok)
+        archive_discard(part, index_part);
+
+    // アーカイブが完成してから、書き込めたファイルのソースを削除する
+    unsigned long long written = 0;
+    for (size_t i = 0; i < m->file_count; i++) {
+        const ManifestEntry *e = &m->files[i];
+        ArchiveMember *member = &members[i];
+        int done = ok && member->offset != 0 && member->ok;
+        CopyResult result = { BACKEND_ARCHIVE, member->hash, member->seconds };
+        if (done) {
+            record_copy_result(task, &result, e->size);
+            written++;
+            if (g_deleteSource) {
+                double start = monotonic_seconds();
+                manifest_file_path(m, task->src, i, src, sizeof(src));
+                if (!delete_file(src)) {
+                    console_printf("\nエラー: ソースファイル %s の削除に失敗しました。\n", src);
+                    log_message("%s: ソース削除失敗\n", src);
+                }
+                task_stage(task, STAGE_DELETE, start);
+            }
+        }
+        task_file_done(task, done ? OUTCOME_NEW : OUTCOME_FAILED, e->size, monotonic_seconds() - member->seconds);
+    }
+    if (ok && g_deleteSource) {
+        // 子フォルダから順に削除する（残っているファイルがあるフォルダは削除されない）
+        for (size_t i = m->dir_count; i-- > 0; ) {
+            if (m->dirs[i].scan_failed)
+                continue;
+            double start = monotonic_seconds();
+            manifest_dir_path(m, task->src, (unsigned int)i, src, sizeof(src));
+            if (remove_directory(src))
+                console_printf("\n[フォルダ削除] %s を削除しました。\n", src);
+            task_stage(task, STAGE_DELETE, start);
+        }
+    }
+    if (ok) {
+        char size_buf[64];
+        format_size(archive_size, size_buf, sizeof(size_buf));
+        console_printf("\n[アーカイブ] %s に %llu 件を書き込みました（%s）%s\n", path, written, size_buf,
+               g_deleteSource ? "。ソースを削除しました" : "");
+        log_message("[タスク %d] アーカイブ %s: %llu 件, %s, 索引 %s%s\n", task->task_id, path, written, size_buf,
+                    index_path, g_deleteSource ? ", ソース削除" : ", ソース保持");
+    }
+    free(members);
+}
+
+// ----- アーカイブの展開 -----
+// "--unpack <アーカイブ> <展開先> [メンバー名]"。メンバー名を省略すると、アーカイブを先頭から
+// 順に読んでツリー全体を展開する。指定すると索引からデータの位置を探し、その1件だけを取り出す。
+// 展開先に同名のファイルがあれば上書きせず、新しいファイル名で作成する。
+// 絶対パスや ".." を含むメンバーは展開しない。
+
+// メンバー名が展開先の外を指さないか（安全なら非0）
+static int archive_name_safe(const char *name) {
+    if (name[0] == '/' || name[0] == '\\' || (name[0] != '\0' && name[1] == ':'))
+        return 0;
+    for (const char *p = name; *p; ) {
+        const char *end = p + strcspn(p, "/\\");
+        if (end - p == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p = *end ? end + 1 : end;
+    }
+    return name[0] != '\0';
+}
+
+// 展開先 dest にメンバー name のパスを組み立てる（区切りを OS のものにする）。パスが buf に収まらなければ0
+static int archive_output_path(const char *dest, const char *name, char *buf, size_t bufsize) {
+    int n = snprintf(buf, bufsize, "%s%c%s", dest, PATH_SEP, name);
+    if (n < 0 || (size_t)n >= bufsize)
+        return 0;
+    size_t len = strlen(buf);
+    while (len > 0 && (buf[len - 1] == '/' || buf[len - 1] == PATH_SEP))
+        buf[--len] = '\0';
+#ifdef _WIN32
+    for (char *p = buf; *p; p++) {
+        if (*p == '/')
+            *p = PATH_SEP;
+    }
+#endif
+    return 1;
+}
+
+// ファイルの親フォルダを作成する
+static void archive_make_parent(const char *path) {
+    char parent[MAX_PATH];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *sep = strrchr(parent, PATH_SEP);
+    if (sep && sep != parent) {
+        *sep = '\0';
+        create_directory_recursive(parent);
+    }
+}
+
+// 展開するファイルを作成する（同名のファイルがあれば新しいファイル名にする）。path に実際のパスを返す
+static FileHandle archive_create_output(const char *dest, const char *name, char *path, size_t pathsize) {
+    if (!archive_output_path(dest, name, path, pathsize))
+        return INVALID_FILE_HANDLE;
+    archive_make_parent(path);
+    while (path_exists(path)) {
+        char next[MAX_PATH];
+        generate_new_filename(path, next, sizeof(next));
+        snprintf(path, pathsize, "%s", next);
+    }
+    return file_open_write(path, 1, 0);
+}
+
+// ヘッダの8進数の欄を読む
+static unsigned long long tar_parse_octal(const char *field, size_t width) {
+    unsigned long long v = 0;
+    for (size_t i = 0; i < width && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7')
+            v = v * 8 + (unsigned long long)(field[i] - '0');
+    }
+    return v;
+}
+
+// ヘッダのチェックサムが正しければ非0
+static int tar_checksum_ok(const unsigned char *h) {
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == (unsigned int)tar_parse_octal((const char*)h + 148, 8);
+}
+
+// ストリームから len バイト読み込む（成功で非0）。buf が NULL なら読み飛ばす
+static int archive_read(FILE *fp, char *buf, unsigned long long len) {
+    char skip[TAR_BLOCK * 8];
+    while (len > 0) {
+        size_t n = len < sizeof(skip) ? (size_t)len : sizeof(skip);
+        if (fread(buf ? buf : skip, 1, n, fp) != n)
+            return 0;
+        if (buf)
+            buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static unsigned long long tar_padding(unsigned long long size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// アーカイブ全体を展開する（成功で0）
+static int archive_unpack_all(const char *archive, const char *dest) {
+    FILE *fp = file_open_stream(archive);
+    if (!fp) {
+        console_printf("エラー: アーカイブ %s を開けません。\n", archive);
+        return 1;
+    }
+    setvbuf(fp, NULL, _IOFBF, ARCHIVE_BUFFER_SIZE);
+    char *buf = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    create_directory_recursive(dest);
+    unsigned char h[TAR_BLOCK];
+    char pax_path[MAX_PATH] = "", name[MAX_PATH], path[MAX_PATH];
+    unsigned long long pax_size = 0, files = 0, dirs = 0, bytes = 0, skipped = 0;
+    int have_pax_size = 0, status = 0;
+    for (;;) {
+        if (fread(h, 1, TAR_BLOCK, fp) != TAR_BLOCK) {
+            console_printf("エラー: アーカイブが途中で終わっています。\n");
+            status = 1;
+            break;
+        }
+        if (h[0] == '\0')
+            break;      // 終端のブロック
+        if (!tar_checksum_ok(h)) {
+            console_printf("エラー: アーカイブのヘッダが壊れています。\n");
+            status = 1;
+            break;
+        }
+        char type = (char)h[156];
+        unsigned long long size = tar_parse_octal((const char*)h + 124, 12);
+        if (type == 'x' || type == 'L') {
+            // 次のメンバーの長い名前・大きなサイズ（pax 拡張ヘッダ、GNU の長い名前）
+            char *data = (char*)malloc((size_t)size + 1);
+            if (!data || !archive_read(fp, data, size) || !archive_read(fp, NULL, tar_padding(size))) {
+                console_printf("エラー: アーカイブの拡張ヘッダを読み込めません。\n");
+                free(data);
+                status = 1;
+                break;
+            }
+            data[size] = '\0';
+            if (type == 'L') {
+                snprintf(pax_path, sizeof(pax_path), "%s", data);
+            } else {
+                for (char *p = data; p < data + size; ) {
+                    char *space = strchr(p, ' ');
+                    unsigned long long rec = strtoull(p, NULL, 10);
+                    if (!space || rec == 0 || p + rec > data + size)
+                        break;
+                    char *value = strchr(space + 1, '=');
+                    if (value && value < p + rec) {
+                        size_t value_len = (size_t)(p + rec - 1 - (value + 1));
+                        if (strncmp(space + 1, "path=", 5) == 0 && value_len < sizeof(pax_path)) {
+                            memcpy(pax_path, value + 1, value_len);
+                            pax_path[value_len] = '\0';
+                        } else if (strncmp(space + 1, "size=", 5) == 0) {
+                            pax_size = strtoull(value + 1, NULL, 10);
+                            have_pax_size = 1;
+                        }
+                    }
+                    p += rec;
+                }
+            }
+            free(data);
+            continue;
+        }
+        if (have_pax_size)
+            size = pax_size;
+        if (pax_path[0]) {
+            snprintf(name, sizeof(name), "%s", pax_path);
+        } else if (h[345]) {
+            snprintf(name, sizeof(name), "%.*s/%.*s", TAR_PREFIX_LEN, (const char*)h + 345, TAR_NAME_LEN, (const char*)h);
+        } else {
+            snprintf(name, sizeof(name), "%.*s", TAR_NAME_LEN, (const char*)h);
+        }
+        pax_path[0] = '\0';
+        have_pax_size = 0;
+        long long mtime = (long long)tar_parse_octal((const char*)h + 136, 12);
+        int is_file = type == '0' || type == '\0' || type == '7';
+        if (!archive_name_safe(name) || (!is_file && type != '5')) {
+            if (!archive_name_safe(name))
+                console_printf("警告: 展開先の外を指すメンバー %s は展開しません。\n", name);
+            skipped++;
+            if (!archive_read(fp, NULL, size + tar_padding(size))) {
+                status = 1;
+                break;
+            }
+            continue;
+        }
+        if (type == '5') {
+            if (!archive_output_path(dest, name, path, sizeof(path))) {
+                console_printf("エラー: %s%c%s のパスが長すぎます。\n", dest, PATH_SEP, name);
+                status = 1;
+                continue;
+            }
+            create_directory_recursive(path);
+            dirs++;
+            continue;
+        }
+        FileHandle out = archive_create_output(dest, name, path, sizeof(path));
+        if (out == INVALID_FILE_HANDLE) {
+            console_printf("エラー: %s を作成できません。\n", path);
+            status = 1;
+        }
+        unsigned long long done = 0;
+        int ok = 1;
+        while (done < size) {
+            size_t n = size - done < COPY_BUFFER_SIZE ? (size_t)(size - done) : COPY_BUFFER_SIZE;
+            if (!archive_read(fp, buf, n)) {
+                ok = 0;
+                break;
+            }
+            if (out != INVALID_FILE_HANDLE && !file_pwrite(out, buf, n, done))
+                ok = 0;
+            done += n;
+        }
+        if (out != INVALID_FILE_HANDLE) {
+            if (!file_close(out))
+                ok = 0;
+            set_file_mtime(path, mtime);
+            if (!ok) {
+                console_printf("エラー: %s を書き込めませんでした。\n", path);
+                status = 1;
+            }
+        }
+        if (done < size || !archive_read(fp, NULL, tar_padding(size))) {
+            console_printf("エラー: アーカイブが途中で終わっています。\n");
+            status = 1;
+            break;
+        }
+        files++;
+        bytes += size;
+    }
+    free(buf);
+    fclose(fp);
+    char size_buf[64];
+    console_printf("展開: %s -> %s : ファイル %llu 件（%s）, フォルダ %llu 件%s\n", archive, dest, files,
+           format_size(bytes, size_buf, sizeof(size_buf)), dirs, skipped ? "（一部のメンバーは展開していません）" : "");
+    return status;
+}
+
+// 索引で member を探し、その1件だけを展開する（成功で0）
+static int archive_unpack_member(const char *archive, const char *dest, const char *member) {
+    char index_path[MAX_PATH], line[MAX_PATH + 128];
+    snprintf(index_path, sizeof(index_path), "%s%s", archive, ARCHIVE_INDEX_SUFFIX);
+    FILE *fp = file_open_stream(index_path);
+    if (!fp) {
+        console_printf("エラー: 索引 %s を開けません。\n", index_path);
+        return 1;
+    }
+    int found = 0;
+    unsigned long long offset = 0, size = 0, hash = 0;
+    long long mtime = 0;
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, ARCHIVE_INDEX_HEADER, strlen(ARCHIVE_INDEX_HEADER)) != 0) {
+        console_printf("エラー: %s は索引ではありません。\n", index_path);
+        fclose(fp);
+        return 1;
+    }
+    while (!found && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char type;
+        int name_at = 0;
+        if (sscanf(line, "%c\t%llu\t%llu\t%lld\t%llx\t%n", &type, &offset, &size, &mtime, &hash, &name_at) >= 5 &&
+            name_at > 0 && type == 'f' && strcmp(line + name_at, member) == 0)
+            found = 1;
+    }
+    fclose(fp);
+    if (!found) {
+        console_printf("エラー: %s に %s はありません。\n", archive, member);
+        return 1;
+    }
+    if (!archive_name_safe(member)) {
+        console_printf("エラー: 展開先の外を指すメンバー %s は展開しません。\n", member);
+        return 1;
+    }
+    FileHandle in = file_open_read(archive, 0);
+    if (in == INVALID_FILE_HANDLE) {
+        console_printf("エラー: アーカイブ %s を開けません。\n", archive);
+        return 1;
+    }
+    char path[MAX_PATH];
+    create_directory_recursive(dest);
+    FileHandle out = archive_create_output(dest, member, path, sizeof(path));
+    if (out == INVALID_FILE_HANDLE) {
+        console_printf("エラー: %s を作成できません。\n", path);
+        file_close(in);
+        return 1;
+    }
+    char *buf = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    unsigned long long h64 = CONTENT_HASH_SEED, done = 0;
+    int ok = 1;
+    while (ok && done < size) {
+        size_t want = size - done < COPY_BUFFER_SIZE ? (size_t)(size - done) : COPY_BUFFER_SIZE;
+        size_t got = 0;
+        while (got < want) {
+            long long n = file_pread(in, buf + got, want - got, offset + done + got);
+            if (n <= 0)
+                break;
+            got += (size_t)n;
+        }
+        ok = got == want && file_pwrite(out, buf, want, done);
+        h64 = content_hash_update(h64, buf, want);
+        done += want;
+    }
+    free(buf);
+    file_close(in);
+    if (!file_close(out))
+        ok = 0;
+    if (ok && content_hash_final(h64) != hash) {
+        console_printf("エラー: %s の内容が索引と一致しません。\n", member);
+        ok = 0;
+    }
+    if (!ok) {
+        delete_file(path);
+        return 1;
+    }
+    set_file_mtime(path, mtime);
+    console_printf("展開: %s:%s -> %s\n", archive, member, path);
+    return 0;
+}
+
+int run_unpack(int argc, char *argv[]) {
+    if (argc < 2) {
+        console_printf("使い方: AutoFileMoveMaster --unpack <アーカイブ> <展開先フォルダ> [メンバー名]\n");
+        return 1;
+    }
+    return argc >= 3 ? archive_unpack_member(argv[0], argv[1], argv[2]) : archive_unpack_all(argv[0], argv[1]);
+}
+
+// ----- 小さなファイルの一括コピー（io_uring） -----
+// 小さなファイルでは、存在確認・オープン・読み込み・書き込み・クローズを1件ずつ順に待つ
+// システムコールの往復がコピー時間の大半を占める。Linux では io_uring を使い、ジョブ内の
+// 新規の小さなファイルについて各段階をまとめて投入し、1回の待ち合わせで全件分を完了させる
+// （1件あたり数回のシステムコールが、1段階あたり1回になる）。
+//   1. コピー元・コピー先の statx（コピー先が既にあるファイルは通常の処理に回す）
+//   2. コピー元・コピー先の openat
+//   3. コピー元の read（内容ハッシュはここで計算する）
+//   4. コピー先の write とコピー元の close
+//   5. 更新日時の設定（io_uring に操作がないため futimens）とコピー先の close
+// ソース削除は従来どおり検証・削除ステージでまとめて行う。
+// リングはワーカーごとに1つ持ち、深さは uring_depth（0 なら使わない）。カーネルが io_uring に
+// 対応しない、または必要な操作がない場合は、最初の失敗を記録して以後は通常の処理を使う。
+#define URING_MAX_FILE_SIZE (64 * 1024)   // 一括コピーの対象とするファイルサイズの上限
+#define URING_MAX_DEPTH 1024
+#define URING_NOT_HANDLED 2               // uring_copy_files で処理しなかったファイルの status
+
+#ifdef HAVE_IO_URING
+typedef struct _Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned tail;          // 次に書き込む SQE の位置
+    unsigned queued;        // 未投入の SQE 数
+} Uring;
+
+// 一括コピー中のファイル1件分の状態
+typedef struct _UringFile {
+    size_t index;           // マニフェストのファイル番号
+    char src[MAX_PATH];
+    char dest[MAX_PATH];
+    struct statx src_stat;
+    struct statx dest_stat;
+    int res[2];             // 直前の段階の結果（コピー元・コピー先）
+    int in, out;            // 開いている記述子（クローズを投入したら -1）
+    int created;            // コピー先を作成した（失敗したら削除する）
+    int ok;                 // ここまでの段階が成功していれば1
+    int retry;              // 通常の処理でコピーし直す（読み込み中にファイルが短くなった）
+    size_t len;             // 読み込んだバイト数
+} UringFile;
+
+// ワーカーごとの一括コピーの状態
+typedef struct _UringContext {
+    Uring ring;
+    UringFile *files;
+    char *data;             // ファイルごとの読み込みバッファ（URING_MAX_FILE_SIZE ずつ）
+    int files_max;          // 1回にまとめるファイル数（リングの深さの半分）
+} UringContext;
+
+#define URING_FILE_DATA(ctx, j) ((ctx)->data + (size_t)(j) * URING_MAX_FILE_SIZE)
+
+static THREAD_LOCAL UringContext *t_uring;
+static THREAD_LOCAL int t_uringFailed;
+static int g_uringUnavailable;      // io_uring を使えないことが分かったら1
+
+static void uring_unmap(Uring *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+}
+
+// 一括コピーに必要な操作にカーネルが対応しているか
+static int uring_probe(int fd) {
+    static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, size);
+    if (!probe)
+        return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok)
+        errno = EOPNOTSUPP;
+    return ok;
+}
+
+// リングを作成する（成功で非0、失敗時は errno を設定する）
+static int uring_setup(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return 0;
+    if (!uring_probe(r->fd)) {
+        int err = errno;
+        close(r->fd);
+        errno = err;
+        return 0;
+    }
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        uring_unmap(r);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            r->cq_map = NULL;
+            uring_unmap(r);
+            return 0;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_unmap(r);
+        return 0;
+    }
+    char *sq = (char*)r->sq_map, *cq = (char*)r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    return 1;
+}
+
+// 次の SQE を取り出す。user_data に結果の格納先を設定する。
+// 1段階で投入する数はリングの深さ以下に抑えているため、空きは必ずある。
+static struct io_uring_sqe *uring_sqe(Uring *r, int op, int *res) {
+    unsigned index = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char)op;
+    sqe->user_data = (unsigned long long)(uintptr_t)res;
+    r->sq_array[index] = index;
+    r->tail++;
+    r->queued++;
+    *res = -EINPROGRESS;
+    return sqe;
+}
+
+// 溜めた SQE を投入し、すべて完了するまで待つ。各操作の結果は SQE の格納先に入る。
+// リング自体のエラーでは0を返す（未完了の操作の結果は -EINPROGRESS のまま）。
+static int uring_submit_wait(Uring *r) {
+    unsigned pending = r->queued;
+    if (pending == 0)
+        return 1;
+    ATOMIC_STORE(r->sq_tail, r->tail);
+    r->queued = 0;
+    while (pending > 0) {
+        unsigned to_submit = r->tail - ATOMIC_LOAD(r->sq_head);
+        if (syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return 0;
+        unsigned head = *r->cq_head, tail = ATOMIC_LOAD(r->cq_tail);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *(int*)(uintptr_t)cqe->user_data = cqe->res;
+            pending--;
+        }
+        ATOMIC_STORE(r->cq_head, head);
+    }
+    return 1;
+}
+
+static void uring_prep_statx(Uring *r, const char *path, struct statx *st, int *res) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_STATX, res);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long long)(uintptr_t)path;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (unsigned long long)(uintptr_t)st;
+    sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+}
+
+static void uring_prep_openat(Uring *r, const char *path, int flags, unsigned mode, int *res) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_OPENAT, res);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long long)(uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = (unsigned)(flags | O_CLOEXEC);
+}
+
+static void uring_prep_rw(Uring *r, int op, int fd, void *buf, size_t len, int *res) {
+    struct io_uring_sqe *sqe = uring_sqe(r, op, res);
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = 0;
+}
+
+static void uring_prep_close(Uring *r, int fd, int *res) {
+    struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_CLOSE, res);
+    sqe->fd = fd;
+}
+
+// 呼び出したワーカーの一括コピーの状態を解放する（スレッド終了時、またはリングのエラー時）
+static void uring_context_free(void) {
+    if (!t_uring)
+        return;
+    uring_unmap(&t_uring->ring);
+    free(t_uring->files);
+    free(t_uring->data);
+    free(t_uring);
+    t_uring = NULL;
+}
+
+// 呼び出したワーカーの一括コピーの状態を返す（使えなければ NULL）
+static UringContext *uring_context(void) {
+    if (t_uring)
+        return t_uring;
+    if (t_uringFailed || g_settings.uring_depth < 2 || ATOMIC_LOAD(&g_uringUnavailable))
+        return NULL;
+    unsigned depth = (unsigned)(g_settings.uring_depth < URING_MAX_DEPTH ? g_settings.uring_depth : URING_MAX_DEPTH);
+    UringContext *ctx = (UringContext*)calloc(1, sizeof(UringContext));
+    if (!ctx) {
+        t_uringFailed = 1;
+        return NULL;
+    }
+    if (!uring_setup(&ctx->ring, depth)) {
+        // カーネル・コンテナの設定で使えない場合は、全ワーカーで通常の処理に切り替える
+        int err = errno;
+        free(ctx);
+        t_uringFailed = 1;
+        if (!ATOMIC_EXCHANGE(&g_uringUnavailable, 1))
+            log_message("io_uring を使用できないため、小さなファイルも1件ずつコピーします (%s)\n", strerror(err));
+        return NULL;
+    }
+    ctx->files_max = (int)(ctx->ring.entries / 2);
+    if (ctx->files_max > (int)depth / 2)
+        ctx->files_max = (int)depth / 2;
+    ctx->files = (UringFile*)malloc(ctx->files_max * sizeof(UringFile));
+    ctx->data = (char*)malloc((size_t)ctx->files_max * URING_MAX_FILE_SIZE);
+    t_uring = ctx;
+    if (!ctx->files || !ctx->data) {
+        uring_context_free();
+        t_uringFailed = 1;
+        return NULL;
+    }
+    return ctx;
+}
+
+// リングの待ち合わせに失敗した：投入済みの操作の結果が分からないため、このワーカーでは以後
+// io_uring を使わない。開いたままの記述子を閉じ、作りかけのコピー先を削除してから、
+// まだ処理を終えていないファイルを通常の処理でやり直す。
+static size_t uring_abandon(UringContext *ctx, int n, int *status, size_t count) {
+    int err = errno;
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        if (f->in >= 0)
+            close(f->in);
+        if (f->out >= 0)
+            close(f->out);
+        if (f->created)
+            delete_file(f->dest);
+    }
+    uring_context_free();
+    t_uringFailed = 1;
+    log_message("io_uring の待ち合わせに失敗しました (%s)。以後は1件ずつコピーします\n", strerror(err));
+    for (size_t k = 0; k < count; k++)
+        status[k] = URING_NOT_HANDLED;
+    return count;
+}
+#endif
+
+// 1ジョブにまとめるファイル数（一括コピーが有効なら、1回でまとめられる数まで増やす）
+static size_t uring_job_files(void) {
+#ifdef HAVE_IO_URING
+    int batch = (g_settings.uring_depth < URING_MAX_DEPTH ? g_settings.uring_depth : URING_MAX_DEPTH) / 2;
+    if (!ATOMIC_LOAD(&g_uringUnavailable) && batch > FILES_PER_JOB)
+        return (size_t)batch;
+#endif
+    return FILES_PER_JOB;
+}
+
+// スレッド終了時に呼び、リングを閉じる
+void uring_release(void) {
+#ifdef HAVE_IO_URING
+    uring_context_free();
+#endif
+}
+
+// マニフェストのファイル番号 first から最大 count 件を io_uring でまとめてコピーする。
+// 対象（新規の小さなファイル）の status[k] には copy_or_delete_file と同じ戻り値を入れ、
+// それ以外は URING_NOT_HANDLED にする。調べたファイル数を返す（io_uring を使えなければ0）。
+// start は呼び出し側でこのまとまりの処理を始めた時刻。処理したファイルの file_seconds[k] には、
+// まとまりの所要時間を件数で割った1件分の時間を入れる（ファイルごとの時間はこの値で記録する）。
+size_t uring_copy_files(CopyTask *task, size_t first, size_t count, int *status, double start, double *file_seconds) {
+#ifdef HAVE_IO_URING
+    UringContext *ctx = uring_context();
+    if (!ctx)
+        return 0;
+    if (count > (size_t)ctx->files_max)
+        count = (size_t)ctx->files_max;
+    Uring *r = &ctx->ring;
+    const Manifest *m = &task->manifest;
+    int n = 0;
+    for (size_t k = 0; k < count; k++) {
+        size_t i = first + k;
+        const ManifestEntry *e = &m->files[i];
+        JournalEntry je;
+        status[k] = URING_NOT_HANDLED;
+        // フォルダごとの移動・同一ボリューム内の移動・重複排除・再開は通常の処理に任せる
+        if (e->size > URING_MAX_FILE_SIZE || task->same_volume || (task->dir_moved && task->dir_moved[e->dir]) ||
+            (task->dedup_group && task->dedup_group[i]))
+            continue;
+        UringFile *f = &ctx->files[n];
+        // パスが長すぎるファイルは通常の処理で失敗として扱う
+        if (!manifest_file_path(m, task->src, i, f->src, sizeof(f->src)) ||
+            journal_lookup(task->journal, source_relative(task, f->src), e, &je) ||
+            !task_dest_file_path(task, i, f->dest, sizeof(f->dest)))
+            continue;
+        f->index = k;
+        f->in = f->out = -1;
+        f->created = 0;
+        uring_prep_statx(r, f->src, &f->src_stat, &f->res[0]);
+        uring_prep_statx(r, f->dest, &f->dest_stat, &f->res[1]);
+        n++;
+    }
+    if (n == 0)
+        return count;
+    if (!uring_submit_wait(r))
+        return uring_abandon(ctx, n, status, count);
+
+    // コピー先が既にある（同一判定が必要な）ファイルや、状態を確認できないファイルは通常の処理に回す
+    int placed = 0;
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        const ManifestEntry *e = &m->files[first + f->index];
+        if (f->res[0] < 0 || f->res[1] != -ENOENT || !S_ISREG(f->src_stat.stx_mode) ||
+            f->src_stat.stx_size > URING_MAX_FILE_SIZE)
+            continue;
+        if (j != placed)
+            ctx->files[placed] = *f;
+        f = &ctx->files[placed++];
+        journal_plan(task->journal, source_relative(task, f->src), 'n', e, dest_relative(task, f->dest));
+        f->ok = 1;
+        f->retry = 0;
+        f->len = 0;
+        uring_prep_openat(r, f->src, O_RDONLY, 0, &f->res[0]);
+        uring_prep_openat(r, f->dest, O_WRONLY | O_CREAT | O_TRUNC, f->src_stat.stx_mode & 0777, &f->res[1]);
+    }
+    n = placed;
+    if (n == 0)
+        return count;
+    if (!uring_submit_wait(r))
+        return uring_abandon(ctx, n, status, count);
+
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        f->in = f->res[0];
+        f->out = f->res[1];
+        f->created = f->out >= 0;
+        f->ok = f->in >= 0 && f->out >= 0;
+        if (f->ok && f->src_stat.stx_size > 0)
+            uring_prep_rw(r, IORING_OP_READ, f->in, URING_FILE_DATA(ctx, j), (size_t)f->src_stat.stx_size, &f->res[0]);
+    }
+    if (!uring_submit_wait(r))
+        return uring_abandon(ctx, n, status, count);
+
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        if (f->ok && f->src_stat.stx_size > 0) {
+            // 読み込み中に短くなったファイルは途中までをコピーせず、通常の処理でコピーし直す
+            f->retry = f->res[0] >= 0 && (unsigned long long)f->res[0] != f->src_stat.stx_size;
+            f->ok = f->res[0] >= 0 && !f->retry;
+            f->len = f->ok ? (size_t)f->res[0] : 0;
+        }
+        if (f->ok && f->len > 0)
+            uring_prep_rw(r, IORING_OP_WRITE, f->out, URING_FILE_DATA(ctx, j), f->len, &f->res[1]);
+        else
+            f->res[1] = 0;
+        if (f->in >= 0)
+            uring_prep_close(r, f->in, &f->res[0]);
+        f->in = -1;
+    }
+    if (!uring_submit_wait(r))
+        return uring_abandon(ctx, n, status, count);
+
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        if (f->ok)
+            f->ok = f->res[1] >= 0 && (size_t)f->res[1] == f->len;
+        if (f->ok) {
+            struct timespec times[2] = {
+                { f->src_stat.stx_atime.tv_sec, f->src_stat.stx_atime.tv_nsec },
+                { f->src_stat.stx_mtime.tv_sec, f->src_stat.stx_mtime.tv_nsec }
+            };
+            futimens(f->out, times);
+        }
+        if (f->out >= 0)
+            uring_prep_close(r, f->out, &f->res[1]);
+        f->out = -1;
+    }
+    if (!uring_submit_wait(r))
+        return uring_abandon(ctx, n, status, count);
+
+    double seconds = (monotonic_seconds() - start) / n;
+    unsigned long long bytes = 0;
+    for (int j = 0; j < n; j++) {
+        UringFile *f = &ctx->files[j];
+        const ManifestEntry *e = &m->files[first + f->index];
+        if (f->ok && f->created && f->res[1] != 0)
+            f->ok = 0;      // クローズでの書き込みエラー
+        if (f->retry) {
+            if (f->created)
+                delete_file(f->dest);
+            continue;       // status は URING_NOT_HANDLED のまま
+        }
+        task_stage(task, STAGE_COPY, monotonic_seconds() - seconds);
+        file_seconds[f->index] = seconds;
+        if (!f->ok) {
+            if (f->created)
+                delete_file(f->dest);
+            console_printf("\nエラー: %s を %s にコピーできませんでした。\n", f->src, f->dest);
+            log_message("%s -> %s: コピー失敗\n", f->src, f->dest);
+            status[f->index] = -1;
+            continue;
+        }
+        CopyResult result;
+        result.backend = BACKEND_URING;
+        result.hash = content_hash_final(content_hash_update(CONTENT_HASH_SEED, URING_FILE_DATA(ctx, j), f->len));
+        result.seconds = seconds;
+        bytes += f->len;
+        status[f->index] = finish_new_copy(task, e, f->src, f->dest, &result, monotonic_seconds() - seconds);
+    }
+    device_throttle(task, bytes, start);
+    return count;
+
+#else
+    (void)task;
+    (void)first;
+    (void)count;
+    (void)status;
+    (void)start;
+    (void)file_seconds;
+    return 0;
+#endif
+}
+
+// ----- 物理配置順の並べ替え -----
+// 回転ディスク（HDD）では、列挙順（フォルダ内の並び）でファイルを読むとヘッドがディスク上を
+// 行き来する。history.txt の並び順に "inode" / "extent" を指定したタスクは、コピーを始める前に
+// タスク全体のファイル一覧を並べ替え、ジョブはその順に分割される。
+//   inode : inode 番号順（列挙時に取得済みのため追加の読み込みはない。ext4 などでは
+//           inode 番号がおおむねディスク上の位置に対応する）
+//   extent: 各ファイルの先頭データの物理位置順（Linux の FIEMAP。使えないファイルシステムでは inode 順）
+// 並べ替えたタスクでは、コピー中のファイルの数件先のファイルを先読みするよう OS に伝え、
+// 次のファイルの読み込みを現在のファイルのコピーと重ねる。Windows では列挙順のままコピーする。
+#define ORDER_READAHEAD_FILES 4                 // 先読みを指示する先のファイル数
+#define ORDER_READAHEAD_BYTES (4 * 1024 * 1024) // 1ファイルあたりの先読みの上限
+
+typedef struct _OrderKey {
+    unsigned long long key;
+    size_t index;
+} OrderKey;
+
+static int order_key_compare(const void *a, const void *b) {
+    const OrderKey *x = (const OrderKey*)a, *y = (const OrderKey*)b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+#ifdef __linux__
+// ファイルの先頭データの物理位置（バイト）を *offset に返す。データのないファイルは0。
+// 成功で1、このファイルだけの失敗で0、ファイルシステムが FIEMAP に対応しなければ-1
+static int file_physical_offset(const char *path, unsigned long long *offset) {
+    unsigned long long buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(unsigned long long) + 1];
+    struct fiemap *map = (struct fiemap*)buf;
+    *offset = 0;
+    int fd = open_path(path, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    memset(buf, 0, sizeof(buf));
+    map->fm_length = ~0ULL;
+    map->fm_extent_count = 1;
+    int status = ioctl(fd, FS_IOC_FIEMAP, map) == 0 ? 1 : backend_unsupported(errno) ? -1 : 0;
+    close(fd);
+    if (status == 1 && map->fm_mapped_extents > 0)
+        *offset = map->fm_extents[0].fe_physical;
+    return status;
+}
+#endif
+
+// タスクのファイル一覧を copy_order の順に並べ替える（ファイルごとの重複グループも合わせて並べ替える）
+void order_task_files(CopyTask *task) {
+    Manifest *m = &task->manifest;
+    size_t n = m->file_count;
+    if (task->copy_order == ORDER_DIR || n < 2)
+        return;
+#ifdef _WIN32
+    log_message("[タスク %d] Windows では並び順の指定は使用できないため、列挙順でコピーします\n", task->task_id);
+#else
+    double start = monotonic_seconds();
+    OrderKey *keys = (OrderKey*)malloc(n * sizeof(OrderKey));
+    ManifestEntry *files = (ManifestEntry*)malloc(n * sizeof(ManifestEntry));
+    unsigned int *groups = task->dedup_group ? (unsigned int*)malloc(n * sizeof(unsigned int)) : NULL;
+    if (!keys || !files || (task->dedup_group && !groups)) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    CopyOrder order = task->copy_order;
+    for (size_t i = 0; i < n; i++) {
+        keys[i].key = m->files[i].ino;
+        keys[i].index = i;
+    }
+#ifdef __linux__
+    if (order == ORDER_EXTENT) {
+        char path[MAX_PATH];
+        for (size_t i = 0; i < n; i++) {
+            unsigned long long offset;
+            manifest_file_path(m, task->src, i, path, sizeof(path));
+            int status = file_physical_offset(path, &offset);
+            if (status < 0) {
+                log_message("[タスク %d] 物理位置を取得できないため inode 順でコピーします (%s)\n", task->task_id,
+                            strerror(errno));
+                for (size_t j = 0; j < i; j++)
+                    keys[j].key = m->files[j].ino;
+                order = ORDER_INODE;
+                break;
+            }
+            keys[i].key = offset;
+        }
+    }
+#else
+    order = ORDER_INODE;
+#endif
+    qsort(keys, n, sizeof(OrderKey), order_key_compare);
+    for (size_t i = 0; i < n; i++) {
+        files[i] = m->files[keys[i].index];
+        if (groups)
+            groups[i] = task->dedup_group[keys[i].index];
+    }
+    free(m->files);
+    m->files = files;
+    m->file_capacity = n;
+    if (groups) {
+        free(task->dedup_group);
+        task->dedup_group = groups;
+    }
+    free(keys);
+    log_message("[タスク %d] %zu 件のファイルを%s順に並べ替えました (%.3f 秒)\n", task->task_id, n,
+                order == ORDER_EXTENT ? "物理位置" : " inode ", monotonic_seconds() - start);
+#endif
+}
+
+// 並べ替えたタスクで、ファイル番号 index の先読みを OS に指示する
+void order_prefetch(CopyTask *task, size_t index) {
+#ifdef _WIN32
+    (void)task;
+    (void)index;
+#else
+    const ManifestEntry *e = &task->manifest.files[index];
+    if (task->copy_order == ORDER_DIR || e->size == 0)
+        return;
+    char path[MAX_PATH];
+    if (!manifest_file_path(&task->manifest, task->src, index, path, sizeof(path)))
+        return;
+    int fd = open_path(path, O_RDONLY, 0);
+    if (fd < 0)
+        return;
+    size_t len = e->size < ORDER_READAHEAD_BYTES ? (size_t)e->size : ORDER_READAHEAD_BYTES;
+#ifdef __linux__
+    readahead(fd, 0, len);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, (off_t)len, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+#endif
+}
+
+// ----- タスク処理 -----
+// タスクの開始：開始をログに記録し、コピーを開始する
+void start_copy_task(WorkerPool *pool, CopyTask *task, int worker_id) {
+    time_t startTime = time(NULL);
+    char time_buf[64];
+    task->start_seconds = monotonic_seconds();
+    ATOMIC_STORE(&task->progress_state, PROGRESS_RUNNING);
+    order_task_files(task);
+    console_printf("\n[タスク %d] コピー開始: %s -> %s\n", task->task_id, task->src, task->dest);
+    log_message("[タスク %d] コピー開始: %s -> %s, 開始時刻: %s", task->task_id, task->src, task->dest, format_time(startTime, time_buf, sizeof(time_buf)));
+    if (task->archive) {
+        // アーカイブは1つのファイルに先頭から順に書き込むため、このワーカーだけで処理する
+        archive_task_run(task);
+        finish_copy_task(task);
+        return;
+    }
+    task->journal = (Journal*)malloc(sizeof(Journal));
+    if (!task->journal) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    create_directory_recursive(task->dest);
+    task->index = dest_index_acquire(task->dest, g_settings.content_index);
+    journal_open(task->journal, task->src, task->dest, g_settings.journal);
+    task->same_volume = g_deleteSource && same_volume(task->src, task->dest);
+    copy_folder_recursive(pool, task, worker_id);
+}
+
+// タスクの完了：最後のファイルを処理したワーカーから呼ばれる
+void finish_copy_task(CopyTask *task) {
+    time_t endTime = time(NULL);
+    char time_buf[64];
+    task->elapsed_seconds = monotonic_seconds() - task->start_seconds;
+    console_printf("\n[タスク %d] コピー完了！\n", task->task_id);
+    if (task->index) {
+        dest_index_release(task->index);
+        task->index = NULL;
+    }
+    if (task->journal) {
+        journal_close(task->journal);
+        free(task->journal);
+        task->journal = NULL;
+    }
+    telemetry_merge(task);
+    const Telemetry *t = &task->telemetry[0];
+    unsigned long long files = t->stages[STAGE_FILE].count;
+    log_message("[タスク %d] 処理結果: 同一 %llu 件, 異なる %llu 件, 新規 %llu 件, 失敗 %llu 件, %.2f 秒 (%.1f 件/s)\n",
+                task->task_id, t->outcomes[OUTCOME_IDENTICAL], t->outcomes[OUTCOME_DIFFERENT],
+                t->outcomes[OUTCOME_NEW], t->outcomes[OUTCOME_FAILED], task->elapsed_seconds,
+                task->elapsed_seconds > 0 ? files / task->elapsed_seconds : 0.0);
+    log_message("[タスク %d] 同一判定: インデックス %llu 件, メタデータ %llu 件, サンプル %llu 件, 全比較 %llu 件\n",
+                task->task_id, task->compare_settled[COMPARE_TIER_INDEX], task->compare_settled[COMPARE_TIER_META],
+                task->compare_settled[COMPARE_TIER_SAMPLE], task->compare_settled[COMPARE_TIER_FULL]);
+    for (int b = 0; b < BACKEND_COUNT; b++) {
+        if (task->backend_files[b] == 0)
+            continue;
+        char size_buf[64], rate_buf[64];
+        double seconds = task->backend_usec[b] / 1e6;
+        log_message("[タスク %d] コピー方式 %s: %llu 件, %s, %s/s\n", task->task_id, g_backendNames[b],
+                    task->backend_files[b], format_size(task->backend_bytes[b], size_buf, sizeof(size_buf)),
+                    format_size(seconds > 0 ? (unsigned long long)(task->backend_bytes[b] / seconds) : 0,
+                                rate_buf, sizeof(rate_buf)));
+    }
+    log_message("[タスク %d] コピー完了: %s -> %s, 終了時刻: %s\n", task->task_id, task->src, task->dest, format_time(endTime, time_buf, sizeof(time_buf)));
+    ATOMIC_STORE(&task->progress_state, PROGRESS_DONE);
+}
+
+// ジョブのファイル範囲をコピーする。大きな範囲は後半を切り出して積み直す。
+// デバイスの同時実行数が上限に達していればジョブを預けて0を返す（ジョブは解放しない）。
+static int copy_manifest_range(WorkerPool *pool, Job *job, int worker_id) {
+    CopyTask *task = job->task;
+    size_t job_files = uring_job_files();
+    while (job->count > job_files) {
+        size_t half = job->count / 2;
+        pool_submit(pool, job_create(JOB_COPY_FILES, task, job->first + half, job->count - half), worker_id);
+        job->count = half;
+    }
+    if (!device_acquire(job))
+        return 0;
+    const Manifest *m = &task->manifest;
+    size_t end = job->first + job->count;
+    for (size_t i = job->first; i < end && i < job->first + ORDER_READAHEAD_FILES; i++)
+        order_prefetch(task, i);
+    for (size_t i = job->first; i < end; ) {
+        // 新規の小さなファイルは io_uring でまとめてコピーし、残りを1件ずつ処理する
+        int status[URING_MAX_DEPTH / 2];
+        double file_seconds[URING_MAX_DEPTH / 2];
+        size_t n = uring_copy_files(task, i, end - i, status, monotonic_seconds(), file_seconds);
+        if (n == 0) {
+            n = 1;
+            status[0] = URING_NOT_HANDLED;
+        }
+        for (size_t k = 0; k < n; k++, i++) {
+            FileOutcome outcome = OUTCOME_NEW;
+            if (i + ORDER_READAHEAD_FILES < end)
+                order_prefetch(task, i + ORDER_READAHEAD_FILES);
+            // まとめてコピーしたファイルは1件分の時間、それ以外はこのファイルの処理の開始時刻から計る
+            double start = monotonic_seconds() - (status[k] == URING_NOT_HANDLED ? 0 : file_seconds[k]);
+            if (status[k] == URING_NOT_HANDLED) {
+                char srcPath[MAX_PATH], destPath[MAX_PATH];
+                if (!manifest_file_path(m, task->src, i, srcPath, sizeof(srcPath)) ||
+                    !task_dest_file_path(task, i, destPath, sizeof(destPath)))
+                    status[k] = report_path_too_long(task, i);
+                else
+                    status[k] = copy_or_delete_file(task, &m->files[i], srcPath, destPath, &outcome, start);
+            }
+            if (status[k] > 0)
+                continue;   // 完了は検証・削除ステージが通知する
+            task_file_done(task, status[k] == 0 ? outcome : OUTCOME_FAILED, m->files[i].size, start);
+            if (status[k] < 0 && task->file_failed)
+                task->file_failed[i] = 1;
+            if (status[k] == 0)
+                ATOMIC_ADD(&task->copied_size, m->files[i].size);
+            release_directory(task, m->files[i].dir);
+        }
+    }
+    device_release(pool, task, worker_id);
+    return 1;
+}
+
+void run_job(WorkerPool *pool, Job *job, int worker_id) {
+    if (job->type == JOB_START_TASK) {
+        start_copy_task(pool, job->task, worker_id);
+    } else if (job->type == JOB_COPY_RANGE) {
+        range_copy_work(job->range);
+        range_copy_release(job->range);
+    } else if (!copy_manifest_range(pool, job, worker_id)) {
+        return;     // デバイスに預けた（空いたときに投入し直される）
+    }
+    free(job);
+}
+
+// 比較モードの文字列を解釈する（空または不明な値は "full"）
+CompareMode parse_compare_mode(const char *option) {
+    if (strcmp(option, "meta") == 0)
+        return COMPARE_META;
+    if (strcmp(option, "sample") == 0)
+        return COMPARE_SAMPLE;
+    if (option[0] != '\0' && strcmp(option, "full") != 0)
+        console_printf("警告: 不明な比較モード \"%s\" のため full で比較します。\n", option);
+    return COMPARE_FULL;
+}
+
+// 並び順の文字列を解釈する（空または不明な値は "dir"）
+CopyOrder parse_copy_order(const char *option) {
+    if (strcmp(option, "inode") == 0)
+        return ORDER_INODE;
+    if (strcmp(option, "extent") == 0)
+        return ORDER_EXTENT;
+    if (option[0] != '\0' && strcmp(option, "dir") != 0)
+        console_printf("警告: 不明な並び順 \"%s\" のため列挙順でコピーします。\n", option);
+    return ORDER_DIR;
+}
+
+// ----- 履歴読み込み -----
+// history.txt の各行は
+// "コピー元, コピー先, 置換前文字列, 置換後文字列, オプション, 比較モード, 並び順"
+// の形式で記述（オプションが "d" ならコピー元直下のフォルダ名に対して置換処理を適用）。
+// 比較モードは "full"（既定）/ "sample" / "meta"、並び順は "dir"（既定）/ "inode" / "extent" のいずれか。
+// 各列は前後の空白を除いて読む。カンマや前後の空白を含む列は "..." で囲み、囲みの中の
+// " は "" と書く。空行と # で始まる行は読み飛ばす。
+// 行の長さや行数に上限はなく、文字列はすべてアリーナに置くため、メモリは履歴の大きさに比例する。
+#define HISTORY_FIELDS 7
+
+// history.txt の1行（1タスク）
+typedef struct _HistoryEntry {
+    const char *src;
+    const char *dest;
+    const char *replace_from;
+    const char *replace_to;
+    const char *option;
+    size_t src_len;
+    size_t dest_len;
+    const RenameRules *rules;   // 同じ置換指定の行は同じ規則を共有する
+    CompareMode compare_mode;
+    CopyOrder copy_order;
+    unsigned int line;          // history.txt での行番号（メッセージ用）
+} HistoryEntry;
+
+typedef struct _History {
+    Arena arena;
+    HistoryEntry *entries;
+    size_t count;
+    size_t capacity;
+    RenameRules **compiled;     // 作成した置換規則（解放用）
+    size_t compiled_count;
+} History;
+
+// 1行を読み込む（長さに上限はなく、バッファは必要に応じて広げる）。ファイル末尾なら0
+static int history_read_line(FILE *fp, char **buf, size_t *capacity) {
+    size_t len = 0;
+    for (;;) {
+        if (*capacity - len < 2)
+            *buf = (char*)grow_array(*buf, capacity, 1);
+        if (!fgets(*buf + len, (int)(*capacity - len), fp))
+            break;
+        len += strlen(*buf + len);
+        if (len > 0 && (*buf)[len - 1] == '\n')
+            break;
+    }
+    if (len == 0)
+        return 0;
+    while (len > 0 && ((*buf)[len - 1] == '\n' || (*buf)[len - 1] == '\r'))
+        len--;
+    (*buf)[len] = '\0';
+    return 1;
+}
+
+// 1行を列に分ける。列は行バッファの中で '\0' 終端に書き換える（"" の囲みは外す）。
+// 戻り値は列の数。囲みが閉じていない、または列が多すぎる場合は -1
+static int history_split(char *line, char *fields[HISTORY_FIELDS], size_t lens[HISTORY_FIELDS]) {
+    char *in = line, *out = line;
+    int count = 0;
+    for (;;) {
+        while (isspace((unsigned char)*in))
+            in++;
+        char *start = out, *end;
+        if (*in == '"') {
+            in++;
+            for (;;) {
+                if (*in == '\0')
+                    return -1;
+                if (*in == '"') {
+                    if (in[1] != '"')
+                        break;
+                    in++;
+                }
+                *out++ = *in++;
+            }
+            in++;
+            end = out;
+            while (isspace((unsigned char)*in))
+                in++;
+            if (*in != ',' && *in != '\0')
+                return -1;
+        } else {
+            while (*in != ',' && *in != '\0')
+                *out++ = *in++;
+            end = out;
+            while (end > start && isspace((unsigned char)end[-1]))
+                end--;
+        }
+        char sep = *in;
+        *end = '\0';
+        if (count < HISTORY_FIELDS) {
+            fields[count] = start;
+            lens[count] = (size_t)(end - start);
+            count++;
+        } else if (end != start) {
+            return -1;
+        }
+        if (sep == '\0')
+            break;
+        in++;
+        out = end + 1;
+    }
+    return count;
+}
+
+// 末尾のパス区切り文字を除く（"/" や "C:\" のようなルートはそのまま）
+static size_t history_strip_separator(char *path, size_t len) {
+    while (len > 1 && (path[len - 1] == PATH_SEP || path[len - 1] == '/') &&
+           !(len == 3 && path[1] == ':'))
+        path[--len] = '\0';
+    return len;
+}
+
+static char *history_strdup(History *h, const char *s, size_t len) {
+    char *copy = (char*)arena_alloc(&h->arena, len + 1);
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+static int history_same_task(const HistoryEntry *a, const HistoryEntry *b) {
+    return a->src_len == b->src_len && a->dest_len == b->dest_len &&
+           strcmp(a->src, b->src) == 0 && strcmp(a->dest, b->dest) == 0;
+}
+
+static int history_same_rules(const HistoryEntry *a, const HistoryEntry *b) {
+    return strcmp(a->replace_from, b->replace_from) == 0 && strcmp(a->replace_to, b->replace_to) == 0 &&
+           strcmp(a->option, b->option) == 0;
+}
+
+// entries[index] と同じものを表から探す。見つかればその番号、無ければ表に追加して index を返す
+static size_t history_probe(size_t *slots, size_t mask, unsigned long long hash, const HistoryEntry *entries,
+                            size_t index, int (*same)(const HistoryEntry*, const HistoryEntry*)) {
+    size_t i = (size_t)hash & mask;
+    while (slots[i]) {
+        if (same(&entries[slots[i] - 1], &entries[index]))
+            return slots[i] - 1;
+        i = (i + 1) & mask;
+    }
+    slots[i] = index + 1;
+    return index;
+}
+
+// 1行を解釈して履歴に追加する（書式が正しくなければエラーを表示して追加しない）
+static void history_add_line(History *h, char *line, unsigned int line_no) {
+    char *fields[HISTORY_FIELDS];
+    size_t lens[HISTORY_FIELDS];
+    int count = history_split(line, fields, lens);
+    if (count < 0) {
+        printf("エラー: history.txt の %u 行目: \"...\" の囲みが正しくないか、列が多すぎます。この行はスキップします。\n", line_no);
+        return;
+    }
+    if (count < 2 || lens[0] == 0 || lens[1] == 0) {
+        printf("エラー: history.txt の %u 行目: コピー元とコピー先の両方が必要です。この行はスキップします。\n", line_no);
+        return;
+    }
+    for (int i = count; i < HISTORY_FIELDS; i++) {
+        fields[i] = (char*)"";
+        lens[i] = 0;
+    }
+    lens[0] = history_strip_separator(fields[0], lens[0]);
+    lens[1] = history_strip_separator(fields[1], lens[1]);
+    for (int i = 0; i < 2; i++) {
+        if (lens[i] >= MAX_PATH) {
+            printf("エラー: history.txt の %u 行目: パスが長すぎます（%zu バイト、上限 %d バイト）。この行はスキップします。\n",
+                   line_no, lens[i], (int)MAX_PATH - 1);
+            return;
+        }
+    }
+    if (h->count == h->capacity)
+        h->entries = (HistoryEntry*)grow_array(h->entries, &h->capacity, sizeof(HistoryEntry));
+    HistoryEntry *e = &h->entries[h->count++];
+    memset(e, 0, sizeof(*e));
+    e->src = history_strdup(h, fields[0], lens[0]);
+    e->dest = history_strdup(h, fields[1], lens[1]);
+    e->replace_from = history_strdup(h, fields[2], lens[2]);
+    e->replace_to = history_strdup(h, fields[3], lens[3]);
+    e->option = history_strdup(h, fields[4], lens[4]);
+    e->src_len = lens[0];
+    e->dest_len = lens[1];
+    e->line = line_no;
+    e->compare_mode = parse_compare_mode(fields[5]);
+    e->copy_order = parse_copy_order(fields[6]);
+}
+
+// 読み込んだタスクを検証し、重複を除く。置換規則は同じ指定ごとに1回だけ作る。
+// ハッシュ表を使うため、件数に比例する時間で終わる。
+static void history_validate(History *h) {
+    size_t table_size = 16;
+    while (table_size < h->count * 2)
+        table_size *= 2;
+    size_t *tasks = (size_t*)calloc(table_size, sizeof(size_t));
+    size_t *rules = (size_t*)calloc(table_size, sizeof(size_t));
+    h->compiled = (RenameRules**)calloc(h->count ? h->count : 1, sizeof(RenameRules*));
+    if (!tasks || !rules || !h->compiled) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < h->count; i++) {
+        HistoryEntry *e = &h->entries[kept];
+        *e = h->entries[i];
+        if (e->src_len == e->dest_len && strcmp(e->src, e->dest) == 0) {
+            printf("エラー: history.txt の %u 行目: コピー元とコピー先が同じです。この行はスキップします。\n", e->line);
+            continue;
+        }
+        if (e->dest_len > e->src_len && strncmp(e->dest, e->src, e->src_len) == 0 &&
+            (e->dest[e->src_len] == PATH_SEP || e->dest[e->src_len] == '/')) {
+            printf("エラー: history.txt の %u 行目: コピー先がコピー元の中にあります。この行はスキップします。\n", e->line);
+            continue;
+        }
+        unsigned long long hash = string_hash(e->src) * 31 + string_hash(e->dest);
+        size_t same = history_probe(tasks, table_size - 1, hash, h->entries, kept, history_same_task);
+        if (same != kept) {
+            printf("警告: history.txt の %u 行目は %u 行目と同じタスクのため、スキップします。\n", e->line, h->entries[same].line);
+            continue;
+        }
+        hash = (string_hash(e->replace_from) * 31 + string_hash(e->replace_to)) * 31 + string_hash(e->option);
+        same = history_probe(rules, table_size - 1, hash, h->entries, kept, history_same_rules);
+        if (same != kept) {
+            e->rules = h->entries[same].rules;
+        } else {
+            RenameRules *r = (RenameRules*)arena_alloc(&h->arena, sizeof(RenameRules));
+            rename_rules_compile(r, e->replace_from, e->replace_to, e->option);
+            h->compiled[h->compiled_count++] = r;
+            e->rules = r;
+        }
+        if (!e->rules->valid) {
+            // 同じ指定の行ではエラーの詳細は最初の1回だけ表示される
+            printf("エラー: history.txt の %u 行目（%s）の置換規則が正しくないため、このタスクはスキップします。\n", e->line, e->src);
+            continue;
+        }
+        kept++;
+    }
+    h->count = kept;
+    free(tasks);
+    free(rules);
+}
+
+// history.txt を1行ずつ読み込む（ファイルが無ければ0件）
+void load_history(History *h) {
+    memset(h, 0, sizeof(*h));
+    FILE *file = fopen(HISTORY_FILE, "r");
+    if (!file)
+        return;
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned int line_no = 0;
+    while (history_read_line(file, &line, &capacity)) {
+        char *p = line;
+        if (++line_no == 1 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+            p += 3;     // UTF-8 の BOM
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+        history_add_line(h, p, line_no);
+    }
+    free(line);
+    fclose(file);
+    history_validate(h);
+}
+
+void history_free(History *h) {
+    for (size_t i = 0; i < h->compiled_count; i++)
+        rename_rules_free(h->compiled[i]);
+    free(h->compiled);
+    free(h->entries);
+    arena_free(&h->arena);
+    memset(h, 0, sizeof(*h));
+}
+
+// ----- 実行日時待機処理 -----
+// schedule.txt に "YYYY-MM-DD HH:MM:SS" 形式で指定された日時まで、
+// 日、時間、分、秒で残り時間をリアルタイムに表示しながら待機する。
+void wait_until_scheduled_time() {
+    FILE *fp = fopen(SCHEDULE_FILE, "r");
+    if (fp) {
+        char scheduleStr[64];
+        if (fgets(scheduleStr, sizeof(scheduleStr), fp)) {
+            scheduleStr[strcspn(scheduleStr, "\n")] = '\0';
+            struct tm tmSchedule = {0};
+            if (sscanf(scheduleStr, "%d-%d-%d %d:%d:%d",
+                       &tmSchedule.tm_year, &tmSchedule.tm_mon, &tmSchedule.tm_mday,
+                       &tmSchedule.tm_hour, &tmSchedule.tm_min, &tmSchedule.tm_sec) == 6) {
+                tmSchedule.tm_year -= 1900;
+                tmSchedule.tm_mon -= 1;
+                time_t scheduledTime = mktime(&tmSchedule);
+                time_t now;
+                while ((now = time(NULL)) < scheduledTime) {
+                    int remaining = (int)(scheduledTime - now);
+                    int days = remaining / (24 * 3600);
+                    int hours = (remaining % (24 * 3600)) / 3600;
+                    int minutes = (remaining % 3600) / 60;
+                    int seconds = remaining % 60;
+                    printf("\r残り時間: %d日 %d時間 %d分 %d秒  ", days, hours, minutes, seconds);
+                    fflush(stdout);
+                    sleep_ms(1000);
+                }
+                printf("\n指定時刻になりました。\n");
+            }
+        }
+        fclose(fp);
+    }
+}
+
+// ----- 設定読み込み -----
+// settings.txt の各行は "キー = 値" の形式で記述（# 以降はコメント）。
+// ファイルが無い場合や記述の無い項目は既定値を使用する。
+void load_settings() {
+    FILE *fp = fopen(SETTINGS_FILE, "r");
+    if (!fp)
+        return;
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#\n")] = '\0';
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        char *key = line;
+        char *value = eq + 1;
+        trim(key);
+        trim(value);
+        if (strcmp(key, "worker_threads") == 0) {
+            g_settings.worker_threads = atoi(value);
+        } else if (strcmp(key, "content_index") == 0) {
+            g_settings.content_index = atoi(value);
+        } else if (strcmp(key, "log_flush_interval_ms") == 0) {
+            g_settings.log_flush_interval_ms = atoi(value);
+        } else if (strcmp(key, "log_flush_bytes") == 0) {
+            g_settings.log_flush_bytes = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "journal") == 0) {
+            g_settings.journal = atoi(value);
+        } else if (strcmp(key, "large_file_threshold") == 0) {
+            g_settings.large_file_threshold = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "range_size") == 0) {
+            g_settings.range_size = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "direct_io") == 0) {
+            g_settings.direct_io = atoi(value);
+        } else if (strcmp(key, "watch") == 0) {
+            g_settings.watch = atoi(value);
+        } else if (strcmp(key, "watch_settle_ms") == 0) {
+            g_settings.watch_settle_ms = atoi(value);
+        } else if (strcmp(key, "watch_rescan_sec") == 0) {
+            g_settings.watch_rescan_sec = atoi(value);
+        } else if (strcmp(key, "hdd_streams") == 0) {
+            g_settings.hdd_streams = atoi(value);
+        } else if (strcmp(key, "verify") == 0) {
+            g_settings.verify = atoi(value);
+        } else if (strcmp(key, "delete_threads") == 0) {
+            g_settings.delete_threads = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(key, "dedup") == 0) {
+            // "off" / "reflink" / "hardlink"（0 / 1 / 2 も可）
+            if (strcmp(value, "reflink") == 0 || strcmp(value, "1") == 0)
+                g_settings.dedup = DEDUP_REFLINK;
+            else if (strcmp(value, "hardlink") == 0 || strcmp(value, "2") == 0)
+                g_settings.dedup = DEDUP_HARDLINK;
+            else if (strcmp(value, "off") == 0 || strcmp(value, "0") == 0)
+                g_settings.dedup = DEDUP_OFF;
+            else
+                printf("警告: 不明な dedup の値 \"%s\" は無視します。\n", value);
+        } else if (strcmp(key, "uring_depth") == 0) {
+            g_settings.uring_depth = atoi(value) > 0 ? atoi(value) : 0;
+        } else if (strcmp(key, "device_limit") == 0) {
+            // "パス, 同時実行数, 帯域（MB/s）"（帯域は省略可）
+            if (g_settings.device_limit_count >= MAX_DEVICE_LIMITS) {
+                printf("警告: device_limit は %d 件までです。\"%s\" は無視します。\n", MAX_DEVICE_LIMITS, value);
+                continue;
+            }
+            DeviceLimit *limit = &g_settings.device_limits[g_settings.device_limit_count];
+            char *token = strtok(value, ",");
+            if (!token)
+                continue;
+            snprintf(limit->path, sizeof(limit->path), "%s", token);
+            trim(limit->path);
+            token = strtok(NULL, ",");
+            limit->streams = token ? atoi(token) : 0;
+            token = strtok(NULL, ",");
+            limit->bytes_per_sec = token ? (unsigned long long)(atof(token) * 1024 * 1024) : 0;
+            g_settings.device_limit_count++;
+        } else if (strcmp(key, "telemetry_file") == 0) {
+            snprintf(g_settings.telemetry_file, sizeof(g_settings.telemetry_file), "%s", value);
+        } else if (strcmp(key, "throughput_profile") == 0) {
+            snprintf(g_settings.throughput_profile, sizeof(g_settings.throughput_profile), "%s", value);
+        } else {
+            printf("警告: settings.txt の不明な設定項目 \"%s\" は無視します。\n", key);
+        }
+    }
+    fclose(fp);
+}
+
+// ----- 監視モード -----
+// settings.txt で watch = 1 のとき、schedule.txt の時刻以降は常駐して各コピー元フォルダを監視し、
+// 届いたファイルを少数ずつまとめて通常のタスクと同じ処理（同一判定・名前置換・ソース削除）で移す。
+// Linux では inotify で変更を受け取り、最後の変更から watch_settle_ms が経過し、
+// 更新日時も同じだけ古くなったファイルを書き込み完了とみなす。
+// 取りこぼし（イベントキューのあふれ等）に備えて watch_rescan_sec ごとにコピー元全体を再走査する。
+// Linux 以外では、この再走査だけで新しいファイルを検出する。
+// ソースを削除しない場合は処理したファイルのサイズと更新日時を覚えておき、再走査では変わっていない
+// ファイルを待ち一覧に入れない（毎回同一判定をやり直してログに残さないため）。
+// ソースを削除する場合、処理したファイルのフォルダも書き込み完了と同じ条件（最後の変更から
+// watch_settle_ms が経過）を満たしてから、空であれば削除する（コピー元フォルダ自体は残す）。
+#define WATCH_BATCH_FILES 256   // 1回のタスクで処理するファイル数の上限
+#define WATCH_TICK_MS 250       // 書き込み完了を確認する間隔
+
+// 監視対象（history.txt の1行）
+typedef struct _WatchRoot {
+    const char *src;
+    const char *dest;
+    const RenameRules *rules;
+    CompareMode compare_mode;
+    CopyOrder copy_order;
+} WatchRoot;
+
+// 書き込み完了を待っているファイル（処理済みの記録にも使う）
+typedef struct _PendingFile {
+    struct _PendingFile *next;
+    int root;                   // 監視対象の番号
+    double last_event;          // 最後に変更を受け取った時刻（処理済みの記録では、再走査で最後に見つけた時刻）
+    unsigned long long size;    // 書き込み完了と判定した時点のサイズ
+    long long mtime;
+    char rel[];                 // コピー元フォルダからの相対パス
+} PendingFile;
+
+// 監視対象の番号と相対パスで引くファイルの表
+typedef struct _FileTable {
+    PendingFile **buckets;
+    size_t bucket_count;
+    size_t count;
+} FileTable;
+
+#ifdef __linux__
+// inotify の監視番号ごとのフォルダ
+typedef struct _WatchDir {
+    int root;                   // 監視対象の番号（未使用なら-1）
+    char *rel;
+} WatchDir;
+#endif
+
+typedef struct _Watcher {
+    WatchRoot *roots;
+    int root_count;
+    FileTable pending;          // 書き込み完了を待っているファイル
+    FileTable processed;        // 処理済みのファイル（ソースを削除しない場合のみ）
+    FileTable folders;          // 空になったら削除するフォルダ（ソースを削除する場合のみ）
+    double scan_time;           // 最後の再走査を始めた時刻
+    int rescan_needed;
+#ifdef __linux__
+    int fd;                     // inotify（使えなければ-1）
+    WatchDir *dirs;             // 監視番号で引く
+    size_t dir_capacity;
+#endif
+} Watcher;
+
+static volatile sig_atomic_t g_watchStop = 0;
+
+static void watch_signal(int sig) {
+    (void)sig;
+    g_watchStop = 1;
+}
+
+static size_t file_table_bucket(const FileTable *t, int root, const char *rel) {
+    return (size_t)((string_hash(rel) ^ ((unsigned long long)root * 0x9E3779B97F4A7C15ULL)) % t->bucket_count);
+}
+
+static void file_table_grow(FileTable *t) {
+    size_t old_count = t->bucket_count;
+    PendingFile **old = t->buckets;
+    t->bucket_count = old_count ? old_count * 2 : 1024;
+    t->buckets = (PendingFile**)calloc(t->bucket_count, sizeof(PendingFile*));
+    if (!t->buckets) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_count; i++) {
+        PendingFile *p = old[i];
+        while (p) {
+            PendingFile *next = p->next;
+            size_t b = file_table_bucket(t, p->root, p->rel);
+            p->next = t->buckets[b];
+            t->buckets[b] = p;
+            p = next;
+        }
+    }
+    free(old);
+}
+
+// root と rel のエントリを返す（無ければ作成する）
+static PendingFile *file_table_get(FileTable *t, int root, const char *rel) {
+    if (t->count >= t->bucket_count)
+        file_table_grow(t);
+    size_t b = file_table_bucket(t, root, rel);
+    for (PendingFile *p = t->buckets[b]; p; p = p->next)
+        if (p->root == root && strcmp(p->rel, rel) == 0)
+            return p;
+    size_t len = strlen(rel) + 1;
+    PendingFile *p = (PendingFile*)malloc(sizeof(PendingFile) + len);
+    if (!p) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    p->root = root;
+    p->last_event = 0;
+    p->size = 0;
+    p->mtime = 0;
+    memcpy(p->rel, rel, len);
+    p->next = t->buckets[b];
+    t->buckets[b] = p;
+    t->count++;
+    return p;
+}
+
+static PendingFile *file_table_find(const FileTable *t, int root, const char *rel) {
+    if (t->bucket_count == 0)
+        return NULL;
+    for (PendingFile *p = t->buckets[file_table_bucket(t, root, rel)]; p; p = p->next)
+        if (p->root == root && strcmp(p->rel, rel) == 0)
+            return p;
+    return NULL;
+}
+
+static void file_table_free(FileTable *t) {
+    for (size_t b = 0; b < t->bucket_count; b++) {
+        PendingFile *p = t->buckets[b];
+        while (p) {
+            PendingFile *next = p->next;
+            free(p);
+            p = next;
+        }
+    }
+    free(t->buckets);
+    memset(t, 0, sizeof(*t));
+}
+
+// ファイルの変更を記録する（未登録なら追加、登録済みなら最後の変更時刻を更新）
+static void pending_touch(Watcher *w, int root, const char *rel, double when) {
+    PendingFile *p = file_table_get(&w->pending, root, rel);
+    if (when > p->last_event)
+        p->last_event = when;
+}
+
+// 処理済みで、サイズと更新日時が処理した時点から変わっていなければ1
+static int watch_unchanged(Watcher *w, int root, const char *rel, const DirEntry *entry) {
+    PendingFile *p = file_table_find(&w->processed, root, rel);
+    if (!p || p->size != entry->size || p->mtime != (long long)entry->mtime)
+        return 0;
+    p->last_event = w->scan_time;
+    return 1;
+}
+
+// 再走査で見つからなかった（削除・移動された）ファイルの処理済みの記録を捨てる
+static void watch_prune_processed(Watcher *w) {
+    FileTable *t = &w->processed;
+    for (size_t b = 0; b < t->bucket_count; b++) {
+        PendingFile **link = &t->buckets[b];
+        while (*link) {
+            PendingFile *p = *link;
+            if (p->last_event >= w->scan_time) {
+                link = &p->next;
+                continue;
+            }
+            *link = p->next;
+            t->count--;
+            free(p);
+        }
+    }
+}
+
+// コピー元フォルダ直下の管理用ファイルは監視しない
+static int watch_ignored(const char *rel) {
+    return strchr(rel, PATH_SEP) == NULL && is_control_file(rel);
+}
+
+static void watch_join(char *buf, size_t bufsize, const char *rel, const char *name) {
+    if (rel[0] == '\0')
+        snprintf(buf, bufsize, "%s", name);
+    else
+        snprintf(buf, bufsize, "%s%c%s", rel, PATH_SEP, name);
+}
+
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static void watch_dir_set(Watcher *w, int wd, int root, const char *rel) {
+    if ((size_t)wd >= w->dir_capacity) {
+        size_t capacity = w->dir_capacity ? w->dir_capacity : 256;
+        while (capacity <= (size_t)wd)
+            capacity *= 2;
+        WatchDir *dirs = (WatchDir*)realloc(w->dirs, capacity * sizeof(WatchDir));
+        if (!dirs) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        for (size_t i = w->dir_capacity; i < capacity; i++) {
+            dirs[i].root = -1;
+            dirs[i].rel = NULL;
+        }
+        w->dirs = dirs;
+        w->dir_capacity = capacity;
+    }
+    free(w->dirs[wd].rel);
+    w->dirs[wd].root = root;
+    w->dirs[wd].rel = strdup(rel);
+}
+
+static void watch_dir_clear(Watcher *w, int wd) {
+    if (wd < 0 || (size_t)wd >= w->dir_capacity)
+        return;
+    free(w->dirs[wd].rel);
+    w->dirs[wd].rel = NULL;
+    w->dirs[wd].root = -1;
+}
+#endif
+
+// rel 以下のフォルダを監視に加え、見つかったファイルを when の時刻で待ち一覧に登録する。
+// 再走査でも使う（監視済みのフォルダは監視番号が変わらない）。
+static void watch_add_tree(Watcher *w, int root, const char *rel, double when) {
+    char path[MAX_PATH], child[MAX_PATH];
+    DirIter it;
+    DirEntry entry;
+    if (rel[0] == '\0')
+        snprintf(path, sizeof(path), "%s", w->roots[root].src);
+    else
+        snprintf(path, sizeof(path), "%s%c%s", w->roots[root].src, PATH_SEP, rel);
+#ifdef __linux__
+    if (w->fd >= 0) {
+        int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+        if (wd >= 0)
+            watch_dir_set(w, wd, root, rel);
+    }
+#endif
+    if (!dir_open(&it, path))
+        return;
+    while (dir_next(&it, &entry)) {
+        watch_join(child, sizeof(child), rel, entry.name);
+        if (entry.is_dir)
+            watch_add_tree(w, root, child, when);
+        else if (!watch_ignored(child) && !watch_unchanged(w, root, child, &entry))
+            pending_touch(w, root, child, when);
+    }
+    dir_close(&it);
+}
+
+// 変更の通知を最大 timeout_ms 待って待ち一覧に反映する
+static void watch_wait_events(Watcher *w, int timeout_ms) {
+#ifdef __linux__
+    if (w->fd >= 0) {
+        struct pollfd pfd = { w->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return;
+        char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+        char rel[MAX_PATH];
+        ssize_t len;
+        while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+            double now = monotonic_seconds();
+            for (char *p = buf; p < buf + len; ) {
+                const struct inotify_event *ev = (const struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    w->rescan_needed = 1;   // 取りこぼしがあったので全体を再走査する
+                    continue;
+                }
+                if (ev->wd < 0 || (size_t)ev->wd >= w->dir_capacity || w->dirs[ev->wd].root < 0)
+                    continue;
+                const WatchDir *dir = &w->dirs[ev->wd];
+                PendingFile *folder = file_table_find(&w->folders, dir->root, dir->rel);
+                if (folder)
+                    folder->last_event = now;   // 削除の候補のフォルダに変更があった
+                if (ev->mask & IN_IGNORED) {
+                    watch_dir_clear(w, ev->wd);
+                    continue;
+                }
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    // フォルダが移動・削除された：移動先がコピー元の中なら IN_MOVED_TO で監視し直す
+                    if (dir->rel[0] != '\0')
+                        inotify_rm_watch(w->fd, ev->wd);
+                    continue;
+                }
+                if (ev->len == 0)
+                    continue;
+                watch_join(rel, sizeof(rel), dir->rel, ev->name);
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        watch_add_tree(w, dir->root, rel, now);
+                } else if (!watch_ignored(rel)) {
+                    pending_touch(w, dir->root, rel, now);
+                }
+            }
+        }
+        return;
+    }
+#endif
+    (void)w;
+    sleep_ms((unsigned int)timeout_ms);
+}
+
+// 待ち一覧のファイルを1つのタスクとしてコピー（移動）する。
+// ソースを削除しない場合は、失敗しなかったファイルを処理済みとして記録する。
+// ソースを削除する場合は、処理したファイルのフォルダを削除の候補にする。
+static void watch_run_batch(Watcher *w, WorkerPool *pool, int root, PendingFile **files, size_t count) {
+    const WatchRoot *r = &w->roots[root];
+    CopyTask task;
+    memset(&task, 0, sizeof(task));
+    double scan_start = monotonic_seconds();
+    // 前回の処理の後にフォルダが削除・作り直されている可能性があるため、キャッシュを捨てる
+    dir_forget_all();
+    dir_cache_invalidate();
+    manifest_init(&task.manifest);
+    for (size_t i = 0; i < count; i++)
+        manifest_add_path(&task.manifest, files[i]->rel, files[i]->size, files[i]->mtime);
+    create_directory_recursive(r->dest);
+    char size_buf[64], free_buf[64];
+    unsigned long long free_space = get_free_space(r->dest);
+    if (task.manifest.total_size > free_space) {
+        printf("\nエラー: %s の空き容量が不足しています（必要 %s, 空き %s）。次回の再走査で再試行します。\n", r->dest,
+               format_size(task.manifest.total_size, size_buf, sizeof(size_buf)),
+               format_size(free_space, free_buf, sizeof(free_buf)));
+        log_message("[監視] %s -> %s: 空き容量不足のため %zu 件を保留\n", r->src, r->dest, count);
+        manifest_free(&task.manifest);
+        return;
+    }
+    task.src = r->src;
+    task.dest = r->dest;
+    task.rules = r->rules;
+    task.compare_mode = r->compare_mode;
+    task.copy_order = r->copy_order;
+    task.folder_size = task.manifest.total_size;
+    task.task_id = root + 1;
+    task.partial = 1;
+    task.file_failed = (unsigned char*)calloc(task.manifest.file_count, 1);
+    if (!task.file_failed) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    telemetry_init(&task, pool_telemetry_slots(pool));
+    task_assign_devices(&task);
+    stage_record(&task.telemetry[0], STAGE_ENUMERATE, scan_start);
+    log_message("[監視] %s: %zu 件 (%s) を処理\n", r->src, count,
+                format_size(task.manifest.total_size, size_buf, sizeof(size_buf)));
+    pool_submit(pool, job_create(JOB_START_TASK, &task, 0, 0), -1);
+    pool_wait(pool);
+    const Manifest *m = &task.manifest;
+    for (size_t i = 1; i < m->dir_count && g_deleteSource; i++)
+        file_table_get(&w->folders, root, m->dirs[i].rel)->last_event = monotonic_seconds();
+    for (size_t i = 0; i < m->file_count && !g_deleteSource; i++) {
+        const ManifestEntry *e = &m->files[i];
+        char rel[MAX_PATH];
+        if (task.file_failed[i])
+            continue;   // 次回の再走査でやり直す
+        watch_join(rel, sizeof(rel), m->dirs[e->dir].rel, e->name);
+        PendingFile *p = file_table_get(&w->processed, root, rel);
+        p->size = e->size;
+        p->mtime = e->mtime;
+        p->last_event = monotonic_seconds();
+    }
+    manifest_free(&task.manifest);
+    free(task.file_failed);
+    free(task.dir_pending);
+    free(task.dir_moved);
+    free(task.telemetry);
+}
+
+// 書き込みが完了したファイルを監視対象ごとにまとめて処理する
+static void watch_process_ready(Watcher *w, WorkerPool *pool) {
+    double settle = g_settings.watch_settle_ms / 1000.0;
+    long long settle_sec = (g_settings.watch_settle_ms + 999) / 1000;
+    PendingFile *batch[WATCH_BATCH_FILES];
+    char path[MAX_PATH];
+    for (int root = 0; root < w->root_count && !g_watchStop; root++) {
+        size_t count = 0;
+        double now = monotonic_seconds();
+        long long wall = (long long)time(NULL);
+        for (size_t b = 0; b < w->pending.bucket_count && count < WATCH_BATCH_FILES; b++) {
+            PendingFile **link = &w->pending.buckets[b];
+            while (*link && count < WATCH_BATCH_FILES) {
+                PendingFile *p = *link;
+                if (p->root != root || now - p->last_event < settle) {
+                    link = &p->next;
+                    continue;
+                }
+                FileInfo info;
+                snprintf(path, sizeof(path), "%s%c%s", w->roots[root].src, PATH_SEP, p->rel);
+                int exists = get_file_info(path, &info);
+                if (exists && info.mtime > wall - settle_sec && info.mtime <= wall) {
+                    // 通知は途切れたが更新日時が新しい：まだ書き込み中の可能性があるので待つ
+                    p->last_event = now;
+                    link = &p->next;
+                    continue;
+                }
+                *link = p->next;
+                w->pending.count--;
+                if (!exists) {
+                    free(p);    // 処理前に削除・移動された
+                    continue;
+                }
+                p->size = info.size;
+                p->mtime = info.mtime;
+                batch[count++] = p;
+            }
+        }
+        if (count == 0)
+            continue;
+        watch_run_batch(w, pool, root, batch, count);
+        for (size_t i = 0; i < count; i++)
+            free(batch[i]);
+        root--;     // 同じ監視対象に残りがあれば続けて処理する
+    }
+}
+
+// 最後の変更から watch_settle_ms が経過した削除の候補のフォルダを、空であれば削除する。
+// 削除できたら親フォルダを候補にする（空でないフォルダは、中のファイルを処理した時点で候補に戻る）。
+static void watch_remove_folders(Watcher *w) {
+    double settle = g_settings.watch_settle_ms / 1000.0;
+    long long settle_sec = (g_settings.watch_settle_ms + 999) / 1000;
+    double now = monotonic_seconds();
+    long long wall = (long long)time(NULL);
+    char path[MAX_PATH];
+    PendingFile *parents = NULL;    // 削除できたフォルダの親（走査中は表を組み替えないよう後で登録する）
+    FileTable *t = &w->folders;
+    if (t->count == 0)
+        return;
+    dir_cache_invalidate();
+    for (size_t b = 0; b < t->bucket_count && !g_watchStop; b++) {
+        PendingFile **link = &t->buckets[b];
+        while (*link) {
+            PendingFile *p = *link;
+            if (now - p->last_event < settle) {
+                link = &p->next;
+                continue;
+            }
+            FileInfo info;
+            int n = snprintf(path, sizeof(path), "%s%c%s", w->roots[p->root].src, PATH_SEP, p->rel);
+            int fits = n >= 0 && (size_t)n < sizeof(path);
+            if (fits && get_file_info(path, &info) && info.mtime > wall - settle_sec && info.mtime <= wall) {
+                // 通知は途切れたが更新日時が新しい：まだ書き込み中の可能性があるので待つ
+                p->last_event = now;
+                link = &p->next;
+                continue;
+            }
+            *link = p->next;
+            t->count--;
+            if (fits && remove_directory(path)) {
+                console_printf("\n[フォルダ削除] %s を削除しました。\n", path);
+                log_message("[監視] %s: 空になったフォルダを削除\n", path);
+                char *sep = strrchr(p->rel, PATH_SEP);
+                if (sep) {
+                    *sep = '\0';
+                    p->next = parents;
+                    parents = p;
+                    continue;
+                }
+            }
+            free(p);
+        }
+    }
+    while (parents) {
+        PendingFile *p = parents;
+        parents = p->next;
+        file_table_get(t, p->root, p->rel)->last_event = now;
+        free(p);
+    }
+}
+
+// 監視モードを実行する（Ctrl+C で終了するまで戻らない）
+void run_watch(WorkerPool *pool, WatchRoot *roots, int root_count) {
+    Watcher w;
+    memset(&w, 0, sizeof(w));
+    w.roots = roots;
+    w.root_count = root_count;
+#ifdef __linux__
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0)
+        printf("警告: inotify を使用できません。%d 秒ごとの再走査で検出します。\n", g_settings.watch_rescan_sec);
+#endif
+    signal(SIGINT, watch_signal);
+    signal(SIGTERM, watch_signal);
+    printf("\n監視を開始します（Ctrl+C で終了）。\n");
+    log_message("[監視] 開始: %d 件のコピー元を監視\n", root_count);
+    double next_rescan = 0;
+    while (!g_watchStop) {
+        double now = monotonic_seconds();
+        if (w.rescan_needed || now >= next_rescan) {
+            // 起動時と定期的な再走査：既存のファイルは書き込み完了の確認だけで処理対象になる
+            w.scan_time = now;
+            for (int i = 0; i < root_count; i++)
+                watch_add_tree(&w, i, "", 0);
+            watch_prune_processed(&w);
+            w.rescan_needed = 0;
+            next_rescan = now + (g_settings.watch_rescan_sec > 0 ? g_settings.watch_rescan_sec : 60);
+        }
+        watch_process_ready(&w, pool);
+        watch_remove_folders(&w);
+        if (!g_watchStop)
+            watch_wait_events(&w, WATCH_TICK_MS);
+    }
+    printf("\n監視を終了します。\n");
+    log_message("[監視] 終了: 未処理 %zu 件\n", w.pending.count);
+    file_table_free(&w.pending);
+    file_table_free(&w.processed);
+    file_table_free(&w.folders);
+#ifdef __linux__
+    if (w.fd >= 0)
+        close(w.fd);
+    for (size_t i = 0; i < w.dir_capacity; i++)
+        free(w.dirs[i].rel);
+    free(w.dirs);
+#endif
+}
+
+// ----- ベンチマーク -----
+// AutoFileMoveMaster --bench <作業フォルダ> [オプション] で実行する。
+// 作業フォルダに合成したコピー元ツリー（src）を作り、実際のコピー処理
+// （copy_folder_recursive / copy_or_delete_file）で dst へのコピーを繰り返し計測する。
+// コピー元は削除しない。各回の前に dst を削除し、指定した割合のファイルを
+// 同一・異なる内容で dst に事前配置する。tmpfs とディスク上のフォルダを
+// 比較する場合は、作業フォルダを変えて実行する。
+// 結果は "キー=値" 形式の固定順の行で出力し、バージョン間で diff できるようにする。
+// 計測中の各ファイルの表示は抑止し、log.txt は作業フォルダに出力する。
+typedef enum _BenchShape {
+    BENCH_TINY,     // 大量の小さなファイル（1フォルダ 1000 件ずつ）
+    BENCH_LARGE,    // 少数の巨大なファイル
+    BENCH_DEEP,     // 深く細いフォルダ階層
+    BENCH_WIDE,     // 1フォルダに大量のファイル
+    BENCH_SHAPES
+} BenchShape;
+
+const char *const g_benchShapeNames[BENCH_SHAPES] = { "tiny", "large", "deep", "wide" };
+
+#define BENCH_FILES_PER_DIR 1000
+
+typedef struct _BenchConfig {
+    BenchShape shape;
+    unsigned long long files;       // ファイル数
+    unsigned long long file_size;   // 1ファイルのサイズ
+    int depth;                      // deep のフォルダ階層数
+    int existing_pct;               // dst に事前配置するファイルの割合
+    int different_pct;              // 事前配置のうち内容を変えるファイルの割合
+    int warmup;                     // 計測しない予行回数
+    int repeat;                     // 計測回数
+    int workers;                    // ワーカー数（0 なら設定値）
+    unsigned long long seed;
+    CompareMode compare_mode;
+    CopyOrder copy_order;
+} BenchConfig;
+
+// 既定値（--files / --size / --depth で上書きできる）
+static void bench_defaults(BenchConfig *cfg, BenchShape shape) {
+    static const unsigned long long files[BENCH_SHAPES] = { 1000000, 4, 10000, 100000 };
+    static const unsigned long long sizes[BENCH_SHAPES] = { 1024, 2ULL << 30, 4096, 4096 };
+    cfg->shape = shape;
+    cfg->files = files[shape];
+    cfg->file_size = sizes[shape];
+    cfg->depth = shape == BENCH_DEEP ? 200 : 1;
+}
+
+// 再現可能な擬似乱数（xorshift64*）
+static unsigned long long bench_random(unsigned long long *state) {
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// i 番目のファイルのパス（同じ設定なら常に同じパスになる）
+static void bench_file_path(const BenchConfig *cfg, const char *root, unsigned long long i, char *buf, size_t bufsize) {
+    size_t len = (size_t)snprintf(buf, bufsize, "%s", root);
+    if (cfg->shape == BENCH_TINY) {
+        len += (size_t)snprintf(buf + len, bufsize - len, "%cd%05llu", PATH_SEP, i / BENCH_FILES_PER_DIR);
+    } else if (cfg->shape == BENCH_DEEP) {
+        // 階層 (i % depth) + 1 の位置に置く
+        for (unsigned long long level = 0; level <= i % (unsigned long long)cfg->depth && len < bufsize; level++)
+            len += (size_t)snprintf(buf + len, bufsize - len, "%cd", PATH_SEP);
+    }
+    if (len < bufsize)
+        snprintf(buf + len, bufsize - len, "%cf%08llu.bin", PATH_SEP, i);
+}
+
+// 親フォルダを作成する
+static void bench_make_parent(const char *path) {
+    char parent[MAX_PATH];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *sep = strrchr(parent, PATH_SEP);
+    if (sep && sep != parent) {
+        *sep = '\0';
+        create_directory_recursive(parent);
+    }
+}
+
+// 擬似乱数の内容で size バイトのファイルを書き込む（成功で非0）
+static int bench_write_file(const char *path, unsigned long long size, unsigned long long seed, char *buf) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return 0;
+    unsigned long long state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    int ok = 1;
+    while (size > 0 && ok) {
+        size_t chunk = size < COPY_BUFFER_SIZE ? (size_t)size : COPY_BUFFER_SIZE;
+        for (size_t k = 0; k < chunk; k += 8) {
+            unsigned long long r = bench_random(&state);
+            memcpy(buf + k, &r, chunk - k < 8 ? chunk - k : 8);
+        }
+        ok = fwrite(buf, 1, chunk, fp) == chunk;
+        size -= chunk;
+    }
+    if (fclose(fp) != 0)
+        ok = 0;
+    return ok;
+}
+
+// フォルダを配下ごと削除する（存在しなければ何もしない）
+static void bench_remove_tree(const char *path) {
+    DirIter it;
+    DirEntry entry;
+    if (!dir_open(&it, path))
+        return;
+    while (dir_next(&it, &entry)) {
+        char child[MAX_PATH];
+        snprintf(child, sizeof(child), "%s%c%s", path, PATH_SEP, entry.name);
+        if (entry.is_dir)
+            bench_remove_tree(child);
+        else
+            delete_file(child);
+    }
+    dir_close(&it);
+    remove_directory(path);
+}
+
+// 設定を1行の文字列にする（コピー元ツリーの再利用判定と結果の見出しに使う）
+static void bench_describe(const BenchConfig *cfg, char *buf, size_t bufsize) {
+    snprintf(buf, bufsize, "shape=%s files=%llu file_size=%llu depth=%d seed=%llu",
+             g_benchShapeNames[cfg->shape], cfg->files, cfg->file_size, cfg->depth, cfg->seed);
+}
+
+// コピー元ツリーを作成する。同じ設定で作成済みなら再利用する（成功で非0）
+static int bench_generate(const BenchConfig *cfg, char *buf) {
+    char desc[256], saved[256] = "";
+    bench_describe(cfg, desc, sizeof(desc));
+    FILE *fp = fopen("src.params", "r");
+    if (fp) {
+        if (fgets(saved, sizeof(saved), fp))
+            saved[strcspn(saved, "\n")] = '\0';
+        fclose(fp);
+        if (strcmp(saved, desc) == 0 && path_exists("src"))
+            return 1;
+    }
+    remove("src.params");
+    bench_remove_tree("src");
+    make_directory("src");
+    char path[MAX_PATH];
+    for (unsigned long long i = 0; i < cfg->files; i++) {
+        bench_file_path(cfg, "src", i, path, sizeof(path));
+        bench_make_parent(path);
+        if (!bench_write_file(path, cfg->file_size, cfg->seed + i, buf))
+            return 0;
+    }
+    fp = fopen("src.params", "w");
+    if (!fp)
+        return 0;
+    fprintf(fp, "%s\n", desc);
+    fclose(fp);
+    return 1;
+}
+
+// dst を空にし、指定した割合のファイルを事前配置する（成功で非0）
+static int bench_prepare_dest(const BenchConfig *cfg, char *buf) {
+    bench_remove_tree("dst");
+    dir_forget_all();   // 前回の計測で作成したフォルダを作成済みとして覚えているため
+    make_directory("dst");
+    char src[MAX_PATH], dest[MAX_PATH];
+    for (unsigned long long i = 0; i < cfg->files; i++) {
+        // 100 件ごとに同じ並びで、先頭 existing_pct 件を配置し、その先頭 different_pct% を別内容にする
+        int slot = (int)(i % 100);
+        if (slot >= cfg->existing_pct)
+            continue;
+        bench_file_path(cfg, "src", i, src, sizeof(src));
+        bench_file_path(cfg, "dst", i, dest, sizeof(dest));
+        bench_make_parent(dest);
+        int ok;
+        if (slot * 100 < cfg->existing_pct * cfg->different_pct)
+            ok = bench_write_file(dest, cfg->file_size, ~(cfg->seed + i), buf);
+        else
+            ok = copy_file(src, dest, NULL);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+// 計測1回分の結果
+typedef struct _BenchRun {
+    double elapsed;
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long outcomes[OUTCOME_COUNT];
+} BenchRun;
+
+// 実際のコピー処理で src -> dst を1回実行する（成功で非0）
+static int bench_run_once(const BenchConfig *cfg, WorkerPool *pool, BenchRun *run, Telemetry *total) {
+    CopyTask *task = (CopyTask*)calloc(1, sizeof(CopyTask));
+    if (!task)
+        return 0;
+    double scan_start = monotonic_seconds();
+    if (!manifest_build(&task->manifest, "src")) {
+        manifest_free(&task->manifest);
+        free(task);
+        return 0;
+    }
+    task->src = "src";
+    task->dest = "dst";
+    task->folder_size = task->manifest.total_size;
+    task->task_id = 1;
+    task->compare_mode = cfg->compare_mode;
+    task->copy_order = cfg->copy_order;
+    telemetry_init(task, pool_telemetry_slots(pool));
+    task_assign_devices(task);
+    stage_record(&task->telemetry[0], STAGE_ENUMERATE, scan_start);
+    double start = monotonic_seconds();
+    pool_submit(pool, job_create(JOB_START_TASK, task, 0, 0), -1);
+    pool_wait(pool);
+    run->elapsed = monotonic_seconds() - start;
+    run->bytes = task->manifest.total_size;
+    run->files = 0;
+    for (int o = 0; o < OUTCOME_COUNT; o++) {
+        run->outcomes[o] = task->telemetry[0].outcomes[o];
+        run->files += run->outcomes[o];
+    }
+    if (total)
+        telemetry_add(total, &task->telemetry[0]);
+    manifest_free(&task->manifest);
+    free(task->dir_pending);
+    free(task->dir_moved);
+    free(task->telemetry);
+    free(task);
+    return 1;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 値の最小・中央・最大を出力する
+static void bench_print_spread(FILE *out, const char *name, double *values, int count) {
+    qsort(values, (size_t)count, sizeof(double), compare_double);
+    double median = count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+    fprintf(out, "throughput %s min=%.2f median=%.2f max=%.2f\n", name, values[0], median, values[count - 1]);
+}
+
+// 作業フォルダのファイルシステムの種類
+static const char *bench_fs_name(char *buf, size_t bufsize) {
+#ifdef __linux__
+    struct statfs sfs;
+    if (statfs(".", &sfs) == 0) {
+        switch ((unsigned long)sfs.f_type) {
+        case 0x01021994UL: return "tmpfs";
+        case 0xEF53UL:     return "ext4";
+        case 0x58465342UL: return "xfs";
+        case 0x9123683EUL: return "btrfs";
+        default:
+            snprintf(buf, bufsize, "0x%lx", (unsigned long)sfs.f_type);
+            return buf;
+        }
+    }
+#endif
+    (void)buf;
+    (void)bufsize;
+    return "unknown";
+}
+
+static void bench_usage(void) {
+    printf("使い方: AutoFileMoveMaster --bench <作業フォルダ> [オプション]\n"
+           "  --shape tiny|large|deep|wide  ツリーの形（既定 tiny）\n"
+           "  --files N         ファイル数\n"
+           "  --size BYTES      1ファイルのサイズ\n"
+           "  --depth N         deep のフォルダ階層数\n"
+           "  --existing PCT    dst に事前配置するファイルの割合（既定 0）\n"
+           "  --different PCT   事前配置のうち内容を変える割合（既定 0）\n"
+           "  --compare full|sample|meta  同一判定の比較モード（既定 full）\n"
+           "  --order dir|inode|extent    ファイルをコピーする順序（既定 dir）\n"
+           "  --warmup N        計測しない予行回数（既定 1）\n"
+           "  --repeat N        計測回数（既定 5）\n"
+           "  --workers N       ワーカー数（既定は settings.txt の worker_threads）\n"
+           "  --uring N         小さなファイルの一括コピーの io_uring の深さ（0 で1件ずつ、既定は settings.txt の uring_depth）\n"
+           "  --seed N          内容生成の乱数の種（既定 1）\n");
+}
+
+// ベンチマークを実行する（終了コードを返す）
+int run_benchmark(int argc, char *argv[]) {
+    if (argc < 1) {
+        bench_usage();
+        return 1;
+    }
+    const char *workdir = argv[0];
+    BenchConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    bench_defaults(&cfg, BENCH_TINY);
+    cfg.warmup = 1;
+    cfg.repeat = 5;
+    cfg.seed = 1;
+    cfg.compare_mode = COMPARE_FULL;
+    // 形を先に決めてから個別の指定で上書きする
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--shape") != 0)
+            continue;
+        int s = 0;
+        while (s < BENCH_SHAPES && strcmp(argv[i + 1], g_benchShapeNames[s]) != 0)
+            s++;
+        if (s == BENCH_SHAPES) {
+            printf("エラー: 不明なツリーの形 \"%s\" です。\n", argv[i + 1]);
+            return 1;
+        }
+        bench_defaults(&cfg, (BenchShape)s);
+    }
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            bench_usage();
+            return 1;
+        }
+        const char *opt = argv[i], *value = argv[i + 1];
+        if (strcmp(opt, "--shape") == 0)
+            continue;
+        else if (strcmp(opt, "--files") == 0)
+            cfg.files = strtoull(value, NULL, 10);
+        else if (strcmp(opt, "--size") == 0)
+            cfg.file_size = strtoull(value, NULL, 10);
+        else if (strcmp(opt, "--depth") == 0)
+            cfg.depth = atoi(value);
+        else if (strcmp(opt, "--existing") == 0)
+            cfg.existing_pct = atoi(value);
+        else if (strcmp(opt, "--different") == 0)
+            cfg.different_pct = atoi(value);
+        else if (strcmp(opt, "--compare") == 0)
+            cfg.compare_mode = parse_compare_mode(value);
+        else if (strcmp(opt, "--order") == 0)
+            cfg.copy_order = parse_copy_order(value);
+        else if (strcmp(opt, "--warmup") == 0)
+            cfg.warmup = atoi(value);
+        else if (strcmp(opt, "--repeat") == 0)
+            cfg.repeat = atoi(value);
+        else if (strcmp(opt, "--workers") == 0)
+            cfg.workers = atoi(value);
+        else if (strcmp(opt, "--uring") == 0)
+            g_settings.uring_depth = atoi(value) > 0 ? atoi(value) : 0;
+        else if (strcmp(opt, "--seed") == 0)
+            cfg.seed = strtoull(value, NULL, 10);
+        else {
+            bench_usage();
+            return 1;
+        }
+    }
+    if (cfg.files == 0 || cfg.depth < 1 || cfg.repeat < 1 || cfg.warmup < 0 ||
+        cfg.existing_pct < 0 || cfg.existing_pct > 100 || cfg.different_pct < 0 || cfg.different_pct > 100) {
+        bench_usage();
+        return 1;
+    }
+
+    make_directory(workdir);
+    if (!change_directory(workdir)) {
+        printf("エラー: 作業フォルダ %s に移動できません。\n", workdir);
+        return 1;
+    }
+    logger_start();
+    char *buf = (char*)malloc(COPY_BUFFER_SIZE);
+    double *files_per_sec = (double*)malloc(cfg.repeat * sizeof(double));
+    double *bytes_per_sec = (double*)malloc(cfg.repeat * sizeof(double));
+    Telemetry *total = (Telemetry*)calloc(1, sizeof(Telemetry));
+    if (!buf || !files_per_sec || !bytes_per_sec || !total) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    // 結果は元の標準出力へ、フォルダ作成やコピー処理の各ファイルの表示は null デバイスへ出力する
+    fflush(stdout);
+    FILE *out = fdopen(dup(fileno(stdout)), "w");
+#ifdef _WIN32
+    int null_fd = open("NUL", O_WRONLY);
+#else
+    int null_fd = open("/dev/null", O_WRONLY);
+#endif
+    if (!out || null_fd < 0) {
+        printf("エラー: 出力の切り替えに失敗しました。\n");
+        return 1;
+    }
+    dup2(null_fd, fileno(stdout));
+    close(null_fd);
+
+    fprintf(out, "# コピー元ツリーを準備しています...\n");
+    fflush(out);
+    if (!bench_generate(&cfg, buf)) {
+        fprintf(out, "エラー: コピー元ツリーを作成できません。\n");
+        fclose(out);
+        return 1;
+    }
+
+    int worker_count = cfg.workers > 0 ? cfg.workers
+                     : g_settings.worker_threads > 0 ? g_settings.worker_threads : cpu_count();
+    if (!pool_start(&g_pool, worker_count)) {
+        fprintf(out, "エラー: ワーカースレッドを作成できませんでした。\n");
+        fclose(out);
+        return 1;
+    }
+
+    char desc[256], fs_buf[32];
+    bench_describe(&cfg, desc, sizeof(desc));
+    fprintf(out, "# AutoFileMoveMaster benchmark\n%s existing_pct=%d different_pct=%d compare=%s order=%s\n",
+            desc, cfg.existing_pct, cfg.different_pct,
+            cfg.compare_mode == COMPARE_META ? "meta" : cfg.compare_mode == COMPARE_SAMPLE ? "sample" : "full",
+            cfg.copy_order == ORDER_EXTENT ? "extent" : cfg.copy_order == ORDER_INODE ? "inode" : "dir");
+    fprintf(out, "fs=%s workers=%d uring_depth=%d warmup=%d repeat=%d\n", bench_fs_name(fs_buf, sizeof(fs_buf)),
+            g_pool.worker_count, g_settings.uring_depth, cfg.warmup, cfg.repeat);
+    fflush(out);
+
+    int status = 0;
+    for (int r = 0; r < cfg.warmup + cfg.repeat; r++) {
+        BenchRun run;
+        int measured = r >= cfg.warmup;
+        if (!bench_prepare_dest(&cfg, buf) || !bench_run_once(&cfg, &g_pool, &run, measured ? total : NULL)) {
+            fprintf(out, "error run=%d\n", r + 1);
+            status = 1;
+            break;
+        }
+        double fps = run.elapsed > 0 ? run.files / run.elapsed : 0.0;
+        double bps = run.elapsed > 0 ? run.bytes / run.elapsed : 0.0;
+        fprintf(out, "%s=%d elapsed_sec=%.6f files_per_sec=%.2f bytes_per_sec=%.2f",
+                measured ? "run" : "warmup", measured ? r - cfg.warmup + 1 : r + 1, run.elapsed, fps, bps);
+        for (int o = 0; o < OUTCOME_COUNT; o++)
+            fprintf(out, " %s=%llu", g_outcomeNames[o], run.outcomes[o]);
+        fprintf(out, "\n");
+        fflush(out);
+        if (measured) {
+            files_per_sec[r - cfg.warmup] = fps;
+            bytes_per_sec[r - cfg.warmup] = bps;
+        }
+    }
+    if (status == 0) {
+        bench_print_spread(out, "files_per_sec", files_per_sec, cfg.repeat);
+        bench_print_spread(out, "bytes_per_sec", bytes_per_sec, cfg.repeat);
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const StageStats *st = &total->stages[s];
+            if (st->count == 0)
+                continue;
+            fprintf(out, "latency stage=%s count=%llu mean_usec=%.1f p50_usec=%llu p90_usec=%llu p99_usec=%llu max_usec=%llu\n",
+                    g_stageNames[s], st->count, (double)st->total_usec / st->count, stage_percentile(st, 0.50),
+                    stage_percentile(st, 0.90), stage_percentile(st, 0.99), st->max_usec);
+        }
+    }
+    fclose(out);
+    pool_stop(&g_pool);
+    free(buf);
+    free(files_per_sec);
+    free(bytes_per_sec);
+    free(total);
+    return status;
+}
+
+// ----- 実行計画（ドライラン） -----
+// --plan は history.txt のすべてのタスクを列挙し、データを移さずにファイルを分類して、
+// 必要な容量と所要時間の見積もりとともに実行計画（PLAN_FILE）に書き出す。
+//   分類：新規 / 同一 / 異なる / 名前変更（コピー先インデックスに、同じサイズ・更新日時のファイルが
+//         別の名前で記録されている）。判定はメタデータだけで行い、中身は読まない。
+//   容量：ファイルごとにコピー先ボリュームの割り当て単位へ切り上げ、同じボリュームのタスクの分を
+//         合算して空き容量と比べる（収まらないタスクは計画から外す）。
+//   時間：以前の実行で記録した転送速度（throughput_profile）から、デバイスの組み合わせと
+//         ファイルサイズ区分ごとに見積もる。
+// --run-plan は計画に含まれるタスクを、記録した一覧のまま（再列挙せずに）一斉に実行する。
+// 通常の一斉実行でも、同じボリュームのタスクの必要容量を合算して空き容量を確認する。
+//
+// 実行計画の形式（1行1レコード、タブ区切り、名前とパスは行の最後の列）：
+//   "AFMPLAN 1"                                                  ヘッダ
+//   "created\t<作成日時（UNIX 時刻）>"
+//   "delete\t<コピー元を削除するなら1>"
+//   "task\t<必要容量>\t<推定秒>\t<コピー元>"                      タスクの開始
+//   "dest\t<コピー先>"
+//   "d\t<親フォルダ番号>\t<更新日時>\t<列挙失敗なら1>\t<名前>"    フォルダ（ルートを除き列挙順）
+//   "f\t<フォルダ番号>\t<サイズ>\t<更新日時>\t<inode>\t<分類>\t<名前>"  ファイル
+//   "END"                                                        正常終了の印（最終行）
+#define PLAN_FILE "plan.txt"
+#define PLAN_HEADER "AFMPLAN 1"
+#define PROFILE_HEADER "AFMPROFILE 1"
+#define PROFILE_DECAY 0.5                               // 記録を更新するとき、以前の値に掛ける重み
+#define PROFILE_DEFAULT_BYTES_PER_SEC (50.0 * 1024 * 1024) // 記録がない場合のコピーの転送速度
+#define PROFILE_DEFAULT_FILES_PER_SEC 200.0             // 記録がない場合のコピーの1秒あたりのファイル数
+#define PROFILE_DEFAULT_SAME_PER_SEC 2000.0             // 記録がない場合のコピーしないファイルの1秒あたりの数
+#define MAX_VOLUMES 64
+
+// ファイルの分類（実行計画）
+typedef enum _PlanClass {
+    PLAN_NEW,           // コピー先に無い
+    PLAN_IDENTICAL,     // コピー先に同じサイズ・更新日時のファイルがある（またはインデックスと一致）
+    PLAN_DIFFERENT,     // コピー先に異なるファイルがある（"_copy" 付きでコピーする）
+    PLAN_RENAMED,       // コピー先に無いが、同じサイズ・更新日時のファイルが別の名前でインデックスにある
+    PLAN_TOO_LONG,      // パスが長すぎるためコピーしない（実行時も失敗として扱い、ソースは残す）
+    PLAN_CLASSES
+} PlanClass;
+
+const char g_planClassCodes[PLAN_CLASSES] = { 'n', 'i', 'd', 'r', 'x' };
+const char *const g_planClassNames[PLAN_CLASSES] = { "新規", "同一", "異なる", "名前変更", "パス長超過" };
+
+// コピー先のボリューム（必要容量の予約）
+typedef struct _Volume {
+    unsigned long long id;          // ボリュームの識別子
+    char path[MAX_PATH];            // 最初に予約したタスクのコピー先（表示用）
+    unsigned long long free_space;
+    unsigned long long block_size;  // 割り当て単位
+    unsigned long long reserved;    // 予約済みの容量の合計
+    double seconds;                 // このボリュームに書き込むタスクの推定所要時間の合計
+} Volume;
+
+typedef struct _VolumeTable {
+    Volume items[MAX_VOLUMES];
+    int count;
+} VolumeTable;
+
+// 転送速度の記録（デバイスの組み合わせ・コピーの有無・サイズ区分ごと）
+typedef struct _ProfileEntry {
+    char src[64];                   // コピー元のデバイス名
+    char dest[64];                  // コピー先のデバイス名
+    int copied;                     // 1: コピーしたファイル（新規・異なる） / 0: コピーしなかったファイル
+    int size_class;
+    double files;
+    double bytes;
+    double seconds;                 // 実行時間のうち、このファイルに費やした分
+    int updated;                    // 今回の実行で値を加えたら1（以前の値の減衰は1回だけ行う）
+} ProfileEntry;
+
+typedef struct _Profile {
+    ProfileEntry *items;
+    size_t count;
+    size_t capacity;
+} Profile;
+
+// 実行計画の1タスク
+typedef struct _PlanTask {
+    const char *src;                // 計画のアリーナ内
+    const char *dest;
+    Manifest manifest;              // 計画作成時の列挙結果（実行で CopyTask に移す）
+    unsigned long long space;       // 必要容量
+    double seconds;                 // 推定所要時間
+    int used;                       // 実行で使用したら1
+} PlanTask;
+
+typedef struct _ExecutionPlan {
+    Arena arena;
+    PlanTask *tasks;
+    size_t count;
+    size_t capacity;
+    int delete_source;
+    long long created;
+} ExecutionPlan;
+
+// path 自身、またはまだ無ければ存在する最も近い親フォルダのパスを buf に返す
+static const char *existing_parent(const char *path, char *buf, size_t bufsize) {
+    snprintf(buf, bufsize, "%s", path);
+    while (!path_exists(buf)) {
+        char *sep = strrchr(buf, PATH_SEP);
+        if (!sep) {
+            snprintf(buf, bufsize, ".");
+            break;
+        }
+        if (sep == buf) {
+            sep[1] = '\0';
+            break;
+        }
+        *sep = '\0';
+    }
+    return buf;
+}
+
+// path が載っているボリュームの識別子（調べられなければ0）
+static unsigned long long volume_identify(const char *path) {
+#ifdef _WIN32
+    char volume[MAX_PATH];
+    DWORD serial = 0;
+    if (!GetVolumePathName(path, volume, MAX_PATH) ||
+        !GetVolumeInformation(volume, NULL, 0, &serial, NULL, NULL, NULL, 0))
+        return 0;
+    return (unsigned long long)serial + 1;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    return (unsigned long long)st.st_dev + 1;
+#endif
+}
+
+// path（まだ無くてもよい）が載っているボリュームを返す（初めてなら空き容量を調べて登録する。調べられなければ NULL）
+Volume *volume_for_path(VolumeTable *table, const char *path) {
+    char buf[MAX_PATH];
+    const char *existing = existing_parent(path, buf, sizeof(buf));
+    unsigned long long id = volume_identify(existing);
+    if (id == 0)
+        return NULL;
+    for (int i = 0; i < table->count; i++)
+        if (table->items[i].id == id)
+            return &table->items[i];
+    if (table->count >= MAX_VOLUMES)
+        return NULL;
+    Volume *v = &table->items[table->count++];
+    memset(v, 0, sizeof(*v));
+    v->id = id;
+    snprintf(v->path, sizeof(v->path), "%s", path);
+    v->free_space = get_free_space(existing);
+    v->block_size = get_block_size(existing);
+    return v;
+}
+
+// 同じボリュームの予約と合わせて bytes が空き容量に収まれば予約して非0を返す
+int volume_reserve(Volume *v, unsigned long long bytes) {
+    if (v->reserved + bytes > v->free_space)
+        return 0;
+    v->reserved += bytes;
+    return 1;
+}
+
+static unsigned long long round_up(unsigned long long size, unsigned long long unit) {
+    return (size + unit - 1) / unit * unit;
+}
+
+// マニフェストのコピーに必要なコピー先の容量（割り当て単位 block に切り上げる）。
+// classes が NULL ならすべてのファイルを、そうでなければコピーすると分類したファイルだけを数える。
+// アーカイブは tar の形式（メンバーごとのヘッダと512バイト単位の内容）で数える。
+unsigned long long manifest_required_space(const Manifest *m, const unsigned char *classes, int archive,
+                                           unsigned long long block) {
+    unsigned long long total = 0;
+    for (size_t i = 0; i < m->file_count; i++) {
+        if (classes && (classes[i] == PLAN_IDENTICAL || classes[i] == PLAN_TOO_LONG))
+            continue;
+        total += archive ? TAR_BLOCK + round_up(m->files[i].size, TAR_BLOCK) : round_up(m->files[i].size, block);
+    }
+    // フォルダは1件あたり割り当て単位1つ（アーカイブではヘッダ1つ）とみなす
+    if (archive)
+        return round_up(total + (m->dir_count - 1) * TAR_BLOCK + 2 * TAR_BLOCK, block);
+    return total + (m->dir_count - 1) * block;
+}
+
+// ----- 転送速度の記録 -----
+// 形式（1行1レコード、タブ区切り）：
+//   "AFMPROFILE 1"
+//   "<c: コピー / s: コピーせず>\t<サイズ区分>\t<ファイル数>\t<バイト数>\t<秒>\t<コピー元デバイス>\t<コピー先デバイス>"
+void profile_free(Profile *p) {
+    free(p->items);
+    memset(p, 0, sizeof(*p));
+}
+
+static ProfileEntry *profile_find(Profile *p, const char *src, const char *dest, int copied, int size_class) {
+    for (size_t i = 0; i < p->count; i++) {
+        ProfileEntry *e = &p->items[i];
+        if (e->copied == copied && e->size_class == size_class && strcmp(e->src, src) == 0 && strcmp(e->dest, dest) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void profile_add(Profile *p, const char *src, const char *dest, int copied, int size_class,
+                        double files, double bytes, double seconds) {
+    if (files <= 0)
+        return;
+    ProfileEntry *e = profile_find(p, src, dest, copied, size_class);
+    if (e && !e->updated) {
+        e->files *= PROFILE_DECAY;
+        e->bytes *= PROFILE_DECAY;
+        e->seconds *= PROFILE_DECAY;
+    } else if (!e) {
+        if (p->count == p->capacity)
+            p->items = (ProfileEntry*)grow_array(p->items, &p->capacity, sizeof(ProfileEntry));
+        e = &p->items[p->count++];
+        memset(e, 0, sizeof(*e));
+        snprintf(e->src, sizeof(e->src), "%s", src);
+        snprintf(e->dest, sizeof(e->dest), "%s", dest);
+        e->copied = copied;
+        e->size_class = size_class;
     }
-    snprintf(buf, bufsize, "%.2f %s", dsize, units[unit_index]);
-    return buf;
+    e->files += files;
+    e->bytes += bytes;
+    e->seconds += seconds;
+    e->updated = 1;
 }
 
-// ----- 再帰的ディレクトリ作成関数 -----
-// 指定されたパスのディレクトリが存在しなければ、親ディレクトリも含めて再帰的に作成する
-void create_directory_recursive(const char *path) {
-    if (GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES)
-        return; // すでに存在する
-    char parent[MAX_PATH];
-    strcpy(parent, path);
-    char *lastSlash = strrchr(parent, '\\');
-    if (lastSlash != NULL) {
-        *lastSlash = '\0';
-        create_directory_recursive(parent);
+// 記録を読み込む（ファイルが無い、または記録しない設定なら空のまま）
+void profile_load(Profile *p) {
+    memset(p, 0, sizeof(*p));
+    if (g_settings.throughput_profile[0] == '\0')
+        return;
+    FILE *fp = fopen(g_settings.throughput_profile, "r");
+    if (!fp)
+        return;
+    char line[256];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, PROFILE_HEADER, strlen(PROFILE_HEADER)) != 0) {
+        console_printf("警告: %s の形式が正しくないため使用しません。\n", g_settings.throughput_profile);
+        fclose(fp);
+        return;
     }
-    if (!CreateDirectory(path, NULL)) {
-        printf("エラー: コピー先フォルダ %s の作成に失敗しました。\n", path);
-        exit(1);
-    } else {
-        printf("コピー先フォルダ %s を作成しました。\n", path);
+    while (fgets(line, sizeof(line), fp)) {
+        char kind;
+        int size_class, consumed = 0;
+        double files, bytes, seconds;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%c\t%d\t%lf\t%lf\t%lf\t%n", &kind, &size_class, &files, &bytes, &seconds, &consumed) != 5 ||
+            consumed == 0 || (kind != 'c' && kind != 's') || size_class < 0 || size_class >= SIZE_CLASSES)
+            continue;
+        char *src = line + consumed;
+        char *dest = strchr(src, '\t');
+        if (!dest)
+            continue;
+        *dest++ = '\0';
+        ProfileEntry *e = profile_find(p, src, dest, kind == 'c', size_class);
+        if (e)
+            continue;   // 同じ組み合わせの2行目以降は無視する
+        profile_add(p, src, dest, kind == 'c', size_class, files, bytes, seconds);
     }
+    fclose(fp);
+    for (size_t i = 0; i < p->count; i++)
+        p->items[i].updated = 0;
 }
 
-// ----- ディスク・フォルダ関数 -----
-// 指定パスの空き容量（バイト単位）を取得（Windows API）
-unsigned long long get_free_space(const char *path) {
-    ULARGE_INTEGER freeBytesAvailable, totalBytes, totalFree;
-    if (GetDiskFreeSpaceEx(path, &freeBytesAvailable, &totalBytes, &totalFree))
-        return freeBytesAvailable.QuadPart;
-    return 0;
+// 記録を書き出す（一時ファイルに書いてから置き換える）
+void profile_save(const Profile *p) {
+    if (g_settings.throughput_profile[0] == '\0' || p->count == 0)
+        return;
+    char tmp_path[MAX_PATH + sizeof(".tmp")];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_settings.throughput_profile);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        console_printf("警告: 転送速度の記録 %s を作成できません。\n", g_settings.throughput_profile);
+        return;
+    }
+    fprintf(fp, "%s\n", PROFILE_HEADER);
+    for (size_t i = 0; i < p->count; i++) {
+        const ProfileEntry *e = &p->items[i];
+        fprintf(fp, "%c\t%d\t%.3f\t%.0f\t%.6f\t%s\t%s\n", e->copied ? 'c' : 's', e->size_class, e->files, e->bytes,
+                e->seconds, e->src, e->dest);
+    }
+    if (fclose(fp) != 0 || !replace_file(tmp_path, g_settings.throughput_profile)) {
+        delete_file(tmp_path);
+        console_printf("警告: 転送速度の記録 %s を更新できません。\n", g_settings.throughput_profile);
+    }
 }
-// 指定フォルダのサイズ（バイト単位）を再帰的に計算する
-unsigned long long get_folder_size(const char *path) {
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind;
-    char searchPath[MAX_PATH];
-    unsigned long long totalSize = 0;
-    
-    snprintf(searchPath, sizeof(searchPath), "%s\\*", path);
-    hFind = FindFirstFile(searchPath, &findFileData);
-    if (hFind == INVALID_HANDLE_VALUE)
-        return 0;
-    
-    do {
-        if (strcmp(findFileData.cFileName, ".") == 0 ||
-            strcmp(findFileData.cFileName, "..") == 0)
-            continue;
-        char fullPath[MAX_PATH];
-        snprintf(fullPath, sizeof(fullPath), "%s\\%s", path, findFileData.cFileName);
-        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-            totalSize += get_folder_size(fullPath);
-        else
-            totalSize += (((unsigned long long)findFileData.nFileSizeHigh << 32) | findFileData.nFileSizeLow);
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);
-    return totalSize;
+
+// デバイスの表示名（記録のキー）。コピー先がコピー元と同じデバイスなら NULL が渡される。
+static void profile_device_names(const Device *src, const Device *dest, const char **src_name, const char **dest_name) {
+    *src_name = src ? src->name : "-";
+    *dest_name = dest ? dest->name : *src_name;
 }
 
-// ----- ファイル比較・新規ファイル名生成 -----
-// 2つのファイルが同一かどうかを判定する（同一なら非0、異なれば0）
-int files_are_identical(const char *file1, const char *file2) {
-    FILE *fp1 = fopen(file1, "rb");
-    FILE *fp2 = fopen(file2, "rb");
-    if (!fp1 || !fp2) {
-        if (fp1) fclose(fp1);
-        if (fp2) fclose(fp2);
-        return 0;
+// 完了したタスクの計測値を記録に加える。タスクの実行時間を、ファイルごとの処理時間の比で
+// サイズ区分・コピーの有無に配分する（並行して処理した分は実行時間に含まれない）。
+void profile_record(Profile *p, const CopyTask *task) {
+    const Telemetry *t = &task->telemetry[0];
+    double usec = 0;
+    for (int c = 0; c < SIZE_CLASSES; c++)
+        usec += (double)t->size_classes[c].usec;
+    if (usec <= 0 || task->elapsed_seconds <= 0 || task->partial)
+        return;
+    double scale = task->elapsed_seconds / usec;
+    const char *src, *dest;
+    profile_device_names(task->src_device, task->dest_device, &src, &dest);
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        const SizeClassStats *all = &t->size_classes[c], *copied = &t->copied[c];
+        profile_add(p, src, dest, 1, c, (double)copied->files, (double)copied->bytes, copied->usec * scale);
+        profile_add(p, src, dest, 0, c, (double)(all->files - copied->files), (double)(all->bytes - copied->bytes),
+                    (all->usec - copied->usec) * scale);
     }
-    fseek(fp1, 0, SEEK_END);
-    fseek(fp2, 0, SEEK_END);
-    long size1 = ftell(fp1);
-    long size2 = ftell(fp2);
-    if (size1 != size2) {
-        fclose(fp1);
-        fclose(fp2);
+}
+
+// files 件・bytes バイトのサイズ区分 size_class のファイルの所要時間を見積もる。
+// 同じデバイスの組み合わせ → 同じコピー先デバイス → すべての記録の順に探し、記録がなければ
+// 既定の速度を使って *calibrated を0にする。
+static double profile_estimate(const Profile *p, const char *src, const char *dest, int copied, int size_class,
+                               unsigned long long files, unsigned long long bytes, int *calibrated) {
+    if (files == 0)
         return 0;
-    }
-    rewind(fp1);
-    rewind(fp2);
-    
-    char buffer1[BUFFER_SIZE], buffer2[BUFFER_SIZE];
-    size_t bytes1, bytes2;
-    int identical = 1;
-    do {
-        bytes1 = fread(buffer1, 1, BUFFER_SIZE, fp1);
-        bytes2 = fread(buffer2, 1, BUFFER_SIZE, fp2);
-        if (bytes1 != bytes2 || memcmp(buffer1, buffer2, bytes1) != 0) {
-            identical = 0;
-            break;
+    for (int level = 0; level < 3; level++) {
+        double f = 0, b = 0, s = 0;
+        for (size_t i = 0; i < p->count; i++) {
+            const ProfileEntry *e = &p->items[i];
+            if (e->copied != copied || e->size_class != size_class)
+                continue;
+            if ((level == 0 && (strcmp(e->src, src) != 0 || strcmp(e->dest, dest) != 0)) ||
+                (level == 1 && strcmp(e->dest, dest) != 0))
+                continue;
+            f += e->files;
+            b += e->bytes;
+            s += e->seconds;
         }
-    } while (bytes1 > 0);
-    
-    fclose(fp1);
-    fclose(fp2);
-    return identical;
-}
-// 新しいファイル名を生成する（例："file.txt" -> "file_copy.txt"）
-void generate_new_filename(const char *dest, char *new_dest, size_t new_dest_size) {
-    strncpy(new_dest, dest, new_dest_size);
-    new_dest[new_dest_size - 1] = '\0';
-    char *dot = strrchr(new_dest, '.');
-    if (dot) {
-        size_t pos = dot - new_dest;
-        char temp[MAX_PATH];
-        strncpy(temp, new_dest, pos);
-        temp[pos] = '\0';
-        strncat(temp, "_copy", sizeof(temp) - strlen(temp) - 1);
-        strncat(temp, dot, sizeof(temp) - strlen(temp) - 1);
-        strncpy(new_dest, temp, new_dest_size);
-    } else {
-        strncat(new_dest, "_copy", new_dest_size - strlen(new_dest) - 1);
+        if (f <= 0)
+            continue;
+        // 1MB 以上の区分は転送量に、それより小さい区分はファイル数に比例するとみなす
+        if (g_sizeClassLimits[size_class] > (1ULL << 20) && b > 0)
+            return bytes * (s / b);
+        return files * (s / f);
     }
+    *calibrated = 0;
+    if (!copied)
+        return files / PROFILE_DEFAULT_SAME_PER_SEC;
+    return files / PROFILE_DEFAULT_FILES_PER_SEC + bytes / PROFILE_DEFAULT_BYTES_PER_SEC;
 }
 
-// ----- 文字列置換 -----
-// 指定されたパス中に search が含まれていれば、replace に置換する
-int rename_file_by_replacement(const char *path, const char *search, const char *replace) {
-    if (strlen(search) == 0)
-        return 0;
-    const char *pos = strstr(path, search);
-    if (!pos)
-        return 0;
-    char new_name[MAX_PATH];
-    size_t prefix_len = pos - path;
-    strncpy(new_name, path, prefix_len);
-    new_name[prefix_len] = '\0';
-    strncat(new_name, replace, sizeof(new_name) - strlen(new_name) - 1);
-    strncat(new_name, pos + strlen(search), sizeof(new_name) - strlen(new_name) - 1);
-    if (!MoveFile(path, new_name)) {
-        printf("エラー: %s の置換に失敗しました。\n", path);
-        return -1;
+// 分類済みのタスクの所要時間を見積もる
+double task_estimate_seconds(const Profile *p, const CopyTask *task, const unsigned char *classes,
+                             const char *src, const char *dest, int *calibrated) {
+    unsigned long long files[2][SIZE_CLASSES], bytes[2][SIZE_CLASSES];
+    const Manifest *m = &task->manifest;
+    memset(files, 0, sizeof(files));
+    memset(bytes, 0, sizeof(bytes));
+    for (size_t i = 0; i < m->file_count; i++) {
+        int copied = classes[i] != PLAN_IDENTICAL && classes[i] != PLAN_TOO_LONG;
+        int c = size_class(m->files[i].size);
+        files[copied][c]++;
+        bytes[copied][c] += m->files[i].size;
     }
-    printf("置換により、名前を %s に変更しました。\n", new_name);
-    log_message("名前変更: %s -> %s\n", path, new_name);
-    return 0;
+    double seconds = 0;
+    for (int copied = 0; copied < 2; copied++)
+        for (int c = 0; c < SIZE_CLASSES; c++)
+            seconds += profile_estimate(p, src, dest, copied, c, files[copied][c], bytes[copied][c], calibrated);
+    return seconds;
 }
 
-// ----- コピー・削除処理 -----
-// ファイルの場合：
-//   - 宛先が存在し、内容が同一なら、
-//       g_deleteSource 有効ならコピーせずソース削除、無効なら保持。
-//   - 宛先が存在し、内容が異なるなら、
-//       g_deleteSource 有効なら "_copy" 付加でコピー＆削除、無効ならコピーのみ。
-//   - 宛先が存在しなければ通常コピーし、g_deleteSource に応じて削除または保持。
-// ※ オプションが "d" でなければ、ファイル名置換処理を実施する。
-int copy_or_delete_file(const char *src, const char *dest, const char *search, const char *replace) {
-    if (GetFileAttributes(dest) != INVALID_FILE_ATTRIBUTES) {
-        if (files_are_identical(src, dest)) {
-            if (g_deleteSource) {
-                if (DeleteFile(src)) {
-                    printf("\n[同一ファイル] %s -> %s : コピーせずソース削除\n", src, dest);
-                    log_message("%s -> %s: 同一ファイル、ソース削除\n", src, dest);
-                    if (strcmp(search, "d") != 0)
-                        rename_file_by_replacement(dest, search, replace);
-                    return 0;
-                } else {
-                    printf("\nエラー: %s の削除に失敗しました。\n", src);
-                    log_message("%s -> %s: 削除失敗\n", src, dest);
-                    return -1;
-                }
-            } else {
-                printf("\n[同一ファイル] %s と %s は同一。ソース保持\n", src, dest);
-                log_message("%s -> %s: 同一ファイル、ソース保持\n", src, dest);
-                return 0;
-            }
-        } else {
-            char new_dest[MAX_PATH];
-            generate_new_filename(dest, new_dest, sizeof(new_dest));
-            if (!CopyFile(src, new_dest, FALSE)) {
-                printf("\nエラー: %s を %s にコピーできませんでした。\n", src, new_dest);
-                log_message("%s -> %s: コピー失敗\n", src, new_dest);
-                return -1;
+// ----- ファイルの分類 -----
+typedef struct _PlanKey {
+    unsigned long long size;
+    long long mtime;
+} PlanKey;
+
+static int plan_key_compare(const void *a, const void *b) {
+    const PlanKey *x = (const PlanKey*)a, *y = (const PlanKey*)b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+// タスクのファイルをコピー先の現在の状態と比べて classes に分類する（中身は読まない）。
+// 比較モードが full / sample でも、サイズと更新日時が一致すれば同一に数える（実行時に中身を比較する）。
+void plan_classify(CopyTask *task, unsigned char *classes) {
+    Manifest *m = &task->manifest;
+    if (task->archive) {
+        memset(classes, PLAN_NEW, m->file_count);   // アーカイブは毎回すべてを書き込む
+        return;
+    }
+    plan_folder_names(task);
+    DestIndex index;
+    memset(&index, 0, sizeof(index));
+    mutex_init(&index.lock);
+    index.enabled = g_settings.content_index;
+    PlanKey *keys = NULL;
+    size_t key_count = 0;
+    if (index.enabled) {
+        char path[MAX_PATH];
+        dest_index_file_path(task->dest, path, sizeof(path));
+        dest_index_load(&index, path);
+        if (index.trusted && index.used > 0) {
+            keys = (PlanKey*)malloc(index.used * sizeof(PlanKey));
+            if (!keys) {
+                printf("エラー: メモリ確保に失敗しました。\n");
+                exit(1);
             }
-            if (g_deleteSource) {
-                if (!DeleteFile(src)) {
-                    printf("\nエラー: %s の削除に失敗しました。\n", src);
-                    log_message("%s -> %s: 削除失敗\n", src, new_dest);
-                    return -1;
+            for (size_t i = 0; i < index.capacity; i++) {
+                const IndexEntry *e = &index.slots[i];
+                if (e->path && !e->removed && e->size > 0) {
+                    keys[key_count].size = e->size;
+                    keys[key_count].mtime = e->mtime;
+                    key_count++;
                 }
             }
-            printf("\n[異なるファイル] %s を %s としてコピー%s\n", src, new_dest, g_deleteSource ? "、ソース削除" : "（ソース保持）");
-            log_message("%s -> %s: 異なるファイル、%s\n", src, new_dest, g_deleteSource ? "ソース削除" : "ソース保持");
-            if (strcmp(search, "d") != 0)
-                rename_file_by_replacement(new_dest, search, replace);
-            return 0;
-        }
-    } else {
-        if (!CopyFile(src, dest, FALSE)) {
-            printf("\nエラー: %s を %s にコピーできませんでした。\n", src, dest);
-            log_message("%s -> %s: コピー失敗\n", src, dest);
-            return -1;
+            qsort(keys, key_count, sizeof(PlanKey), plan_key_compare);
         }
-        if (g_deleteSource) {
-            if (!DeleteFile(src)) {
-                printf("\nエラー: %s の削除に失敗しました。\n", src);
-                log_message("%s -> %s: 削除失敗\n", src, dest);
-                return -1;
-            }
-            printf("\n[新規コピー] %s を %s にコピー、ソース削除\n", src, dest);
-            log_message("%s -> %s: 新規コピー、ソース削除\n", src, dest);
+    }
+    for (size_t i = 0; i < m->file_count; i++) {
+        const ManifestEntry *e = &m->files[i];
+        char dest[MAX_PATH];
+        FileInfo info;
+        if (!task_dest_file_path(task, i, dest, sizeof(dest))) {
+            classes[i] = PLAN_TOO_LONG;
+        } else if (get_file_info(dest, &info)) {
+            int identical = dest_index_matches(&index, dest_relative(task, dest), e->size, e->mtime, &info) ||
+                            (info.size == e->size && info.mtime == e->mtime);
+            classes[i] = identical ? PLAN_IDENTICAL : PLAN_DIFFERENT;
         } else {
-            printf("\n[新規コピー] %s を %s にコピー、ソース保持\n", src, dest);
-            log_message("%s -> %s: 新規コピー、ソース保持\n", src, dest);
+            PlanKey key = { e->size, e->mtime };
+            classes[i] = key_count && bsearch(&key, keys, key_count, sizeof(PlanKey), plan_key_compare)
+                       ? PLAN_RENAMED : PLAN_NEW;
         }
-        if (strcmp(search, "d") != 0)
-            rename_file_by_replacement(dest, search, replace);
-        return 0;
     }
+    free(keys);
+    dest_index_close(&index);
 }
 
-// ----- 再帰的コピー処理 -----
-// src の内容を dest に再帰的にコピーする。
-// 引数 search, replace はファイル名置換用。
-// level: 階層（0=コピー元フォルダ自体、1=直下の項目、2以上=それ以降）。
-// folder_option: 1 の場合、コピー元フォルダ直下のフォルダ名に対して置換処理を適用する。
-int copy_folder_recursive(const char *src, const char *dest, unsigned long long total_size, const char *search, const char *replace, int level, int folder_option) {
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind;
-    char searchPath[MAX_PATH];
-    unsigned long long copied_size = 0;
-    
-    snprintf(searchPath, sizeof(searchPath), "%s\\*", src);
-    hFind = FindFirstFile(searchPath, &findFileData);
-    if (hFind == INVALID_HANDLE_VALUE)
-        return -1;
-    
-    // コピー先フォルダが存在しなければ再帰的に作成
-    create_directory_recursive(dest);
-    
-    do {
-        if (strcmp(findFileData.cFileName, ".") == 0 ||
-            strcmp(findFileData.cFileName, "..") == 0)
+// ----- 実行計画ファイル -----
+// 計画を書き出す（成功で非0）
+static int plan_write(const char *path, CopyTask *tasks, unsigned char **classes, const unsigned long long *space,
+                      const double *seconds, const int *admitted, int task_count) {
+    char tmp_path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return 0;
+    fprintf(fp, "%s\ncreated\t%lld\ndelete\t%d\n", PLAN_HEADER, (long long)time(NULL), g_deleteSource);
+    for (int t = 0; t < task_count; t++) {
+        if (!admitted[t])
             continue;
-        char srcPath[MAX_PATH], destPath[MAX_PATH];
-        snprintf(srcPath, sizeof(srcPath), "%s\\%s", src, findFileData.cFileName);
-        snprintf(destPath, sizeof(destPath), "%s\\%s", dest, findFileData.cFileName);
-        
-        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            copy_folder_recursive(srcPath, destPath, total_size, search, replace, level + 1, folder_option);
-            if (level == 0 && folder_option == 1)
-                rename_file_by_replacement(destPath, search, replace);
-            if (g_deleteSource) {
-                if (!RemoveDirectory(srcPath))
-                    printf("エラー: ディレクトリ %s の削除に失敗しました。\n", srcPath);
-                else
-                    printf("\n[フォルダ削除] %s を削除しました。\n", srcPath);
-            }
-        } else {
-            if (copy_or_delete_file(srcPath, destPath, search, replace) == 0) {
-                copied_size += (((unsigned long long)findFileData.nFileSizeHigh << 32) | findFileData.nFileSizeLow);
-                printf("\r進捗: %.2f%%", (double)copied_size / total_size * 100);
-                fflush(stdout);
-            }
+        const Manifest *m = &tasks[t].manifest;
+        fprintf(fp, "task\t%llu\t%.3f\t%s\ndest\t%s\n", space[t], seconds[t], tasks[t].src, tasks[t].dest);
+        for (size_t i = 1; i < m->dir_count; i++) {
+            const ManifestDir *d = &m->dirs[i];
+            fprintf(fp, "d\t%u\t%lld\t%d\t%s\n", d->parent, d->mtime, d->scan_failed, d->name);
+        }
+        for (size_t i = 0; i < m->file_count; i++) {
+            const ManifestEntry *e = &m->files[i];
+            fprintf(fp, "f\t%u\t%llu\t%lld\t%llu\t%c\t%s\n", e->dir, e->size, e->mtime, e->ino,
+                    g_planClassCodes[classes[t][i]], e->name);
         }
-    } while (FindNextFile(hFind, &findFileData) != 0);
-    
-    FindClose(hFind);
-    if (g_deleteSource) {
-        if (!RemoveDirectory(src))
-            printf("\nエラー: ソースフォルダ %s の削除に失敗しました。\n", src);
-        else
-            printf("\n[フォルダ削除] ソースフォルダ %s を削除しました。\n", src);
     }
-    return 0;
+    fprintf(fp, "END\n");
+    if (fclose(fp) != 0 || !replace_file(tmp_path, path)) {
+        delete_file(tmp_path);
+        return 0;
+    }
+    return 1;
 }
 
-// ----- 履歴読み込み -----
-// history.txt の各行は
-// "コピー元, コピー先, 置換前文字列, 置換後文字列, オプション"
-// の形式で記述（オプションが "d" ならコピー元直下のフォルダ名に対して置換処理を適用）
-int load_history(char src_list[MAX_ENTRIES][MAX_PATH], char dest_list[MAX_ENTRIES][MAX_PATH],
-                 char replace_from[MAX_ENTRIES][MAX_REPLACE_LEN], char replace_to[MAX_ENTRIES][MAX_REPLACE_LEN],
-                 char rep_option[MAX_ENTRIES][MAX_REPLACE_LEN]) {
-    FILE *file = fopen(HISTORY_FILE, "r");
-    if (!file)
+void plan_free(ExecutionPlan *plan) {
+    for (size_t i = 0; i < plan->count; i++)
+        manifest_free(&plan->tasks[i].manifest);
+    free(plan->tasks);
+    arena_free(&plan->arena);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// 計画を読み込む（成功で非0。形式が正しくない、または途中で切れた計画は使わない）
+int plan_load(ExecutionPlan *plan, const char *path) {
+    memset(plan, 0, sizeof(*plan));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("エラー: 実行計画 %s を開けません。\n", path);
         return 0;
-    int count = 0;
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = '\0';
-        char *token = strtok(line, ",");
-        if (token == NULL) continue;
-        strncpy(src_list[count], token, MAX_PATH);
-        src_list[count][MAX_PATH - 1] = '\0';
-        trim(src_list[count]);
-        
-        token = strtok(NULL, ",");
-        if (token == NULL) continue;
-        strncpy(dest_list[count], token, MAX_PATH);
-        dest_list[count][MAX_PATH - 1] = '\0';
-        trim(dest_list[count]);
-        
-        token = strtok(NULL, ",");
-        if (token != NULL) {
-            strncpy(replace_from[count], token, MAX_REPLACE_LEN);
-            replace_from[count][MAX_REPLACE_LEN - 1] = '\0';
-            trim(replace_from[count]);
-        } else {
-            replace_from[count][0] = '\0';
-        }
-        
-        token = strtok(NULL, ",");
-        if (token != NULL) {
-            strncpy(replace_to[count], token, MAX_REPLACE_LEN);
-            replace_to[count][MAX_REPLACE_LEN - 1] = '\0';
-            trim(replace_to[count]);
-        } else {
-            replace_to[count][0] = '\0';
-        }
-        
-        token = strtok(NULL, ",");
-        if (token != NULL) {
-            strncpy(rep_option[count], token, MAX_REPLACE_LEN);
-            rep_option[count][MAX_REPLACE_LEN - 1] = '\0';
-            trim(rep_option[count]);
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned int line_no = 1;
+    PlanTask *task = NULL;
+    int valid = history_read_line(fp, &line, &capacity) && strcmp(line, PLAN_HEADER) == 0;
+    int ended = 0;
+    while (valid && !ended && history_read_line(fp, &line, &capacity)) {
+        line_no++;
+        int consumed = 0;
+        if (strcmp(line, "END") == 0) {
+            ended = 1;
+        } else if (strncmp(line, "created\t", 8) == 0) {
+            plan->created = atoll(line + 8);
+        } else if (strncmp(line, "delete\t", 7) == 0) {
+            plan->delete_source = atoi(line + 7);
+        } else if (strncmp(line, "task\t", 5) == 0) {
+            if (plan->count == plan->capacity)
+                plan->tasks = (PlanTask*)grow_array(plan->tasks, &plan->capacity, sizeof(PlanTask));
+            task = &plan->tasks[plan->count++];
+            memset(task, 0, sizeof(*task));
+            manifest_init(&task->manifest);
+            valid = sscanf(line + 5, "%llu\t%lf\t%n", &task->space, &task->seconds, &consumed) == 2 && consumed > 0;
+            task->src = arena_strdup(&plan->arena, line + 5 + consumed);
+            task->dest = "";
+        } else if (task && strncmp(line, "dest\t", 5) == 0) {
+            task->dest = arena_strdup(&plan->arena, line + 5);
+        } else if (task && line[0] == 'd' && line[1] == '\t') {
+            unsigned int parent;
+            long long mtime;
+            int failed;
+            valid = sscanf(line + 2, "%u\t%lld\t%d\t%n", &parent, &mtime, &failed, &consumed) == 3 && consumed > 0 &&
+                    parent < task->manifest.dir_count;
+            if (valid) {
+                unsigned int dir = manifest_add_dir(&task->manifest, parent, line + 2 + consumed, mtime);
+                task->manifest.dirs[dir].scan_failed = failed;
+            }
+        } else if (task && line[0] == 'f' && line[1] == '\t') {
+            unsigned int dir;
+            unsigned long long size, ino;
+            long long mtime;
+            char kind;
+            valid = sscanf(line + 2, "%u\t%llu\t%lld\t%llu\t%c\t%n", &dir, &size, &mtime, &ino, &kind, &consumed) == 5 &&
+                    consumed > 0 && dir < task->manifest.dir_count;
+            if (valid) {
+                DirEntry entry = { line + 2 + consumed, 0, size, (time_t)mtime, ino };
+                manifest_add_file(&task->manifest, dir, &entry);
+            }
         } else {
-            rep_option[count][0] = '\0';
+            valid = 0;
         }
-        
-        count++;
-        if (count >= MAX_ENTRIES)
-            break;
     }
-    fclose(file);
-    return count;
+    free(line);
+    fclose(fp);
+    if (!valid || !ended) {
+        printf("エラー: 実行計画 %s の %u 行目が正しくないか、計画が途中で切れています。\n", path, line_no);
+        plan_free(plan);
+        return 0;
+    }
+    return 1;
 }
 
-// ----- スレッド関数 -----
-// 各コピータスクをスレッドで実行する関数
-DWORD WINAPI CopyThreadFunc(LPVOID lpParam) {
-    CopyTask *task = (CopyTask*)lpParam;
-    time_t startTime = time(NULL);
-    printf("\n[タスク %d] コピー開始: %s -> %s\n", task->task_id, task->src, task->dest);
-    log_message("[タスク %d] コピー開始: %s -> %s, 開始時刻: %s", task->task_id, task->src, task->dest, ctime(&startTime));
-    int folder_option = (strcmp(task->replace_option, "d") == 0) ? 1 : 0;
-    copy_folder_recursive(task->src, task->dest, task->folder_size, task->replace_from, task->replace_to, 0, folder_option);
-    time_t endTime = time(NULL);
-    printf("\n[タスク %d] コピー完了！\n", task->task_id);
-    log_message("[タスク %d] コピー完了: %s -> %s, 終了時刻: %s\n", task->task_id, task->src, task->dest, ctime(&endTime));
-    return 0;
+// コピー元・コピー先が一致する計画のタスク（無ければ NULL）
+PlanTask *plan_find(ExecutionPlan *plan, const char *src, const char *dest) {
+    for (size_t i = 0; i < plan->count; i++)
+        if (!plan->tasks[i].used && strcmp(plan->tasks[i].src, src) == 0 && strcmp(plan->tasks[i].dest, dest) == 0)
+            return &plan->tasks[i];
+    return NULL;
 }
 
-// ----- 実行日時待機処理 -----
-// schedule.txt に "YYYY-MM-DD HH:MM:SS" 形式で指定された日時まで、
-// 日、時間、分、秒で残り時間をリアルタイムに表示しながら待機する。
-void wait_until_scheduled_time() {
-    FILE *fp = fopen(SCHEDULE_FILE, "r");
-    if (fp) {
-        char scheduleStr[64];
-        if (fgets(scheduleStr, sizeof(scheduleStr), fp)) {
-            scheduleStr[strcspn(scheduleStr, "\n")] = '\0';
-            struct tm tmSchedule = {0};
-            if (sscanf(scheduleStr, "%d-%d-%d %d:%d:%d",
-                       &tmSchedule.tm_year, &tmSchedule.tm_mon, &tmSchedule.tm_mday,
-                       &tmSchedule.tm_hour, &tmSchedule.tm_min, &tmSchedule.tm_sec) == 6) {
-                tmSchedule.tm_year -= 1900;
-                tmSchedule.tm_mon -= 1;
-                time_t scheduledTime = mktime(&tmSchedule);
-                time_t now;
-                while ((now = time(NULL)) < scheduledTime) {
-                    int remaining = (int)(scheduledTime - now);
-                    int days = remaining / (24 * 3600);
-                    int hours = (remaining % (24 * 3600)) / 3600;
-                    int minutes = (remaining % 3600) / 60;
-                    int seconds = remaining % 60;
-                    printf("\r残り時間: %d日 %d時間 %d分 %d秒  ", days, hours, minutes, seconds);
-                    fflush(stdout);
-                    Sleep(1000);
-                }
-                printf("\n指定時刻になりました。\n");
-            }
+// ----- 計画の作成 -----
+static void plan_usage(void) {
+    printf("使い方: AutoFileMoveMaster --plan [オプション]\n"
+           "  --delete      コピー完了後にコピー元を削除する前提で計画する\n"
+           "  --out ファイル  実行計画の出力先（既定 %s）\n"
+           "作成した計画は AutoFileMoveMaster --run-plan [ファイル] で実行します。\n", PLAN_FILE);
+}
+
+int run_plan(int argc, char *argv[]) {
+    const char *out_path = PLAN_FILE;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--delete") == 0) {
+            g_deleteSource = 1;
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            plan_usage();
+            return 1;
         }
-        fclose(fp);
     }
+    History history;
+    load_history(&history);
+    int task_count = (int)history.count;
+    if (task_count == 0) {
+        printf("履歴が見つかりませんでした。\n");
+        history_free(&history);
+        return 1;
+    }
+    Profile profile;
+    profile_load(&profile);
+    VolumeTable *volumes = (VolumeTable*)calloc(1, sizeof(VolumeTable));
+    CopyTask *tasks = (CopyTask*)calloc(task_count, sizeof(CopyTask));
+    unsigned char **classes = (unsigned char**)calloc(task_count, sizeof(unsigned char*));
+    unsigned long long *space = (unsigned long long*)calloc(task_count, sizeof(unsigned long long));
+    double *seconds = (double*)calloc(task_count, sizeof(double));
+    int *admitted = (int*)calloc(task_count, sizeof(int));
+    if (!volumes || !tasks || !classes || !space || !seconds || !admitted) {
+        printf("エラー: メモリ確保に失敗しました。\n");
+        exit(1);
+    }
+    char size_buf[64], free_buf[64], time_buf[32];
+    int planned = 0, uncalibrated = 0;
+    for (int t = 0; t < task_count; t++) {
+        const HistoryEntry *entry = &history.entries[t];
+        CopyTask *task = &tasks[t];
+        task->src = entry->src;
+        task->dest = entry->dest;
+        task->task_id = t + 1;
+        task->rules = entry->rules;
+        task->compare_mode = entry->compare_mode;
+        task->copy_order = entry->copy_order;
+        task->archive = is_archive_path(entry->dest);
+        printf("\n[%d] コピー元: %s\n[%d] コピー先: %s\n", t + 1, task->src, t + 1, task->dest);
+        if (!manifest_build(&task->manifest, task->src)) {
+            printf("エラー: コピー元フォルダを読み込めません。このタスクは計画から外します。\n");
+            continue;
+        }
+        const Manifest *m = &task->manifest;
+        classes[t] = (unsigned char*)malloc(m->file_count ? m->file_count : 1);
+        if (!classes[t]) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            exit(1);
+        }
+        plan_classify(task, classes[t]);
+        unsigned long long counts[PLAN_CLASSES] = { 0 }, bytes[PLAN_CLASSES] = { 0 };
+        for (size_t i = 0; i < m->file_count; i++) {
+            counts[classes[t][i]]++;
+            bytes[classes[t][i]] += m->files[i].size;
+        }
+        for (int c = 0; c < PLAN_CLASSES; c++)
+            printf("%s%s %llu 件 (%s)", c ? ", " : "", g_planClassNames[c], counts[c],
+                   format_size(bytes[c], size_buf, sizeof(size_buf)));
+        printf("\n");
+
+        // 必要容量：同一ボリューム内の移動はコピー先の容量を使わない
+        char root_buf[MAX_PATH], existing_buf[MAX_PATH];
+        const char *dest_root = dest_root_path(task->dest, root_buf, sizeof(root_buf));
+        const char *existing = existing_parent(dest_root, existing_buf, sizeof(existing_buf));
+        Volume *volume = volume_for_path(volumes, dest_root);
+        unsigned long long block = volume ? volume->block_size : get_block_size(existing);
+        int moves = !task->archive && g_deleteSource && same_volume(task->src, existing);
+        space[t] = moves ? 0 : manifest_required_space(m, classes[t], task->archive, block);
+
+        // 所要時間：コピー元・コピー先のデバイスごとの記録から見積もる
+        const Device *src_device = device_for_path(task->src);
+        const Device *dest_device = device_for_path(existing);
+        const char *src_name, *dest_name;
+        profile_device_names(src_device, dest_device == src_device ? NULL : dest_device, &src_name, &dest_name);
+        int calibrated = 1;
+        seconds[t] = task_estimate_seconds(&profile, task, classes[t], src_name, dest_name, &calibrated);
+        printf("必要容量: %s（割り当て単位 %llu B）, 推定所要時間: %s%s\n",
+               format_size(space[t], size_buf, sizeof(size_buf)), block,
+               format_eta((unsigned long long)seconds[t], 1.0, time_buf, sizeof(time_buf)),
+               calibrated ? "" : "（記録のないサイズ区分は既定の速度で推定）");
+        uncalibrated |= !calibrated;
+
+        admitted[t] = volume ? volume_reserve(volume, space[t]) : space[t] <= get_free_space(existing);
+        if (!admitted[t]) {
+            printf("エラー: 同じボリュームの他のタスクと合わせると空き容量が不足します。このタスクは計画から外します。\n");
+            continue;
+        }
+        if (volume)
+            volume->seconds += seconds[t];
+        planned++;
+    }
+
+    // ボリュームごとの予約と、実行全体の所要時間（別のボリュームへのタスクは並行して進むとみなす）
+    double total_seconds = 0;
+    printf("\n----- 実行計画 -----\n");
+    for (int v = 0; v < volumes->count; v++) {
+        const Volume *volume = &volumes->items[v];
+        printf("ボリューム %s: 空き %s, 予約 %s, 推定 %s\n", volume->path,
+               format_size(volume->free_space, free_buf, sizeof(free_buf)),
+               format_size(volume->reserved, size_buf, sizeof(size_buf)),
+               format_eta((unsigned long long)volume->seconds, 1.0, time_buf, sizeof(time_buf)));
+        if (volume->seconds > total_seconds)
+            total_seconds = volume->seconds;
+    }
+    printf("計画に含めたタスク: %d / %d, 推定所要時間: %s%s\n", planned, task_count,
+           format_eta((unsigned long long)total_seconds, 1.0, time_buf, sizeof(time_buf)),
+           uncalibrated ? "（一部は既定の速度で推定。実行するたびに記録して精度が上がります）" : "");
+    int status = 0;
+    if (!plan_write(out_path, tasks, classes, space, seconds, admitted, task_count)) {
+        printf("エラー: 実行計画 %s を書き出せません。\n", out_path);
+        status = 1;
+    } else {
+        printf("実行計画を %s に書き出しました。AutoFileMoveMaster --run-plan %s で実行します。\n", out_path, out_path);
+    }
+    for (int t = 0; t < task_count; t++) {
+        manifest_free(&tasks[t].manifest);
+        free(classes[t]);
+    }
+    free(tasks);
+    free(classes);
+    free(space);
+    free(seconds);
+    free(admitted);
+    free(volumes);
+    profile_free(&profile);
+    history_free(&history);
+    return status;
 }
 
 // ----- メイン関数 -----
@@ -456,121 +8673,342 @@ void wait_until_scheduled_time() {
 // 3. 指定日時まで待機（残り時間をリアルタイム表示）
 // 4. 指定時刻になったらタスク実行
 // 5. 終了
-int main() {
+int main(int argc, char *argv[]) {
+#ifdef _WIN32
     // コンソール出力コードページをUTF-8に設定
     SetConsoleOutputCP(CP_UTF8);
+#endif
     
     // ログ用ミューテックス作成
-    g_logMutex = CreateMutex(NULL, FALSE, NULL);
+    mutex_init(&g_logMutex);
+    mutex_init(&g_deviceLock);
+    mutex_init(&g_knownDirs.lock);
+    mutex_init(&g_dedup.lock);
+    mutex_init(&g_indexLock);
+    
+    // 動作設定の読み込み
+    load_settings();
+    
+    // ベンチマークモード（対話や history.txt を使わずに計測だけを行う）
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        int status = run_benchmark(argc - 2, argv + 2);
+        logger_shutdown();
+        mutex_destroy(&g_logMutex);
+        return status;
+    }
+    
+    // アーカイブの展開（コピー先に ".tar" を指定したタスクで作成したもの）
+    if (argc > 1 && strcmp(argv[1], "--unpack") == 0) {
+        int status = run_unpack(argc - 2, argv + 2);
+        logger_shutdown();
+        mutex_destroy(&g_logMutex);
+        return status;
+    }
+    
+    // 実行計画の作成（列挙と見積もりだけを行い、データは移さない）
+    if (argc > 1 && strcmp(argv[1], "--plan") == 0) {
+        int status = run_plan(argc - 2, argv + 2);
+        logger_shutdown();
+        mutex_destroy(&g_logMutex);
+        return status;
+    }
     
-    // ① コピー完了後にコピー元の削除確認
+    // 実行計画の実行（計画の一覧を使い、コピー元を列挙し直さない）
+    ExecutionPlan plan;
+    int use_plan = argc > 1 && strcmp(argv[1], "--run-plan") == 0;
+    const char *plan_path = argc > 2 ? argv[2] : PLAN_FILE;
+    if (use_plan && !plan_load(&plan, plan_path))
+        return 1;
+    
+    // ログ書き込みスレッドの開始
+    logger_start();
+    
+    // ① コピー完了後にコピー元の削除確認（実行計画では計画作成時の指定に従う）
     char user_choice;
-    printf("コピー完了後にコピー元のフォルダ/ファイルを削除しますか？ (Y/N): ");
-    scanf(" %c", &user_choice);
-    g_deleteSource = (user_choice == 'Y' || user_choice == 'y') ? 1 : 0;
+    if (use_plan) {
+        char created_buf[64];
+        g_deleteSource = plan.delete_source;
+        printf("実行計画 %s を実行します（コピー元の削除: %s）。計画の作成時刻: %s", plan_path,
+               g_deleteSource ? "する" : "しない", format_time((time_t)plan.created, created_buf, sizeof(created_buf)));
+    } else {
+        printf("コピー完了後にコピー元のフォルダ/ファイルを削除しますか？ (Y/N): ");
+        scanf(" %c", &user_choice);
+        g_deleteSource = (user_choice == 'Y' || user_choice == 'y') ? 1 : 0;
+    }
     
-    // ② 一斉実行か個別確認かの選択
-    printf("すべてのタスクを一斉に開始しますか？ (Y: 一斉実行 / N: 個別確認): ");
-    scanf(" %c", &user_choice);
-    int all_mode = (user_choice == 'Y' || user_choice == 'y') ? 1 : 0;
+    // ② 一斉実行か個別確認かの選択（監視モードでは常にすべてを監視し、実行計画は一斉に実行する）
+    int all_mode = 1;
+    if (!g_settings.watch && !use_plan) {
+        printf("すべてのタスクを一斉に開始しますか？ (Y: 一斉実行 / N: 個別確認): ");
+        scanf(" %c", &user_choice);
+        all_mode = (user_choice == 'Y' || user_choice == 'y') ? 1 : 0;
+    }
     
     // ③ 指定日時まで待機（残り時間をリアルタイムに表示）
     wait_until_scheduled_time();
     
     // グローバル開始時刻のログ
     time_t globalStart = time(NULL);
-    log_message("=== 実行開始時刻: %s", ctime(&globalStart));
+    char time_buf[64];
+    log_message("=== 実行開始時刻: %s", format_time(globalStart, time_buf, sizeof(time_buf)));
     
-    char src_list[MAX_ENTRIES][MAX_PATH], dest_list[MAX_ENTRIES][MAX_PATH];
-    char replace_from[MAX_ENTRIES][MAX_REPLACE_LEN], replace_to[MAX_ENTRIES][MAX_REPLACE_LEN];
-    char rep_option[MAX_ENTRIES][MAX_REPLACE_LEN];
-    int history_count = load_history(src_list, dest_list, replace_from, replace_to, rep_option);
+    // 履歴の読み込み（名前置換の規則もここで一度だけ作る）
+    History history;
+    load_history(&history);
+    int history_count = (int)history.count;
+    const HistoryEntry *entries = history.entries;
     
     char src_size_buf[64], dest_size_buf[64];  // サイズ表示用のバッファ（別々）
     
     if (history_count == 0) {
         printf("履歴が見つかりませんでした。\n");
+        history_free(&history);
+        return 0;
+    }
+    
+    // 以前の実行で記録した転送速度（実行後に今回の計測値を加えて保存する）
+    Profile profile;
+    profile_load(&profile);
+    
+    // ワーカープールの開始（スレッド数は設定値、未指定ならCPUコア数）
+    int worker_count = g_settings.worker_threads > 0 ? g_settings.worker_threads : cpu_count();
+    if (!pool_start(&g_pool, worker_count)) {
+        printf("エラー: ワーカースレッドを作成できませんでした。\n");
+        return 1;
+    }
+    
+    // 監視モード：終了するまで、届いたファイルを少しずつ処理する
+    if (g_settings.watch && !use_plan) {
+        WatchRoot *roots = (WatchRoot*)calloc(history_count, sizeof(WatchRoot));
+        if (!roots) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            return 1;
+        }
+        int root_count = 0;
+        for (int i = 0; i < history_count; i++) {
+            if (is_archive_path(entries[i].dest)) {
+                printf("警告: 監視モードではアーカイブ（%s）に書き込めません。この行はスキップします。\n", entries[i].dest);
+                continue;
+            }
+            roots[root_count].src = entries[i].src;
+            roots[root_count].dest = entries[i].dest;
+            roots[root_count].rules = entries[i].rules;
+            roots[root_count].compare_mode = entries[i].compare_mode;
+            roots[root_count].copy_order = entries[i].copy_order;
+            root_count++;
+        }
+        run_watch(&g_pool, roots, root_count);
+        free(roots);
+        history_free(&history);
+        time_t watchEnd = time(NULL);
+        log_message("=== 実行終了時刻: %s\n", format_time(watchEnd, time_buf, sizeof(time_buf)));
+        pool_stop(&g_pool);
+        logger_shutdown();
+        mutex_destroy(&g_logMutex);
         return 0;
     }
     
+    // 進捗表示（監視モードでは使わない）
+    progress_start();
+    
+    // 計測レポートの作成
+    TelemetryReport report;
+    telemetry_report_open(&report, g_pool.worker_count);
+    
     if (all_mode) {
-        CopyTask tasks[MAX_ENTRIES];
+        CopyTask *tasks = (CopyTask*)calloc(history_count, sizeof(CopyTask));
+        VolumeTable *volumes = (VolumeTable*)calloc(1, sizeof(VolumeTable));
+        if (!tasks || !volumes) {
+            printf("エラー: メモリ確保に失敗しました。\n");
+            return 1;
+        }
         int task_count = 0;
         for (int i = 0; i < history_count; i++) {
-            create_directory_recursive(dest_list[i]);
-            unsigned long long folder_size = get_folder_size(src_list[i]);
-            unsigned long long free_space = get_free_space(dest_list[i]);
+            PlanTask *planned = use_plan ? plan_find(&plan, entries[i].src, entries[i].dest) : NULL;
+            if (use_plan && !planned) {
+                printf("\n[%d] %s -> %s は実行計画に含まれないためスキップします。\n", i + 1, entries[i].src, entries[i].dest);
+                continue;
+            }
+            char root_buf[MAX_PATH];
+            const char *dest_root = dest_root_path(entries[i].dest, root_buf, sizeof(root_buf));
+            create_directory_recursive(dest_root);
+            // コピー元の列挙は1回だけ行い、以降の処理はこの一覧を使う（実行計画では計画の一覧を使う）
+            memset(&tasks[task_count], 0, sizeof(CopyTask));
+            Manifest *manifest = &tasks[task_count].manifest;
+            double scan_start = monotonic_seconds();
+            int scanned = 1;
+            if (planned) {
+                *manifest = planned->manifest;
+                memset(&planned->manifest, 0, sizeof(Manifest));
+                planned->used = 1;
+            } else {
+                scanned = manifest_build(manifest, entries[i].src);
+            }
+            unsigned long long folder_size = manifest->total_size;
+            unsigned long long free_space = get_free_space(dest_root);
             
-            printf("\n[%d] コピー元: %s\n", i + 1, src_list[i]);
-            printf("[%d] コピー先: %s\n", i + 1, dest_list[i]);
+            printf("\n[%d] コピー元: %s\n", i + 1, entries[i].src);
+            printf("[%d] コピー先: %s\n", i + 1, entries[i].dest);
+            if (!scanned) {
+                printf("エラー: コピー元フォルダを読み込めません。このタスクはスキップします。\n");
+                manifest_free(manifest);
+                continue;
+            }
             printf("コピー元サイズ: %s, コピー先空き容量: %s\n",
                    format_size(folder_size, src_size_buf, sizeof(src_size_buf)),
                    format_size(free_space, dest_size_buf, sizeof(dest_size_buf)));
+            print_manifest_summary(manifest);
             
-            if (folder_size > free_space) {
-                printf("エラー: 空き容量が不足しています。このタスクはスキップします。\n");
+            // 同じボリュームに書き込むタスクの必要容量を合算して、空き容量に収まるタスクだけを実行する
+            Volume *volume = volume_for_path(volumes, dest_root);
+            int archive = is_archive_path(entries[i].dest);
+            unsigned long long required = planned ? planned->space
+                                        : !archive && g_deleteSource && same_volume(entries[i].src, dest_root) ? 0
+                                        : manifest_required_space(manifest, NULL, archive,
+                                                                  volume ? volume->block_size : get_block_size(dest_root));
+            if (volume ? !volume_reserve(volume, required) : required > free_space) {
+                printf("エラー: 空き容量が不足しています（必要 %s、同じボリュームの他のタスクの分を含めて判定）。"
+                       "このタスクはスキップします。\n", format_size(required, dest_size_buf, sizeof(dest_size_buf)));
+                manifest_free(manifest);
                 continue;
             }
+            if (volume && planned)
+                volume->seconds += planned->seconds;
             
-            strcpy(tasks[task_count].src, src_list[i]);
-            strcpy(tasks[task_count].dest, dest_list[i]);
+            tasks[task_count].src = entries[i].src;
+            tasks[task_count].dest = entries[i].dest;
             tasks[task_count].folder_size = folder_size;
             tasks[task_count].task_id = task_count + 1;
-            strcpy(tasks[task_count].replace_from, replace_from[i]);
-            strcpy(tasks[task_count].replace_to, replace_to[i]);
-            strcpy(tasks[task_count].replace_option, rep_option[i]);
+            tasks[task_count].rules = entries[i].rules;
+            tasks[task_count].compare_mode = entries[i].compare_mode;
+            tasks[task_count].copy_order = entries[i].copy_order;
+            tasks[task_count].archive = is_archive_path(entries[i].dest);
+            telemetry_init(&tasks[task_count], pool_telemetry_slots(&g_pool));
+            task_assign_devices(&tasks[task_count]);
+            stage_record(&tasks[task_count].telemetry[0], STAGE_ENUMERATE, scan_start);
             task_count++;
         }
         
         if (task_count == 0) {
             printf("\n実行するコピータスクはありませんでした。\n");
+            telemetry_report_close(&report);
+            free(tasks);
+            free(volumes);
+            history_free(&history);
+            pool_stop(&g_pool);
             return 0;
         }
         
-        printf("\nすべてのタスクのチェックが完了しました。一斉にコピーを開始します。\n");
-        HANDLE threads[MAX_ENTRIES];
-        for (int i = 0; i < task_count; i++) {
-            threads[i] = CreateThread(NULL, 0, CopyThreadFunc, &tasks[i], 0, NULL);
-            if (threads[i] == NULL) {
-                printf("エラー: タスク %d のスレッド作成に失敗しました。\n", tasks[i].task_id);
-            }
+        dedup_plan(tasks, task_count);
+        printf("\nすべてのタスクのチェックが完了しました。%d 個のワーカーで一斉にコピーを開始します。\n", g_pool.worker_count);
+        double run_start = monotonic_seconds();
+        progress_track(tasks, task_count);
+        for (int i = 0; i < task_count; i++)
+            pool_submit(&g_pool, job_create(JOB_START_TASK, &tasks[i], 0, 0), -1);
+        pool_wait(&g_pool);
+        progress_untrack();
+        if (use_plan) {
+            // 見積もりと実際の所要時間を比べられるように記録する
+            double estimated = 0;
+            for (int v = 0; v < volumes->count; v++)
+                if (volumes->items[v].seconds > estimated)
+                    estimated = volumes->items[v].seconds;
+            console_printf("\n実行計画の推定所要時間: %.0f 秒, 実際: %.0f 秒\n", estimated, monotonic_seconds() - run_start);
+            log_message("実行計画 %s: 推定所要時間 %.1f 秒, 実際 %.1f 秒\n", plan_path, estimated,
+                        monotonic_seconds() - run_start);
         }
-        WaitForMultipleObjects(task_count, threads, TRUE, INFINITE);
         for (int i = 0; i < task_count; i++) {
-            CloseHandle(threads[i]);
+            profile_record(&profile, &tasks[i]);
+            telemetry_report_task(&report, &tasks[i]);
+            manifest_free(&tasks[i].manifest);
+            free(tasks[i].dir_pending);
+            free(tasks[i].dir_moved);
+            free(tasks[i].dedup_group);
+            free(tasks[i].telemetry);
         }
+        free(tasks);
+        free(volumes);
         printf("\nすべてのコピータスクが完了しました！\n");
         
     } else {
         for (int i = 0; i < history_count; i++) {
-            printf("\n[%d] コピー元: %s\n", i + 1, src_list[i]);
-            printf("[%d] コピー先: %s\n", i + 1, dest_list[i]);
+            printf("\n[%d] コピー元: %s\n", i + 1, entries[i].src);
+            printf("[%d] コピー先: %s\n", i + 1, entries[i].dest);
             printf("このコピーを実行しますか？ (Y/N): ");
             scanf(" %c", &user_choice);
             if (user_choice != 'Y' && user_choice != 'y') {
                 printf("このコピーはスキップされました。\n");
                 continue;
             }
-            create_directory_recursive(dest_list[i]);
-            unsigned long long folder_size = get_folder_size(src_list[i]);
-            unsigned long long free_space = get_free_space(dest_list[i]);
+            char root_buf[MAX_PATH];
+            const char *dest_root = dest_root_path(entries[i].dest, root_buf, sizeof(root_buf));
+            create_directory_recursive(dest_root);
+            CopyTask task;
+            memset(&task, 0, sizeof(task));
+            double scan_start = monotonic_seconds();
+            if (!manifest_build(&task.manifest, entries[i].src)) {
+                printf("エラー: コピー元フォルダを読み込めません。このコピーはスキップされます。\n");
+                manifest_free(&task.manifest);
+                continue;
+            }
+            unsigned long long folder_size = task.manifest.total_size;
+            unsigned long long free_space = get_free_space(dest_root);
             printf("コピー元サイズ: %s, コピー先空き容量: %s\n",
                    format_size(folder_size, src_size_buf, sizeof(src_size_buf)),
                    format_size(free_space, dest_size_buf, sizeof(dest_size_buf)));
+            print_manifest_summary(&task.manifest);
             if (folder_size > free_space) {
                 printf("エラー: 空き容量が不足しています。このコピーはスキップされます。\n");
+                manifest_free(&task.manifest);
                 continue;
             }
+            task.src = entries[i].src;
+            task.dest = entries[i].dest;
+            task.folder_size = folder_size;
+            task.task_id = i + 1;
+            task.rules = entries[i].rules;
+            task.compare_mode = entries[i].compare_mode;
+            task.copy_order = entries[i].copy_order;
+            task.archive = is_archive_path(entries[i].dest);
+            dedup_plan(&task, 1);
             printf("コピーを開始します...\n");
-            int folder_option = (strcmp(rep_option[i], "d") == 0) ? 1 : 0;
-            copy_folder_recursive(src_list[i], dest_list[i], folder_size, replace_from[i], replace_to[i], 0, folder_option);
+            telemetry_init(&task, pool_telemetry_slots(&g_pool));
+            task_assign_devices(&task);
+            stage_record(&task.telemetry[0], STAGE_ENUMERATE, scan_start);
+            progress_track(&task, 1);
+            pool_submit(&g_pool, job_create(JOB_START_TASK, &task, 0, 0), -1);
+            pool_wait(&g_pool);
+            progress_untrack();
+            profile_record(&profile, &task);
+            telemetry_report_task(&report, &task);
+            manifest_free(&task.manifest);
+            free(task.dir_pending);
+            free(task.dir_moved);
+            free(task.dedup_group);
+            free(task.telemetry);
             printf("\nコピー完了！\n");
         }
     }
     
+    dedup_finish();
+    telemetry_report_close(&report);
+    profile_save(&profile);
+    profile_free(&profile);
+    if (use_plan) {
+        for (size_t i = 0; i < plan.count; i++)
+            if (!plan.tasks[i].used)
+                printf("警告: 実行計画のタスク %s -> %s は history.txt に無いため実行しませんでした。\n",
+                       plan.tasks[i].src, plan.tasks[i].dest);
+        plan_free(&plan);
+    }
+    history_free(&history);
+    
     time_t globalEnd = time(NULL);
-    log_message("=== 実行終了時刻: %s\n", ctime(&globalEnd));
+    log_message("=== 実行終了時刻: %s\n", format_time(globalEnd, time_buf, sizeof(time_buf)));
     
-    CloseHandle(g_logMutex);
+    pool_stop(&g_pool);
+    progress_shutdown();
+    logger_shutdown();
+    mutex_destroy(&g_logMutex);
     return 0;
 }